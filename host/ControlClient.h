@@ -0,0 +1,79 @@
+#pragma once
+// The host side of the control protocol in multi/Control.h, shared by ledctl (a real port) and loopback
+// (the sketch running in this process): requests from command line words, and replies out of whatever
+// the dress prints, which is log text with the reply frames among it.
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "../multi/Control.h"
+
+// "mode 4", "colour white", "set speed 4000", "query"; false if the words are not a request
+inline bool controlRequest(int argc, const char* const* argv, ControlFrame& frame) {
+  frame.length = 0;
+  if (argc == 2 && !strcmp(argv[0], "mode")) {
+    frame.type = CONTROL_SET_MODE;
+    frame.payload[0] = atoi(argv[1]);
+    frame.length = 1;
+  } else if (argc == 2 && !strcmp(argv[0], "colour")) {
+    frame.type = CONTROL_SET_COLOUR;
+    frame.payload[0] = !strcmp(argv[1], "white");
+    frame.length = 1;
+  } else if (argc == 3 && !strcmp(argv[0], "set")) {
+    size_t name_length = strlen(argv[1]);
+    if (name_length > CONTROL_MAX_PAYLOAD - 4) return false;
+    frame.type = CONTROL_SET_PARAM;
+    frame.setValue(0, (uint32_t)strtol(argv[2], nullptr, 0));
+    memcpy(frame.payload + 4, argv[1], name_length);
+    frame.length = 4 + name_length;
+  } else if (argc == 1 && !strcmp(argv[0], "query")) {
+    frame.type = CONTROL_QUERY;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char* controlStatusName(uint8_t status) {
+  switch (status) {
+    case CONTROL_OK: return "ok";
+    case CONTROL_BAD_LENGTH: return "bad length";
+    case CONTROL_BAD_VALUE: return "bad value";
+    case CONTROL_UNKNOWN_PARAM: return "unknown parameter";
+    case CONTROL_UNKNOWN_TYPE: return "unknown request";
+    default: return "unknown status";
+  }
+}
+
+inline std::string describeReply(const ControlFrame& reply) {
+  char text[128];
+  uint8_t status = reply.length ? reply.payload[0] : 0xFF;
+  if (reply.type == (CONTROL_QUERY | CONTROL_REPLY) && reply.length >= 8) {
+    snprintf(text, sizeof(text), "%s: mode %u of %u, %s, free heap %u", controlStatusName(status), reply.payload[1],
+             reply.payload[3], reply.payload[2] ? "white" : "colour", (unsigned)reply.value(4));
+  } else {
+    snprintf(text, sizeof(text), "%s", controlStatusName(status));
+  }
+  return text;
+}
+
+
+class ReplyReader {
+
+  // Feeds what the dress prints through a ControlParser, keeping the text in between for anyone who wants it.
+
+private:
+  ControlParser parser;
+
+public:
+  std::string text;
+
+  bool feed(uint8_t c, uint32_t now_ms, ControlFrame& reply) {  // true with the reply once one is in
+    if (this->parser.feed(c, now_ms)) {
+      reply = this->parser.frame();
+      return true;
+    }
+    if (!this->parser.tookLast()) this->text += (char)c;
+    return false;
+  }
+};
@@ -0,0 +1,168 @@
+// Bakes the wave modes of the sketches into BakedTables.h, the keyframe tables BakedPattern plays.
+// The sequence is a compare per strip live and chaos does not repeat within a table's 65 s, so those stay live.
+// The patterns are configured exactly as selectActivePattern used to configure them, rendered once per
+// millisecond over a period, and fitted by PatternBaker; see Bake.h.
+//
+//   bake                      write the tables to stdout, and the size and playback error of each to stderr
+//   bake -o ../multi/BakedTables.h
+
+#include "Arduino.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+
+#include "../multi/Patterns.h"
+
+template <int N>
+class WaveKernel {
+
+  // every strip is the same sine oscillator, spread evenly around the cycle; the sketches play the tables
+  // baked from it, so it is only built here
+
+private:
+  Oscillator oscillator;
+  uint32_t phase_offset[N];
+
+public:
+  uint16_t level[N];  // output brightness, 0-65535
+
+  void configure(float frequency, int num_strips) {  // frequency in Hz
+    this->oscillator.setFrequency(frequency);
+    for (int i = 0; i < N; i++) {
+      this->phase_offset[i] = Oscillator::fractionToPhase(float(i) / num_strips);
+      this->level[i] = 0;
+    }
+  }
+
+  void render(uint32_t time_ms) {
+    uint32_t phase = this->oscillator.update(time_ms);
+    for (int i = 0; i < N; i++) {
+      this->level[i] = Oscillator::sine(phase + this->phase_offset[i]);
+    }
+  }
+};
+
+
+template <int N>
+class WavePattern : public Pattern {
+
+  // every strip fades in and out, each a little behind the one before
+
+private:
+  WaveKernel<N> kernel;
+
+public:
+  WavePattern(){};
+
+  WavePattern(LEDStrip ledStripArray[], int num_strips, float frequency, bool is_white) {
+    configure(ledStripArray, num_strips, frequency, is_white);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips, float frequency, bool is_white) {
+    attach(ledStripArray, num_strips, N);
+    this->kernel.configure(frequency, this->num_strips);
+    setStripsWhite(is_white);
+    LOG_DEBUG("Built Wave, is_white %d", is_white);
+  }
+
+  void render(unsigned long time_ms) override {
+    this->kernel.render(time_ms);
+    for (int i = 0; i < num_strips; i++) {
+      this->ledStripArray[i].setLevel(this->kernel.level[i]);
+    }
+  }
+
+  uint32_t nextChangeMs(unsigned long time_ms) override {  // a fade changes every ms
+    return 1;
+  }
+
+  void setIsWhite(bool is_white) override {
+    setStripsWhite(is_white);
+  }
+};
+
+
+#define BAKE_TOLERANCE 64    // fitted segments stay within this many table levels (of 32767) of every sample
+#define BAKE_CAPACITY 8192   // keyframes per table
+
+static Keyframe keys[BAKE_CAPACITY];
+static uint16_t starts[NUMBER_OF_STRIPS + 1];
+
+// Plays the table back against the live pattern for a few periods, returns the worst difference in level.
+// The live pattern carries on from where baking left it, since its oscillators only run forwards.
+template <typename P>
+static int verify(P& live, LEDStrip liveStrips[], const BakedTable& table) {
+  static LEDStrip bakedStrips[NUMBER_OF_STRIPS];
+  BakedPattern<NUMBER_OF_STRIPS> baked;
+  baked.configure(bakedStrips, NUMBER_OF_STRIPS, &table, true);
+  int worst = 0;
+  for (uint32_t t = NUMBER_OF_STRIPS * table.period_ms; t < (NUMBER_OF_STRIPS + 3u) * table.period_ms; t++) {
+    live.render(t);
+    baked.render(t);
+    for (int i = 0; i < NUMBER_OF_STRIPS; i++) {
+      int diff = PatternBaker<NUMBER_OF_STRIPS>::level(bakedStrips[i]) - PatternBaker<NUMBER_OF_STRIPS>::level(liveStrips[i]);
+      if (abs(diff) > worst) worst = abs(diff);
+    }
+  }
+  return worst;
+}
+
+template <typename P>
+static void emit(FILE* out, const char* name, const char* description, P& pattern, PatternBaker<NUMBER_OF_STRIPS>& baker,
+                 uint16_t period_ms, bool follows_colour) {
+  uint32_t count = baker.bake(pattern, period_ms, BAKE_TOLERANCE, keys, BAKE_CAPACITY, starts);
+  if (count > BAKE_CAPACITY) {
+    fprintf(stderr, "%s needs %u keyframes, more than BAKE_CAPACITY\n", name, count);
+    exit(1);
+  }
+
+  fprintf(out, "\n// %s, %u ms period, %u keyframes\n", description, period_ms, count);
+  fprintf(out, "static const Keyframe %s_KEYS[%u] = {", name, count);
+  for (uint32_t k = 0; k < count; k++) {
+    fprintf(out, "%s{ %u, %d },", k % 8 ? " " : "\n  ", keys[k].time_ms, keys[k].level);
+  }
+  fprintf(out, "\n};\n");
+  fprintf(out, "static const uint16_t %s_STARTS[%d] = {", name, NUMBER_OF_STRIPS + 1);
+  for (int i = 0; i <= NUMBER_OF_STRIPS; i++) {
+    fprintf(out, " %u,", starts[i]);
+  }
+  fprintf(out, " };\n");
+  fprintf(out, "static const BakedTable %s = { %u, %d, %s, %s_KEYS, %s_STARTS };\n", name, period_ms, NUMBER_OF_STRIPS,
+          follows_colour ? "true" : "false", name, name);
+
+  BakedTable table = { period_ms, NUMBER_OF_STRIPS, follows_colour, keys, starts };
+  fprintf(stderr, "%-20s %5u ms %5u keyframes %6u bytes, max error %d\n", name, period_ms, count,
+          (unsigned)(count * sizeof(Keyframe)), verify(pattern, baker.getStrips(), table));
+}
+
+int main(int argc, char** argv) {
+  FILE* out = stdout;
+  if (argc == 3 && !strcmp(argv[1], "-o")) {
+    out = fopen(argv[2], "w");
+    if (!out) {
+      perror(argv[2]);
+      return 1;
+    }
+  } else if (argc != 1) {
+    fprintf(stderr, "usage: bake [-o FILE]\n");
+    return 2;
+  }
+
+  fprintf(out, "#pragma once\n");
+  fprintf(out, "#include \"Bake.h\"\n\n");
+  fprintf(out, "// Generated by host/bake.cpp, rebuild with make tables in host/. Do not edit.\n");
+  fprintf(out, "// Levels are strip levels 0-65535 halved, negative on the colour side.\n");
+
+  PatternBaker<NUMBER_OF_STRIPS> baker;
+
+  WavePattern<NUMBER_OF_STRIPS> wave;
+  wave.configure(baker.getStrips(), NUMBER_OF_STRIPS, 1., true);
+  emit(out, "BAKED_WAVE", "wave, 1 Hz", wave, baker, 1000, true);
+
+  WavePattern<NUMBER_OF_STRIPS> slowWave;
+  slowWave.configure(baker.getStrips(), NUMBER_OF_STRIPS, .25, true);
+  emit(out, "BAKED_SLOW_WAVE", "slow wave, 0.25 Hz", slowWave, baker, 4000, true);
+
+  if (out != stdout) fclose(out);
+  return 0;
+}
@@ -0,0 +1,125 @@
+// Runs the micro-benchmarks of Bench.h on the host, against the sketch named by SKETCH built with BENCHMARK.
+// The timings are of this machine, not the ESP32, so compare host runs with host runs and captures from the
+// dress with captures from the dress.
+//
+//   bench_multi > before.csv                       one line per benchmark, as the dress prints them at boot
+//   bench_multi --runs 4000 --baseline before.csv  and how each median moved since
+//   bench_multi --baseline before.csv --fail-over 25    exit 1 if any median grew by more than 25%
+//   bench_single --patterns build/patterns.bin     the programs in an image from pasm are modes too
+
+#include "Arduino.h"
+#include "Wire.h"
+#include <map>
+#include <string>
+#include <vector>
+
+HardwareSerial Serial;  // defined before the sketch so they are constructed first
+EspClass ESP;
+TwoWire Wire;
+
+#include SKETCH
+
+struct Options {
+  uint32_t runs = BENCH_RUNS;
+  const char* patterns_path = nullptr;
+  const char* baseline_path = nullptr;
+  double fail_over_percent = -1;  // off
+};
+
+static void usage() {
+  fprintf(stderr, "usage: bench [--runs N] [--patterns IMAGE] [--baseline CSV] [--fail-over PERCENT]\n");
+  exit(2);
+}
+
+static Options parseArgs(int argc, char** argv) {
+  Options opt;
+  for (int i = 1; i < argc; i++) {
+    const char* a = argv[i];
+    const char* next = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!strcmp(a, "--runs") && next) {
+      opt.runs = atoi(argv[++i]);
+    } else if (!strcmp(a, "--patterns") && next) {
+      opt.patterns_path = argv[++i];
+    } else if (!strcmp(a, "--baseline") && next) {
+      opt.baseline_path = argv[++i];
+    } else if (!strcmp(a, "--fail-over") && next) {
+      opt.fail_over_percent = atof(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+  if (opt.runs == 0 || opt.runs > BENCH_MAX_RUNS) usage();
+  return opt;
+}
+
+static void loadPatterns(const char* path) {  // as if flashed to the patterns partition
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  std::vector<uint8_t> image;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    image.insert(image.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  hal::setPartition(BYTECODE_PARTITION_LABEL, BYTECODE_PARTITION_SUBTYPE, image);
+}
+
+// medians by name from the bench lines of an earlier run, anything else in the file (a whole serial
+// capture, say) is skipped
+static std::map<std::string, uint32_t> readBaseline(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  std::map<std::string, uint32_t> medians;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    char name[BENCH_NAME_SIZE];
+    char unit[16];
+    unsigned runs, min, median;
+    if (sscanf(line, "bench,%23[^,],%15[^,],%u,%u,%u", name, unit, &runs, &min, &median) == 5) {
+      medians[name] = median;
+    }
+  }
+  fclose(f);
+  return medians;
+}
+
+static int compare(const std::map<std::string, uint32_t>& baseline, double fail_over_percent) {
+  fprintf(stderr, "%-24s %10s %10s %8s\n", "benchmark", "before", "now", "change");
+  int worse = 0;
+  for (uint32_t i = 0; i < benchmark.getCount(); i++) {
+    const BenchResult& result = benchmark.getResult(i);
+    auto before = baseline.find(result.name);
+    if (before == baseline.end()) {
+      fprintf(stderr, "%-24s %10s %10u %8s\n", result.name, "-", (unsigned)result.median, "new");
+      continue;
+    }
+    double change = before->second ? 100.0 * ((double)result.median - before->second) / before->second : 0.0;
+    bool failed = fail_over_percent >= 0 && change > fail_over_percent;
+    if (failed) worse++;
+    fprintf(stderr, "%-24s %10u %10u %+7.1f%%%s\n", result.name, (unsigned)before->second, (unsigned)result.median,
+            change, failed ? "  slower" : "");
+  }
+  if (worse) fprintf(stderr, "%d benchmarks slowed by more than %.0f%%\n", worse, fail_over_percent);
+  return worse ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  Options opt = parseArgs(argc, argv);
+  Serial.setEnabled(true);  // the results are printed through it, as on the dress
+  if (opt.patterns_path) loadPatterns(opt.patterns_path);
+
+  programStore.begin();
+  runBenchmarks(benchmark, opt.runs, ledStripArray, NUMBER_OF_STRIPS, patternPools[0], selectActivePattern,
+                TOTAL_MODES + programStore.getCount());
+  fflush(stdout);
+
+  if (!opt.baseline_path) return 0;
+  return compare(readBaseline(opt.baseline_path), opt.fail_over_percent);
+}
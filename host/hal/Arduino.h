@@ -0,0 +1,278 @@
+#pragma once
+// Host stand-in for the parts of the Arduino-ESP32 core used by the sketches.
+// Time is virtual: millis()/micros() only move when delay() or hal::advance() is called,
+// so hours of pattern time can be simulated in milliseconds of wall time.
+// Every analogWrite and ledcWrite is recorded per pin so the simulator can report what the strips would show.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "HardwareSerial.h"
+#include "Esp.h"
+
+#define PI 3.1415926535897932384626433832795
+#define HALF_PI 1.5707963267948966192313216916398
+#define TWO_PI 6.283185307179586476925286766559
+
+#define LOW 0x0
+#define HIGH 0x1
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define LED_BUILTIN 2
+
+#define IRAM_ATTR  // on the ESP32 this places interrupt handlers in RAM
+
+namespace hal {
+
+#define HAL_NUM_GPIO 40
+#define HAL_NUM_EXPANDER_PINS 128  // outputs of the mock I2C PWM expanders in Wire.h, numbered after the GPIOs
+#define HAL_NUM_PINS (HAL_NUM_GPIO + HAL_NUM_EXPANDER_PINS)
+
+struct PinState {
+  uint8_t mode;
+  uint8_t level;            // last digitalWrite
+  uint32_t duty;            // last analogWrite
+  uint32_t writes;          // number of analogWrite calls
+  uint32_t changes;         // number of analogWrite calls that changed the duty
+  uint32_t min_duty;
+  uint32_t max_duty;
+  uint64_t last_change_us;  // when duty last changed, for the duty integral
+  uint64_t duty_us;         // integral of duty over time, in duty * us
+  int touch_value;          // what touchRead returns
+  int digital_in;           // what digitalRead returns
+  void (*touch_isr)(void*);  // attached by touchAttachInterruptArg
+  void* touch_arg;
+  uint16_t touch_threshold;
+  uint8_t resolution_bits;  // of the LEDC channel attached to the pin, 8 for analogWrite
+  uint32_t hpoint;          // where in the PWM period the pin turns on
+  uint8_t partner;          // the other side of the pin's H-bridge, HAL_NUM_PINS if not watched
+};
+
+#define HAL_NUM_LEDC_CHANNELS 16
+
+struct LedcChannel {
+  uint8_t bits;
+  uint8_t pin;  // HAL_NUM_PINS when nothing is attached
+  uint32_t pending_duty;  // set by ledc_set_duty_with_hpoint, applied by ledc_update_duty
+  uint32_t pending_hpoint;
+};
+
+struct State {
+  uint64_t now_us;
+  PinState pins[HAL_NUM_PINS];
+  LedcChannel channels[HAL_NUM_LEDC_CHANNELS];
+  uint32_t overlaps;  // writes that left both sides of a watched H-bridge on at once
+  uint32_t sleep_locks;         // esp_pm locks holding off light sleep
+  uint64_t sleep_locked_since;  // when the first of them was taken
+  uint64_t sleep_locked_us;     // time light sleep was held off, up to sleep_locked_since
+  uint32_t i2c_transactions;    // from the Wire mock
+  uint32_t i2c_failures;        // transactions nothing acknowledged
+  uint64_t i2c_bytes;
+  uint64_t i2c_bus_us;          // time the bus was busy
+  uint64_t i2c_burst_at_us;     // transactions at the same virtual time are one frame's, as time only moves between frames
+  uint64_t i2c_burst_us;        // bus time of the latest burst
+  uint64_t i2c_max_burst_us;
+
+  State()
+    : now_us(0), overlaps(0), sleep_locks(0), sleep_locked_since(0), sleep_locked_us(0), i2c_transactions(0),
+      i2c_failures(0), i2c_bytes(0), i2c_bus_us(0), i2c_burst_at_us(0), i2c_burst_us(0), i2c_max_burst_us(0) {
+    memset(pins, 0, sizeof(pins));
+    for (int i = 0; i < HAL_NUM_PINS; i++) {
+      pins[i].min_duty = 0xFFFFFFFF;
+      pins[i].touch_value = 70;  // untouched pads read around 70
+      pins[i].digital_in = HIGH;  // buttons are pulled up, so open reads high
+      pins[i].resolution_bits = 8;
+      pins[i].partner = HAL_NUM_PINS;
+    }
+    for (int i = 0; i < HAL_NUM_LEDC_CHANNELS; i++) {
+      channels[i].bits = 8;
+      channels[i].pin = HAL_NUM_PINS;
+      channels[i].pending_duty = 0;
+      channels[i].pending_hpoint = 0;
+    }
+  }
+};
+
+inline State& state() {
+  static State s;  // function local so it is ready before the sketch's global LEDStrips are built
+  return s;
+}
+
+inline PinState& pin(uint8_t p) {
+  return state().pins[p % HAL_NUM_PINS];
+}
+
+inline void fireTouchInterrupts() {
+  // the touch peripheral keeps raising its interrupt for as long as a pad reads under the threshold
+  for (int i = 0; i < HAL_NUM_PINS; i++) {
+    PinState& s = state().pins[i];
+    if (s.touch_isr && s.touch_value < s.touch_threshold) {
+      s.touch_isr(s.touch_arg);
+    }
+  }
+}
+
+inline void advance(uint64_t us) {
+  state().now_us += us;
+  fireTouchInterrupts();
+}
+
+inline uint64_t now() {
+  return state().now_us;
+}
+
+inline void setTouch(uint8_t p, int value) {
+  pin(p).touch_value = value;
+}
+
+inline void setDigital(uint8_t p, int value) {
+  pin(p).digital_in = value;
+}
+
+inline void recordDuty(uint8_t p, uint32_t duty) {  // a PWM write to a pin, from analogWrite or an LEDC channel
+  PinState& s = pin(p);
+  s.writes++;
+  if (duty < s.min_duty) s.min_duty = duty;
+  if (duty > s.max_duty) s.max_duty = duty;
+  if (duty != s.duty) {
+    uint64_t now = state().now_us;
+    s.duty_us += (uint64_t)s.duty * (now - s.last_change_us);
+    s.last_change_us = now;
+    s.duty = duty;
+    s.changes++;
+  }
+}
+
+inline uint32_t overlap(uint8_t a, uint8_t b) {  // PWM steps per period that both pins are on for
+  PinState& x = pin(a);
+  PinState& y = pin(b);
+  int64_t period = 1 << x.resolution_bits;
+  int64_t total = 0;
+  for (int k = -1; k <= 1; k++) {  // on times can wrap round the end of the period
+    int64_t start = x.hpoint > y.hpoint + k * period ? x.hpoint : y.hpoint + k * period;
+    int64_t end_x = x.hpoint + x.duty;
+    int64_t end_y = y.hpoint + y.duty + k * period;
+    int64_t end = end_x < end_y ? end_x : end_y;
+    if (end > start) total += end - start;
+  }
+  return total;
+}
+
+inline void watchBridge(uint8_t a, uint8_t b) {  // count any write that leaves both pins on at once
+  pin(a).partner = b % HAL_NUM_PINS;
+  pin(b).partner = a % HAL_NUM_PINS;
+}
+
+inline void checkBridge(uint8_t p) {  // every write is checked, as if a PWM period began right after it
+  uint8_t partner = pin(p).partner;
+  if (partner < HAL_NUM_PINS && overlap(p, partner) > 0) state().overlaps++;
+}
+
+inline void lockSleep(bool lock) {  // from the esp_pm mock
+  State& s = state();
+  if (lock && s.sleep_locks++ == 0) s.sleep_locked_since = s.now_us;
+  if (!lock && s.sleep_locks && --s.sleep_locks == 0) s.sleep_locked_us += s.now_us - s.sleep_locked_since;
+}
+
+inline uint64_t sleepLockedUs() {  // time light sleep was held off, up to now
+  State& s = state();
+  return s.sleep_locked_us + (s.sleep_locks ? s.now_us - s.sleep_locked_since : 0);
+}
+
+inline uint64_t dutyIntegral(uint8_t p) {  // duty * us accumulated up to now
+  PinState& s = pin(p);
+  return s.duty_us + (uint64_t)s.duty * (state().now_us - s.last_change_us);
+}
+
+inline void resetStats() {
+  for (int i = 0; i < HAL_NUM_PINS; i++) {
+    PinState& s = state().pins[i];
+    s.writes = 0;
+    s.changes = 0;
+    s.min_duty = s.duty;
+    s.max_duty = s.duty;
+    s.duty_us = 0;
+    s.last_change_us = state().now_us;
+  }
+  state().sleep_locked_us = 0;
+  state().sleep_locked_since = state().now_us;
+  state().i2c_transactions = 0;
+  state().i2c_failures = 0;
+  state().i2c_bytes = 0;
+  state().i2c_bus_us = 0;
+  state().i2c_burst_us = 0;
+  state().i2c_max_burst_us = 0;
+}
+
+}  // namespace hal
+
+inline unsigned long millis() {
+  return (uint32_t)(hal::now() / 1000);  // wraps at 2^32 like the 32 bit counter on the ESP32
+}
+
+inline unsigned long micros() {
+  return (uint32_t)hal::now();
+}
+
+inline void delay(uint32_t ms) {
+  hal::advance((uint64_t)ms * 1000);
+}
+
+inline void delayMicroseconds(uint32_t us) {
+  hal::advance(us);
+}
+
+inline void pinMode(uint8_t p, uint8_t mode) {
+  hal::pin(p).mode = mode;
+}
+
+inline void digitalWrite(uint8_t p, uint8_t level) {
+  hal::pin(p).level = level;
+}
+
+inline int digitalRead(uint8_t p) {
+  return hal::pin(p).digital_in;
+}
+
+inline void analogWrite(uint8_t p, int value) {
+  hal::recordDuty(p, value < 0 ? 0 : (uint32_t)value);
+}
+
+inline uint32_t ledcSetup(uint8_t channel, uint32_t freq, uint8_t bits) {
+  hal::state().channels[channel % HAL_NUM_LEDC_CHANNELS].bits = bits;
+  return freq;
+}
+
+inline void ledcAttachPin(uint8_t p, uint8_t channel) {
+  hal::LedcChannel& c = hal::state().channels[channel % HAL_NUM_LEDC_CHANNELS];
+  c.pin = p % HAL_NUM_PINS;
+  hal::pin(p).resolution_bits = c.bits;
+}
+
+inline void ledcWrite(uint8_t channel, uint32_t duty) {
+  hal::LedcChannel& c = hal::state().channels[channel % HAL_NUM_LEDC_CHANNELS];
+  if (c.pin < HAL_NUM_PINS) {
+    hal::recordDuty(c.pin, duty);
+    hal::pin(c.pin).hpoint = 0;
+    hal::checkBridge(c.pin);
+  }
+}
+
+inline uint16_t touchRead(uint8_t p) {
+  hal::advance(100);  // a touch reading takes ~0.1ms of measurement time on the ESP32
+  return hal::pin(p).touch_value;
+}
+
+inline void touchAttachInterruptArg(uint8_t p, void (*isr)(void*), void* arg, uint16_t threshold) {
+  hal::PinState& s = hal::pin(p);
+  s.touch_isr = isr;
+  s.touch_arg = arg;
+  s.touch_threshold = threshold;
+}
+
+inline void touchDetachInterrupt(uint8_t p) {
+  hal::pin(p).touch_isr = nullptr;
+}
@@ -0,0 +1,41 @@
+#pragma once
+// Host stand-in for the ESP object. Free heap is a nominal ESP32 heap minus what glibc reports as in use,
+// so leaks and allocations in the sketch show up as they would on the device.
+
+#include <malloc.h>
+#include <stdint.h>
+
+#define HAL_HEAP_SIZE (320 * 1024)
+
+class EspClass {
+
+private:
+  uint32_t min_free_heap;
+
+public:
+  EspClass()
+    : min_free_heap(HAL_HEAP_SIZE) {}
+
+  uint32_t getHeapSize() {
+    return HAL_HEAP_SIZE;
+  }
+
+  uint32_t getFreeHeap() {
+    struct mallinfo2 info = mallinfo2();
+    uint32_t used = (uint32_t)info.uordblks;
+    uint32_t free_heap = used < HAL_HEAP_SIZE ? HAL_HEAP_SIZE - used : 0;
+    if (free_heap < this->min_free_heap) this->min_free_heap = free_heap;
+    return free_heap;
+  }
+
+  uint64_t getEfuseMac() {  // the factory MAC address, low byte first as on the device
+    return 0x3C2B1A60A124ULL;
+  }
+
+  uint32_t getMinFreeHeap() {
+    getFreeHeap();
+    return this->min_free_heap;
+  }
+};
+
+extern EspClass ESP;
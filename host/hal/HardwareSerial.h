@@ -0,0 +1,100 @@
+#pragma once
+// Host stand-in for the ESP32 HardwareSerial. Output goes to stdout when enabled,
+// and is swallowed otherwise so long simulations are not dominated by printing.
+// Input is whatever the simulator has queued with receive(), as if typed into the serial monitor.
+// Output can also be captured into a buffer, for a harness that reads the sketch's replies.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+
+class HardwareSerial {
+
+private:
+  bool enabled;
+  std::deque<uint8_t> input;
+  std::vector<uint8_t>* capture;
+
+  void out(const char* s, size_t length) {
+    if (enabled) fwrite(s, 1, length, stdout);
+    if (capture) capture->insert(capture->end(), s, s + length);
+  }
+
+  template <typename T>
+  void format(const char* spec, T v) {
+    char text[32];
+    int length = snprintf(text, sizeof(text), spec, v);
+    out(text, length);
+  }
+
+public:
+  HardwareSerial()
+    : enabled(false), capture(nullptr) {}
+
+  void setCapture(std::vector<uint8_t>* capture) {  // everything written from now on is appended to it
+    this->capture = capture;
+  }
+
+  void begin(unsigned long baud) {}
+  void setEnabled(bool enabled) {
+    this->enabled = enabled;
+  }
+
+  void receive(const uint8_t* data, size_t length) {
+    this->input.insert(this->input.end(), data, data + length);
+  }
+
+  int available() {
+    return this->input.size();
+  }
+  int read() {  // -1 when there is nothing
+    if (this->input.empty()) return -1;
+    uint8_t c = this->input.front();
+    this->input.pop_front();
+    return c;
+  }
+
+  size_t write(uint8_t c) {
+    out((const char*)&c, 1);
+    return 1;
+  }
+  size_t write(const uint8_t* data, size_t length) {
+    out((const char*)data, length);
+    return length;
+  }
+
+  void print(const char* s) {
+    out(s, strlen(s));
+  }
+  void print(char c) {
+    out(&c, 1);
+  }
+  void print(int v) {
+    format("%d", v);
+  }
+  void print(unsigned int v) {
+    format("%u", v);
+  }
+  void print(long v) {
+    format("%ld", v);
+  }
+  void print(unsigned long v) {
+    format("%lu", v);
+  }
+  void print(double v) {
+    format("%.2f", v);
+  }
+
+  void println() {
+    print('\n');
+  }
+  template <typename T>
+  void println(T v) {
+    print(v);
+    println();
+  }
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,152 @@
+#pragma once
+// Host stand-in for the Arduino-ESP32 Wire library, with PCA9685 PWM expanders on the bus.
+// The simulator adds boards with hal::addPca9685; each one decodes its LED registers the way the chip does
+// and records the result on a pin after the GPIOs (hal::expanderPin), so the strips on it are reported and
+// their H-bridges watched like the LEDC pins. Every transaction's bus time is worked out from the clock
+// and byte count, and added up in hal::state(), but the virtual clock does not move for it.
+
+#include "Arduino.h"
+
+#define I2C_BUFFER_LENGTH 128  // as in the ESP32 core, a longer write is cut short
+#define HAL_MAX_PCA9685 (HAL_NUM_EXPANDER_PINS / 16)
+
+namespace hal {
+
+struct Pca9685 {
+  uint8_t address;  // 0 for a free slot
+  uint8_t regs[256];
+  uint8_t first_pin;
+};
+
+inline Pca9685* pca9685s() {
+  static Pca9685 boards[HAL_MAX_PCA9685] = {};
+  return boards;
+}
+
+inline uint8_t expanderPin(uint8_t board, uint8_t channel) {  // board counts from the first one added
+  return HAL_NUM_GPIO + board * 16 + channel;
+}
+
+inline void addPca9685(uint8_t address) {
+  Pca9685* boards = pca9685s();
+  for (int i = 0; i < HAL_MAX_PCA9685; i++) {
+    if (boards[i].address == 0) {
+      boards[i].address = address;
+      boards[i].regs[0x00] = 0x11;  // MODE1 powers up asleep, answering the all call address
+      boards[i].regs[0x01] = 0x04;
+      boards[i].first_pin = expanderPin(i, 0);
+      for (int c = 0; c < 16; c++) {
+        boards[i].regs[0x06 + 4 * c + 3] = 0x10;  // full off
+        pin(expanderPin(i, c)).resolution_bits = 12;
+      }
+      return;
+    }
+  }
+}
+
+inline Pca9685* findPca9685(uint8_t address) {
+  Pca9685* boards = pca9685s();
+  for (int i = 0; i < HAL_MAX_PCA9685; i++) {
+    if (boards[i].address == address) return &boards[i];
+  }
+  return nullptr;
+}
+
+inline void applyPca9685(Pca9685& board) {  // the chip updates its outputs at the I2C stop
+  for (int c = 0; c < 16; c++) {
+    const uint8_t* led = &board.regs[0x06 + 4 * c];
+    uint16_t on = led[0] | (led[1] & 0x1F) << 8;
+    uint16_t off = led[2] | (led[3] & 0x1F) << 8;
+    uint32_t duty = 0, hpoint = 0;
+    if (off & 0x1000) {
+      duty = 0;  // full off wins over full on
+    } else if (on & 0x1000) {
+      duty = 4096;
+    } else {
+      hpoint = on;
+      duty = (off - on) & 0xFFF;
+    }
+    uint8_t p = board.first_pin + c;
+    if (duty != pin(p).duty || (duty && hpoint != pin(p).hpoint)) {
+      recordDuty(p, duty);
+      pin(p).hpoint = hpoint;
+    }
+  }
+  for (int c = 0; c < 16; c++) checkBridge(board.first_pin + c);
+}
+
+}  // namespace hal
+
+class TwoWire {
+private:
+  uint32_t frequency;
+  uint8_t address;
+  uint8_t buffer[I2C_BUFFER_LENGTH];
+  size_t length;
+
+public:
+  TwoWire()
+    : frequency(100000), address(0), length(0) {}
+
+  bool begin(int sda = -1, int scl = -1, uint32_t frequency = 0) {
+    if (frequency) this->frequency = frequency;
+    return true;
+  }
+
+  void setClock(uint32_t frequency) {
+    this->frequency = frequency;
+  }
+
+  void beginTransmission(uint8_t address) {
+    this->address = address;
+    this->length = 0;
+  }
+
+  size_t write(uint8_t data) {
+    if (this->length >= I2C_BUFFER_LENGTH) return 0;
+    this->buffer[this->length++] = data;
+    return 1;
+  }
+
+  size_t write(const uint8_t* data, size_t count) {
+    size_t written = 0;
+    while (written < count && write(data[written])) written++;
+    return written;
+  }
+
+  uint8_t endTransmission(bool stop = true) {  // 0 on success, 2 when nothing acknowledged the address
+    hal::State& s = hal::state();
+    uint64_t bits = (1 + this->length) * 9 + 2;  // address and data bytes with their acks, start and stop
+    uint64_t us = (bits * 1000000 + this->frequency - 1) / this->frequency;
+    if (s.i2c_burst_at_us != s.now_us) {
+      s.i2c_burst_at_us = s.now_us;
+      s.i2c_burst_us = 0;
+    }
+    s.i2c_burst_us += us;
+    if (s.i2c_burst_us > s.i2c_max_burst_us) s.i2c_max_burst_us = s.i2c_burst_us;
+    s.i2c_transactions++;
+    s.i2c_bytes += 1 + this->length;
+    s.i2c_bus_us += us;
+
+    hal::Pca9685* board = hal::findPca9685(this->address);
+    if (board == nullptr) {
+      s.i2c_failures++;
+      return 2;
+    }
+    if (this->length > 0) {
+      uint8_t reg = this->buffer[0];
+      bool increment = board->regs[0x00] & 0x20;  // MODE1 AI
+      for (size_t i = 1; i < this->length; i++) {
+        if (reg == 0xFA && this->length - i >= 4) {  // ALL_LED, written as a block of four
+          for (int c = 0; c < 16; c++) memcpy(&board->regs[0x06 + 4 * c], &this->buffer[i], 4);
+        }
+        board->regs[reg] = this->buffer[i];
+        if (increment) reg++;
+      }
+    }
+    if (stop) hal::applyPca9685(*board);
+    return 0;
+  }
+};
+
+extern TwoWire Wire;
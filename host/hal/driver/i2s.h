@@ -0,0 +1,107 @@
+#pragma once
+// Host stand-in for the legacy ESP-IDF I2S driver in built-in ADC mode, as AudioInput uses it. The samples
+// are whatever hal::setAudio was given (sim --wav), played on a loop and paced by the virtual clock from when
+// the driver was installed, and read back as the ADC delivers them: 12 bit readings in the low bits of
+// 16 bit words, centred on 2048. A read never blocks; it returns nothing until a whole buffer is due.
+
+#include "Arduino.h"
+#include <vector>
+
+typedef int esp_err_t;
+typedef uint32_t TickType_t;
+
+typedef enum {
+  I2S_NUM_0 = 0,
+} i2s_port_t;
+
+typedef enum {
+  I2S_MODE_MASTER = 1,
+  I2S_MODE_RX = 4,
+  I2S_MODE_ADC_BUILT_IN = 32,
+} i2s_mode_t;
+
+typedef enum {
+  I2S_BITS_PER_SAMPLE_16BIT = 16,
+} i2s_bits_per_sample_t;
+
+typedef enum {
+  I2S_CHANNEL_FMT_ONLY_LEFT = 4,
+} i2s_channel_fmt_t;
+
+typedef enum {
+  I2S_COMM_FORMAT_STAND_I2S = 1,
+} i2s_comm_format_t;
+
+typedef enum {
+  ADC_UNIT_1 = 1,
+} adc_unit_t;
+
+typedef enum {
+  ADC1_CHANNEL_0 = 0,  // GPIO 36
+} adc1_channel_t;
+
+typedef struct {
+  int mode;
+  uint32_t sample_rate;
+  i2s_bits_per_sample_t bits_per_sample;
+  i2s_channel_fmt_t channel_format;
+  int communication_format;
+  int intr_alloc_flags;
+  int dma_buf_count;
+  int dma_buf_len;
+  bool use_apll;
+} i2s_config_t;
+
+namespace hal {
+
+struct AudioSource {
+  std::vector<int16_t> samples;  // at the rate the driver is installed with
+  bool installed = false;
+  uint32_t sample_rate = 0;
+  uint64_t start_us = 0;
+  uint64_t read = 0;  // samples handed out so far
+};
+
+inline AudioSource& audio() {
+  static AudioSource a;
+  return a;
+}
+
+inline void setAudio(const std::vector<int16_t>& samples) {
+  audio().samples = samples;
+}
+
+}  // namespace hal
+
+inline esp_err_t i2s_driver_install(i2s_port_t port, const i2s_config_t* config, int queue_size, void* queue) {
+  hal::AudioSource& a = hal::audio();
+  a.installed = true;
+  a.sample_rate = config->sample_rate;
+  a.start_us = hal::now();
+  a.read = 0;
+  return 0;
+}
+
+inline esp_err_t i2s_set_adc_mode(adc_unit_t unit, adc1_channel_t channel) {
+  return 0;
+}
+
+inline esp_err_t i2s_adc_enable(i2s_port_t port) {
+  return 0;
+}
+
+inline esp_err_t i2s_read(i2s_port_t port, void* dest, size_t size, size_t* bytes_read, TickType_t ticks_to_wait) {
+  hal::AudioSource& a = hal::audio();
+  size_t wanted = size / 2;
+  uint64_t sampled = a.installed ? (hal::now() - a.start_us) * a.sample_rate / 1000000 : 0;
+  *bytes_read = 0;
+  if (sampled - a.read < wanted) return 0;
+  uint16_t* out = (uint16_t*)dest;
+  for (size_t i = 0; i < wanted; i++) {
+    int16_t s = a.samples.empty() ? 0 : a.samples[(a.read + i) % a.samples.size()];
+    out[i] = (uint16_t)((s >> 4) + 2048) & 0x0FFF;
+  }
+  a.read += wanted;
+  *bytes_read = wanted * 2;
+  return 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+// Host stand-in for the parts of the ESP-IDF LEDC driver used by LEDStrip. Arduino numbers LEDC channels
+// 0-15; the IDF splits them into two speed modes of 8, so Arduino channel c is mode c / 8, channel c % 8.
+
+#include "Arduino.h"
+
+typedef enum {
+  LEDC_HIGH_SPEED_MODE = 0,
+  LEDC_LOW_SPEED_MODE = 1,
+} ledc_mode_t;
+
+typedef int ledc_channel_t;
+typedef int esp_err_t;
+
+inline esp_err_t ledc_set_duty_with_hpoint(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty, uint32_t hpoint) {
+  hal::LedcChannel& c = hal::state().channels[(mode * 8 + channel) % HAL_NUM_LEDC_CHANNELS];
+  c.pending_duty = duty;
+  c.pending_hpoint = hpoint;
+  return 0;
+}
+
+inline esp_err_t ledc_update_duty(ledc_mode_t mode, ledc_channel_t channel) {
+  hal::LedcChannel& c = hal::state().channels[(mode * 8 + channel) % HAL_NUM_LEDC_CHANNELS];
+  if (c.pin < HAL_NUM_PINS) {
+    hal::recordDuty(c.pin, c.pending_duty);
+    hal::pin(c.pin).hpoint = c.pending_hpoint;
+    hal::checkBridge(c.pin);
+  }
+  return 0;
+}
@@ -0,0 +1,3 @@
+#pragma once
+// On the ESP32 this declares pinMode/digitalWrite/analogWrite; on the host they live in the mock Arduino.h.
+#include "Arduino.h"
@@ -0,0 +1,76 @@
+#pragma once
+// Host stand-in for the ESP-NOW API as SyncClock's EspNowTransport uses it. There is one radio, this
+// process's: what it sends is counted and handed to hal::air().listener if there is one (the simulator's
+// sync peer), and hal::airDeliver plays a packet from elsewhere into the registered receive callback, as
+// the WiFi task would.
+
+#include "Arduino.h"
+
+#ifndef ESP_OK
+#define ESP_OK 0
+#endif
+#define ESP_FAIL -1
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_MAX_DATA_LEN 250
+
+typedef int esp_err_t;
+
+typedef enum {
+  WIFI_IF_STA = 0,
+} wifi_interface_t;
+
+typedef struct {
+  uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+  uint8_t lmk[16];
+  uint8_t channel;
+  wifi_interface_t ifidx;
+  bool encrypt;
+  void* priv;
+} esp_now_peer_info_t;
+
+typedef void (*esp_now_recv_cb_t)(const uint8_t* mac_addr, const uint8_t* data, int data_len);
+
+namespace hal {
+
+struct Air {
+  bool started = false;
+  esp_now_recv_cb_t receive = nullptr;
+  int peers = 0;
+  uint32_t sent = 0;
+  void (*listener)(const uint8_t* data, int length) = nullptr;  // hears what this radio sends
+};
+
+inline Air& air() {
+  static Air a;
+  return a;
+}
+
+inline void airDeliver(const uint8_t* data, int length) {  // a packet from another device arrives now
+  static const uint8_t from[ESP_NOW_ETH_ALEN] = { 0x24, 0xA1, 0x60, 0x00, 0x00, 0x01 };
+  if (air().started && air().receive) air().receive(from, data, length);
+}
+
+}  // namespace hal
+
+inline esp_err_t esp_now_init() {
+  hal::air().started = true;
+  return ESP_OK;
+}
+
+inline esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+  hal::air().receive = cb;
+  return ESP_OK;
+}
+
+inline esp_err_t esp_now_add_peer(const esp_now_peer_info_t* peer) {
+  hal::air().peers++;
+  return ESP_OK;
+}
+
+inline esp_err_t esp_now_send(const uint8_t* peer_addr, const uint8_t* data, size_t len) {
+  hal::Air& a = hal::air();
+  if (!a.started || a.peers == 0 || len > ESP_NOW_MAX_DATA_LEN) return ESP_FAIL;
+  a.sent++;
+  if (a.listener) a.listener(data, (int)len);
+  return ESP_OK;
+}
@@ -0,0 +1,78 @@
+#pragma once
+// Host stand-in for the ESP-IDF partition API used by ProgramStore. The simulator hands in an image file's
+// contents with hal::setPartition, and mapping it returns a pointer straight to those bytes, read only,
+// which is what the flash cache gives the ESP32.
+
+#include <vector>
+#include "Arduino.h"
+
+typedef int esp_err_t;
+#ifndef ESP_OK
+#define ESP_OK 0
+#endif
+#define ESP_ERR_NOT_FOUND 0x105
+
+typedef enum {
+  ESP_PARTITION_TYPE_APP = 0x00,
+  ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef int esp_partition_subtype_t;
+
+typedef enum {
+  ESP_PARTITION_MMAP_DATA,
+  ESP_PARTITION_MMAP_INST,
+} esp_partition_mmap_memory_t;
+
+typedef uint32_t esp_partition_mmap_handle_t;
+
+typedef struct {
+  esp_partition_type_t type;
+  esp_partition_subtype_t subtype;
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+
+namespace hal {
+
+struct Partition {
+  esp_partition_t info;
+  std::vector<uint8_t> data;
+  bool present;
+};
+
+inline Partition& partition() {
+  static Partition p = {};
+  return p;
+}
+
+inline void setPartition(const char* label, esp_partition_subtype_t subtype, const std::vector<uint8_t>& data) {
+  Partition& p = partition();
+  p.info.type = ESP_PARTITION_TYPE_DATA;
+  p.info.subtype = subtype;
+  p.info.address = 0x1F0000;
+  p.info.size = data.size();
+  strncpy(p.info.label, label, sizeof(p.info.label) - 1);
+  p.data = data;
+  p.present = true;
+}
+
+}  // namespace hal
+
+inline const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                       const char* label) {
+  hal::Partition& p = hal::partition();
+  if (!p.present || p.info.type != type || p.info.subtype != subtype || strcmp(p.info.label, label)) return nullptr;
+  return &p.info;
+}
+
+inline esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size,
+                                    esp_partition_mmap_memory_t memory, const void** out_ptr,
+                                    esp_partition_mmap_handle_t* out_handle) {
+  hal::Partition& p = hal::partition();
+  if (partition != &p.info || offset + size > p.data.size()) return ESP_ERR_NOT_FOUND;
+  *out_ptr = p.data.data() + offset;
+  *out_handle = 1;
+  return ESP_OK;
+}
@@ -0,0 +1,50 @@
+#pragma once
+// Host stand-in for the ESP-IDF power management API used by Power.h. Configuring always succeeds, and
+// the time any lock holds off light sleep is kept so the simulator can estimate what the CPU draws.
+
+#include "Arduino.h"
+
+typedef int esp_err_t;
+#ifndef ESP_OK
+#define ESP_OK 0
+#endif
+
+typedef enum {
+  ESP_PM_CPU_FREQ_MAX,
+  ESP_PM_APB_FREQ_MAX,
+  ESP_PM_NO_LIGHT_SLEEP,
+} esp_pm_lock_type_t;
+
+typedef struct {
+  int max_freq_mhz;
+  int min_freq_mhz;
+  bool light_sleep_enable;
+} esp_pm_config_esp32_t;
+
+struct esp_pm_lock {
+  esp_pm_lock_type_t type;
+};
+typedef esp_pm_lock* esp_pm_lock_handle_t;
+
+inline esp_err_t esp_pm_configure(const void* config) {
+  return ESP_OK;
+}
+
+inline esp_err_t esp_pm_lock_create(esp_pm_lock_type_t type, int arg, const char* name, esp_pm_lock_handle_t* handle) {
+  static esp_pm_lock locks[8];
+  static int used = 0;
+  if (used == 8) return -1;
+  locks[used].type = type;
+  *handle = &locks[used++];
+  return ESP_OK;
+}
+
+inline esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle) {
+  if (handle->type == ESP_PM_NO_LIGHT_SLEEP) hal::lockSleep(true);
+  return ESP_OK;
+}
+
+inline esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle) {
+  if (handle->type == ESP_PM_NO_LIGHT_SLEEP) hal::lockSleep(false);
+  return ESP_OK;
+}
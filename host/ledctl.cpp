@@ -0,0 +1,109 @@
+// Changes a running dress over its USB serial port with the control frames of multi/Control.h.
+//
+//   ledctl /dev/ttyUSB0 mode 4              switch to mode 4
+//   ledctl /dev/ttyUSB0 colour white        or colour
+//   ledctl /dev/ttyUSB0 set period_ms 3000  change a parameter of the mode playing, without restarting it
+//   ledctl /dev/ttyUSB0 query               print the mode, colour and free heap
+//
+// Parameters are the names in controlParameters: brightness, period_ms, speed (millionths, 2000 is the
+// chaos modes' .002), rate (percent, the waves) and white_share. --verbose also prints the log text the
+// dress sends meanwhile. Exits 1 if the dress refuses the request or does not answer within a second.
+
+#include "Arduino.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+HardwareSerial Serial;  // for the sketch headers, nothing here prints through them
+EspClass ESP;
+
+#include "ControlClient.h"
+
+#define LEDCTL_BAUD B115200
+#define LEDCTL_TIMEOUT_MS 1000
+
+static void usage() {
+  fprintf(stderr,
+          "usage: ledctl PORT [--verbose] mode N | colour white|colour | set NAME VALUE | query\n");
+  exit(2);
+}
+
+static int openPort(const char* path) {  // raw 8N1, as the sketch's Serial.begin sets the other end up
+  int fd = open(path, O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(path);
+    exit(1);
+  }
+  struct termios tty;
+  if (tcgetattr(fd, &tty) != 0) {
+    perror(path);
+    exit(1);
+  }
+  cfmakeraw(&tty);
+  cfsetispeed(&tty, LEDCTL_BAUD);
+  cfsetospeed(&tty, LEDCTL_BAUD);
+  tty.c_cflag |= CLOCAL | CREAD;
+  tty.c_cflag &= ~HUPCL;  // closing the port must not reset the ESP32 through DTR
+  if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+    perror(path);
+    exit(1);
+  }
+  return fd;
+}
+
+static uint32_t nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) usage();
+  const char* path = argv[1];
+  int first = 2;
+  bool verbose = false;
+  if (!strcmp(argv[first], "--verbose")) {
+    verbose = true;
+    first++;
+  }
+  ControlFrame request;
+  if (!controlRequest(argc - first, argv + first, request)) usage();
+
+  int fd = openPort(path);
+  uint8_t bytes[CONTROL_FRAME_SIZE];
+  int length = request.encode(bytes);
+  if (write(fd, bytes, length) != length) {
+    perror(path);
+    return 1;
+  }
+
+  ReplyReader reader;
+  uint32_t start = nowMs();
+  for (;;) {
+    uint32_t waited = nowMs() - start;
+    if (waited >= LEDCTL_TIMEOUT_MS) break;
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll(&p, 1, LEDCTL_TIMEOUT_MS - waited) <= 0) continue;
+    uint8_t buffer[256];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno != EINTR) {
+      perror(path);
+      return 1;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      ControlFrame reply;
+      if (!reader.feed(buffer[i], nowMs(), reply) || reply.type != (request.type | CONTROL_REPLY)) continue;
+      if (verbose) fputs(reader.text.c_str(), stderr);
+      printf("%s\n", describeReply(reply).c_str());
+      close(fd);
+      return reply.length && reply.payload[0] == CONTROL_OK ? 0 : 1;
+    }
+  }
+  if (verbose) fputs(reader.text.c_str(), stderr);
+  fprintf(stderr, "%s: no reply\n", path);
+  close(fd);
+  return 1;
+}
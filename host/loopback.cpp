@@ -0,0 +1,134 @@
+// Loopback harness for the control protocol: runs the multi sketch from setup() on the virtual clock, sends
+// it control frames through the mock serial port as ledctl would, and checks the replies and what the
+// strips do after. Exits 1 on the first check that fails; make check runs it.
+
+#include "Arduino.h"
+#include "Wire.h"
+#include <vector>
+
+HardwareSerial Serial;  // defined before the sketch so they are constructed first
+EspClass ESP;
+TwoWire Wire;
+
+#include "../multi/multi.ino"
+#include "ControlClient.h"
+
+static std::vector<uint8_t> output;  // everything the sketch has printed
+static size_t read_to = 0;
+static ReplyReader reader;
+static int checks = 0;
+
+static void check(bool ok, const char* what) {
+  checks++;
+  if (ok) return;
+  printf("loopback: %s\n", what);
+  printf("sketch output:\n%s\n", reader.text.c_str());
+  exit(1);
+}
+
+static void runFor(uint32_t ms) {
+  uint32_t end = millis() + ms;
+  while (millis() < end) loop();
+}
+
+static bool nextReply(ControlFrame& reply) {  // from what the sketch printed since the last call
+  while (read_to < output.size()) {
+    if (reader.feed(output[read_to++], millis(), reply)) return true;
+  }
+  return false;
+}
+
+static bool awaitReply(ControlFrame& reply, uint32_t ms) {
+  uint32_t end = millis() + ms;
+  while (millis() < end) {
+    loop();
+    if (nextReply(reply)) return true;
+  }
+  return false;
+}
+
+static ControlFrame request(std::vector<const char*> words) {  // sends it in one go and waits for the answer
+  ControlFrame frame, reply;
+  check(controlRequest(words.size(), words.data(), frame), "test request does not parse");
+  uint8_t bytes[CONTROL_FRAME_SIZE];
+  Serial.receive(bytes, frame.encode(bytes));
+  check(awaitReply(reply, 200), "no reply within 200 ms");
+  check(reply.type == (frame.type | CONTROL_REPLY), "reply is to a different request");
+  return reply;
+}
+
+static uint32_t whiteChanges() {  // duty changes on every strip's white pin so far
+  const uint8_t pins[] = { STRIP_0_WHITE, STRIP_1_WHITE, STRIP_2_WHITE, STRIP_3_WHITE, STRIP_4_WHITE, STRIP_5_WHITE };
+  uint32_t changes = 0;
+  for (uint8_t p : pins) changes += hal::pin(p).changes;
+  return changes;
+}
+
+int main() {
+  Serial.setCapture(&output);
+  setup();
+  runFor(1000);
+
+  ControlFrame reply = request({ "query" });
+  check(reply.length == 8 && reply.payload[0] == CONTROL_OK, "query is not answered in full");
+  check(reply.payload[1] == 0 && reply.payload[2] == 1, "query does not report mode 0 in white");
+
+  reply = request({ "mode", "4" });
+  check(reply.payload[0] == CONTROL_OK, "mode 4 is refused");
+  runFor(1000);
+  check(render_mode == 4, "mode 4 is not playing");
+  Pattern* sequence = crossfade.current();
+
+  uint32_t before = whiteChanges();
+  runFor(1200);
+  uint32_t slow = whiteChanges() - before;
+  reply = request({ "set", "period_ms", "600" });
+  check(reply.payload[0] == CONTROL_OK, "period_ms is refused");
+  before = whiteChanges();
+  runFor(1200);
+  uint32_t fast = whiteChanges() - before;
+  check(fast > 2 * slow + 4, "the sequence did not speed up");
+  check(crossfade.current() == sequence && render_mode == 4, "setting a parameter restarted the pattern");
+
+  reply = request({ "set", "sparkle", "1" });
+  check(reply.payload[0] == CONTROL_UNKNOWN_PARAM, "an unknown parameter is accepted");
+  reply = request({ "mode", "200" });
+  check(reply.payload[0] == CONTROL_BAD_VALUE, "a mode past the last is accepted");
+
+  const uint8_t corrupt[] = { CONTROL_SYNC, CONTROL_SET_MODE, 1, 2, 0x00 };  // wrong CRC
+  uint32_t errors = control.getErrors();
+  Serial.receive(corrupt, sizeof(corrupt));
+  check(!awaitReply(reply, 200), "a frame with a bad CRC is answered");
+  check(control.getErrors() == errors + 1 && render_mode == 4, "a frame with a bad CRC is acted on");
+
+  const char* typed = "stats\n";  // typed commands still work around frames
+  Serial.receive((const uint8_t*)typed, strlen(typed));
+  runFor(200);
+  nextReply(reply);
+  check(reader.text.find("STATS") != std::string::npos, "the console stopped answering after a bad frame");
+
+  ControlFrame frame;  // a frame arriving a byte per poll
+  const char* words[] = { "colour", "colour" };
+  controlRequest(2, words, frame);
+  uint8_t bytes[CONTROL_FRAME_SIZE];
+  int length = frame.encode(bytes);
+  for (int i = 0; i < length; i++) {
+    Serial.receive(bytes + i, 1);
+    loop();
+  }
+  check(awaitReply(reply, 200) && reply.payload[0] == CONTROL_OK, "a frame split across polls is lost");
+  runFor(600);
+  check(!render_is_white, "colour was not applied");
+
+  reply = request({ "mode", "5" });
+  runFor(600);
+  Pattern* chaos = crossfade.current();
+  reply = request({ "set", "speed", "8000" });
+  check(reply.payload[0] == CONTROL_OK, "speed is refused");
+  runFor(100);
+  check(crossfade.current() == chaos && reader.text.find("Set parameter 2 to 8000") != std::string::npos,
+        "speed was not applied to the chaos pattern");
+
+  printf("loopback: %d checks passed\n", checks);
+  return 0;
+}
@@ -0,0 +1,332 @@
+// Assembler and runner for the pattern programs in Bytecode.h.
+// Assembles a source file of programs into the image that goes in the patterns partition, or runs one
+// program on the host against shadow strips, printing what each strip shows and how long a frame takes.
+//
+//   pasm patterns/dress.pat -o build/patterns.bin        assemble
+//   pasm build/patterns.bin --run breathe --ms 2000 --csv breathe.csv --sample-ms 10
+//
+// Source format, one instruction per line, ';' starts a comment:
+//   program NAME          starts a program, NAME up to 15 characters
+//   label:                a branch target, branches only jump forwards
+//   li r4, 0.5hz          instruction, operands separated by commas
+//   end                   ends the program
+// Registers are r0-r15; t, strip, strips and white name the inputs r0-r3. Numbers can be decimal or hex, or
+// have a unit: 2hz is the phase step per ms of a 2 Hz oscillator, 90deg and 25% are phases.
+// li takes any 32 bit number and becomes two instructions when it needs to; addi takes 16 bits.
+
+#include "Arduino.h"
+#include <time.h>
+#include <string>
+#include <vector>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+#include "../multi/Patterns.h"
+
+struct Mnemonic {
+  const char* name;
+  uint8_t op;
+  const char* operands;  // r register, i immediate, l label
+};
+
+static const Mnemonic MNEMONICS[] = {
+  { "stop", OP_END, "" },       { "li", OP_LI, "ri" },        { "addi", OP_ADDI, "ri" },   { "mov", OP_MOV, "rr" },
+  { "add", OP_ADD, "rrr" },     { "sub", OP_SUB, "rrr" },     { "mul", OP_MUL, "rrr" },    { "mulq", OP_MULQ, "rrr" },
+  { "div", OP_DIV, "rrr" },     { "min", OP_MIN, "rrr" },     { "max", OP_MAX, "rrr" },    { "and", OP_AND, "rrr" },
+  { "or", OP_OR, "rrr" },       { "xor", OP_XOR, "rrr" },     { "shl", OP_SHL, "rrr" },    { "shr", OP_SHR, "rrr" },
+  { "sin", OP_SIN, "rr" },      { "tri", OP_TRI, "rr" },      { "pulse", OP_PULSE, "rrr" }, { "noise", OP_NOISE, "rrr" },
+  { "env", OP_ENV, "rrr" },     { "jmp", OP_JMP, "l" },       { "jlt", OP_JLT, "rrl" },    { "jge", OP_JGE, "rrl" },
+  { "jeq", OP_JEQ, "rrl" },     { "jne", OP_JNE, "rrl" },     { "level", OP_LEVEL, "r" },  { "dir", OP_DIR, "r" },
+  { "mix", OP_MIX, "r" },
+};
+
+struct Program {
+  std::string name;
+  std::vector<Instruction> code;
+  std::vector<std::pair<std::string, int>> labels;   // name, instruction it marks
+  std::vector<std::pair<std::string, int>> fixups;   // label, branch instruction waiting for it
+};
+
+static const char* path;
+static int line_number;
+
+static void fail(const char* message, const std::string& detail = "") {
+  fprintf(stderr, "%s:%d: %s%s%s\n", path, line_number, message, detail.empty() ? "" : ": ", detail.c_str());
+  exit(1);
+}
+
+static std::string trim(const std::string& s) {
+  size_t start = s.find_first_not_of(" \t\r\n");
+  size_t end = s.find_last_not_of(" \t\r\n");
+  return start == std::string::npos ? "" : s.substr(start, end - start + 1);
+}
+
+static uint8_t parseRegister(const std::string& s) {
+  if (s == "t" || s == "time") return 0;
+  if (s == "strip") return 1;
+  if (s == "strips") return 2;
+  if (s == "white") return 3;
+  char* end;
+  if (s.size() < 2 || s[0] != 'r') fail("expected a register", s);
+  long r = strtol(s.c_str() + 1, &end, 10);
+  if (*end || r < 0 || r >= BYTECODE_REGISTERS) fail("no such register", s);
+  return r;
+}
+
+static int64_t parseNumber(const std::string& s) {
+  char* end;
+  double value = strtod(s.c_str(), &end);
+  std::string unit = end;
+  if (end == s.c_str()) fail("expected a number", s);
+  if (unit.empty()) {
+    return strtoll(s.c_str(), nullptr, 0);  // keeps hex exact
+  } else if (unit == "hz") {
+    return llround(value * 4294967296.0 / 1000);  // phase per ms
+  } else if (unit == "deg") {
+    return (int64_t)(uint32_t)llround(value / 360 * 4294967296.0);
+  } else if (unit == "%") {
+    return value >= 100 ? 0xFFFFFFFF : (int64_t)(uint32_t)llround(value / 100 * 4294967296.0);
+  }
+  fail("unknown unit", unit);
+  return 0;
+}
+
+static Instruction make(uint8_t op, uint8_t a, uint8_t b, uint8_t c) {
+  Instruction in = { op, a, b, c };
+  return in;
+}
+
+static void assembleLine(Program& program, const std::string& mnemonic, const std::vector<std::string>& operands) {
+  const Mnemonic* m = nullptr;
+  for (const Mnemonic& candidate : MNEMONICS) {
+    if (mnemonic == candidate.name) m = &candidate;
+  }
+  if (!m) fail("unknown instruction", mnemonic);
+  if (operands.size() != strlen(m->operands)) fail("wrong number of operands for", mnemonic);
+
+  uint8_t regs[3] = { 0, 0, 0 };
+  int64_t imm = 0;
+  std::string label;
+  for (size_t i = 0; i < operands.size(); i++) {
+    char kind = m->operands[i];
+    if (kind == 'r') regs[i] = parseRegister(operands[i]);
+    if (kind == 'i') imm = parseNumber(operands[i]);
+    if (kind == 'l') label = operands[i];
+  }
+
+  if (m->op == OP_LI || m->op == OP_ADDI) {
+    if (imm < INT32_MIN || imm > UINT32_MAX) fail("number does not fit in 32 bits", operands[1]);
+    uint32_t value = (uint32_t)imm;
+    bool fits = (int32_t)value >= -32768 && (int32_t)value <= 32767;
+    if (m->op == OP_ADDI && !fits) fail("addi takes a 16 bit number", operands[1]);
+    program.code.push_back(make(m->op, regs[0], value >> 8 & 0xFF, value & 0xFF));
+    if (!fits) program.code.push_back(make(OP_LIH, regs[0], value >> 24, value >> 16 & 0xFF));
+    return;
+  }
+
+  if (!label.empty()) program.fixups.push_back(std::make_pair(label, (int)program.code.size()));
+  program.code.push_back(make(m->op, regs[0], regs[1], regs[2]));
+}
+
+static void finish(Program& program) {
+  for (auto& fixup : program.fixups) {
+    int target = -1;
+    for (auto& label : program.labels) {
+      if (label.first == fixup.first) target = label.second;
+    }
+    if (target < 0) fail("no such label", fixup.first);
+    int skip = target - fixup.second - 1;
+    if (skip <= 0) fail("branches can only jump forwards", fixup.first);
+    if (skip > 255) fail("branch too long", fixup.first);
+    program.code[fixup.second].c = skip;
+  }
+  if (program.code.size() > BYTECODE_MAX_LENGTH) fail("program longer than BYTECODE_MAX_LENGTH", program.name);
+  if (!BytecodeProgram::validate(program.code.data(), program.code.size())) fail("program does not validate", program.name);
+}
+
+static std::vector<Program> assemble(const char* source) {
+  path = source;
+  FILE* f = fopen(source, "r");
+  if (!f) {
+    perror(source);
+    exit(1);
+  }
+  std::vector<Program> programs;
+  Program* current = nullptr;
+  char buffer[256];
+  line_number = 0;
+  while (fgets(buffer, sizeof(buffer), f)) {
+    line_number++;
+    std::string line = buffer;
+    line = trim(line.substr(0, line.find(';')));
+    if (line.empty()) continue;
+
+    size_t space = line.find_first_of(" \t");
+    std::string word = line.substr(0, space);
+    std::string rest = space == std::string::npos ? "" : trim(line.substr(space));
+
+    if (word == "program") {
+      if (current) fail("program inside a program");
+      if (rest.empty() || rest.size() >= BYTECODE_NAME_SIZE) fail("program names are 1-15 characters", rest);
+      programs.push_back(Program());
+      current = &programs.back();
+      current->name = rest;
+    } else if (!current) {
+      fail("instruction outside a program", word);
+    } else if (word == "end") {
+      finish(*current);
+      current = nullptr;
+    } else if (word.back() == ':' && rest.empty()) {
+      current->labels.push_back(std::make_pair(word.substr(0, word.size() - 1), (int)current->code.size()));
+    } else {
+      std::vector<std::string> operands;
+      size_t start = 0;
+      while (!rest.empty() && start <= rest.size()) {
+        size_t comma = rest.find(',', start);
+        operands.push_back(trim(rest.substr(start, comma == std::string::npos ? std::string::npos : comma - start)));
+        if (comma == std::string::npos) break;
+        start = comma + 1;
+      }
+      assembleLine(*current, word, operands);
+    }
+  }
+  fclose(f);
+  if (current) fail("missing end for program", current->name);
+  if (programs.size() > BYTECODE_MAX_PROGRAMS) fail("more than BYTECODE_MAX_PROGRAMS programs");
+  return programs;
+}
+
+static std::vector<uint8_t> link(const std::vector<Program>& programs) {
+  ProgramImageHeader header = { BYTECODE_MAGIC, BYTECODE_VERSION, (uint16_t)programs.size() };
+  std::vector<ProgramEntry> entries;
+  std::vector<Instruction> code;
+  for (const Program& program : programs) {
+    ProgramEntry entry = {};
+    strncpy(entry.name, program.name.c_str(), BYTECODE_NAME_SIZE - 1);
+    entry.start = code.size();
+    entry.length = program.code.size();
+    entries.push_back(entry);
+    code.insert(code.end(), program.code.begin(), program.code.end());
+  }
+  std::vector<uint8_t> image((const uint8_t*)&header, (const uint8_t*)(&header + 1));
+  image.insert(image.end(), (const uint8_t*)entries.data(), (const uint8_t*)(entries.data() + entries.size()));
+  image.insert(image.end(), (const uint8_t*)code.data(), (const uint8_t*)(code.data() + code.size()));
+  return image;
+}
+
+static std::vector<uint8_t> readImage(const char* file) {
+  FILE* f = fopen(file, "rb");
+  if (!f) {
+    perror(file);
+    exit(1);
+  }
+  std::vector<uint8_t> image;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    image.insert(image.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  return image;
+}
+
+// Runs one program against shadow strips the way the firmware would, a frame every step_ms.
+static int run(const std::vector<uint8_t>& image, const char* name, uint32_t duration_ms, uint32_t step_ms,
+               const char* csv_path, uint32_t sample_ms) {
+  ProgramStore store;
+  if (!store.open(image.data(), image.size())) {
+    fprintf(stderr, "not a valid program image\n");
+    return 1;
+  }
+  int index = -1;
+  for (int i = 0; i < store.getCount(); i++) {
+    if (!strcmp(store.name(i), name)) index = i;
+  }
+  if (index < 0) {
+    fprintf(stderr, "no program called %s\n", name);
+    return 1;
+  }
+
+  static LEDStrip strips[NUMBER_OF_STRIPS];
+  BytecodePattern<NUMBER_OF_STRIPS> pattern;
+  pattern.configure(strips, NUMBER_OF_STRIPS, store.program(index), true);
+
+  FILE* csv = csv_path ? fopen(csv_path, "w") : nullptr;
+  if (csv) {
+    fprintf(csv, "time_ms");
+    for (int i = 0; i < NUMBER_OF_STRIPS; i++) fprintf(csv, ",strip%d_level,strip%d_white_share", i, i);
+    fprintf(csv, "\n");
+  }
+
+  uint32_t frames = 0;
+  clock_t start = clock();
+  for (uint32_t t = 0; t < duration_ms; t += step_ms) {
+    pattern.render(t);
+    frames++;
+    if (csv && t % sample_ms == 0) {
+      fprintf(csv, "%u", t);
+      for (int i = 0; i < NUMBER_OF_STRIPS; i++) fprintf(csv, ",%u,%u", strips[i].getLevel(), strips[i].getWhiteShare());
+      fprintf(csv, "\n");
+    }
+  }
+  double wall_s = double(clock() - start) / CLOCKS_PER_SEC;
+  if (csv) fclose(csv);
+
+  printf("%s: %u instructions, %u frames of %d strips, %.2f us per frame on this machine\n", name,
+         store.program(index).getLength(), frames, NUMBER_OF_STRIPS,
+         frames ? wall_s * 1e6 / frames : 0.0);
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: pasm SOURCE -o IMAGE\n"
+          "       pasm IMAGE --run NAME [--ms MS] [--step-ms MS] [--csv FILE] [--sample-ms MS]\n");
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) usage();
+  const char* input = argv[1];
+  const char* output = nullptr;
+  const char* name = nullptr;
+  const char* csv = nullptr;
+  uint32_t duration_ms = 10000, step_ms = 5, sample_ms = 10;
+  for (int i = 2; i < argc; i++) {
+    const char* next = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!strcmp(argv[i], "-o") && next) {
+      output = argv[++i];
+    } else if (!strcmp(argv[i], "--run") && next) {
+      name = argv[++i];
+    } else if (!strcmp(argv[i], "--ms") && next) {
+      duration_ms = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--step-ms") && next) {
+      step_ms = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--csv") && next) {
+      csv = argv[++i];
+    } else if (!strcmp(argv[i], "--sample-ms") && next) {
+      sample_ms = atoi(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+  if (step_ms == 0 || sample_ms == 0) usage();
+
+  if (name) return run(readImage(input), name, duration_ms, step_ms, csv, sample_ms);
+  if (!output) usage();
+
+  std::vector<Program> programs = assemble(input);
+  std::vector<uint8_t> image = link(programs);
+  FILE* f = fopen(output, "wb");
+  if (!f || fwrite(image.data(), 1, image.size(), f) != image.size()) {
+    perror(output);
+    return 1;
+  }
+  fclose(f);
+  for (const Program& program : programs) {
+    fprintf(stderr, "%-16s %3u instructions\n", program.name.c_str(), (unsigned)program.code.size());
+  }
+  fprintf(stderr, "%u programs, %u bytes\n", (unsigned)programs.size(), (unsigned)image.size());
+  return 0;
+}
@@ -0,0 +1,653 @@
+// Host simulator for the LED dress sketches.
+// The sketch named by SKETCH is compiled as plain C++ against the mock HAL in host/hal, and driven
+// on a virtual clock so hours of pattern time run in milliseconds. At the end it reports what every
+// strip's H-bridge pins were driven with, and estimates how long a battery would last.
+//
+//   sim --mode 4 --hours 6               run selectActivePattern(4, ...) directly for 6 simulated hours
+//   sim --firmware --touch 4:1000:200    run setup()/loop() and press the pad on GPIO 4 at t=1s for 200ms
+//   sim --mode 2 --seconds 10 --csv wave.csv --sample-ms 10
+//   sim --mode 1 --hours 1 --no-idle     render every step even when nothing changes, as before idling
+//   sim --patterns build/patterns.bin --mode 10   run the second program in an image made by pasm
+//   sim --mode 2 --seconds 2 --trace wave.trace    record every pin write, for tracediff
+//   sim --firmware --verbose --send 4000:trace     type "trace" into the serial monitor at t=4s
+//   sim --firmware --seconds 60 --stats            print the runtime counters at the end, as "stats" does
+//   sim_audio --mode 9 --wav song.wav              play a WAV file into the audio input, looping it
+//   sim_sync --firmware --sync-peer 3000:40 --sync-mode 5000:4
+//                                                  another dress, 3 s ahead and 40 ppm fast, leads the shared
+//                                                  clock over the mock ESP-NOW and changes to mode 4 at t=5s
+
+#include "Arduino.h"
+#include "Wire.h"
+#include <time.h>
+#include <string>
+#include <vector>
+
+HardwareSerial Serial;  // defined before the sketch so they are constructed first
+EspClass ESP;
+TwoWire Wire;
+
+#include SKETCH
+
+struct StripPins {
+  uint8_t white;
+  uint8_t colour;
+};
+
+#if EXPANDER_CHIPS
+static StripPins stripPins[NUMBER_OF_STRIPS];  // the expander outputs, filled in by addExpanders
+#else
+static const StripPins stripPins[NUMBER_OF_STRIPS] = {
+  { STRIP_0_WHITE, STRIP_0_COLOUR },
+  { STRIP_1_WHITE, STRIP_1_COLOUR },
+  { STRIP_2_WHITE, STRIP_2_COLOUR },
+  { STRIP_3_WHITE, STRIP_3_COLOUR },
+  { STRIP_4_WHITE, STRIP_4_COLOUR },
+  { STRIP_5_WHITE, STRIP_5_COLOUR },
+};
+#endif
+
+// Power model for the battery estimate. The strip current is a guess for a strip of fairy lights, measure
+// the real strips and pass --strip-ma; the CPU figures are typical ESP32 datasheet numbers with the radios off.
+#define CPU_ACTIVE_MA 50   // rendering, at 240 MHz
+#define CPU_IDLE_MA 15     // blocked between frames at 80 MHz, with light sleep held off by the LEDC
+#define CPU_SLEEP_MA 1     // light sleep
+#define CPU_FRAME_US 150   // awake time per rendered frame
+
+struct ScriptedTouch {
+  uint8_t pin;
+  uint64_t start_ms;
+  uint64_t duration_ms;
+};
+
+struct ScriptedLine {  // typed into the serial monitor
+  uint64_t at_ms;
+  std::string text;
+};
+
+struct Options {
+  int mode = 0;
+  bool is_white = true;
+  bool firmware = false;
+  bool verbose = false;
+  bool idle = true;  // sleep through frames that would not change anything, as the firmware does
+  double strip_ma = 60;      // per strip, fully on
+  double battery_mah = 2000;
+  uint64_t duration_ms = 60000;
+  uint32_t step_ms = 1;  // matches the delay(1) at the end of loop()
+  const char* csv_path = nullptr;
+  const char* patterns_path = nullptr;  // image for the patterns partition
+  const char* trace_path = nullptr;     // where to dump the trace recorder at the end
+  bool stats = false;                   // print the runtime counters at the end
+  const char* wav_path = nullptr;       // what the audio input hears, builds with AUDIO_ENABLED only
+  bool sync_peer = false;               // builds with SYNC_ENABLED only, from here
+  int64_t peer_offset_us = 0;
+  double peer_ppm = 0;
+  uint64_t peer_mode_ms = 0;
+  int peer_mode = -1;
+  uint32_t sample_ms = 10;
+  std::vector<ScriptedTouch> touches;
+  std::vector<ScriptedLine> lines;
+};
+
+static void usage() {
+  fprintf(stderr,
+          "usage: sim [--mode N] [--colour] [--firmware] [--hours H | --seconds S | --ms MS]\n"
+          "           [--step-ms MS] [--csv FILE] [--sample-ms MS] [--touch PIN:START_MS:DUR_MS] [--verbose]\n"
+          "           [--no-idle] [--strip-ma MA] [--battery-mah MAH] [--patterns IMAGE] [--trace FILE]\n"
+          "           [--send MS:TEXT] [--stats] [--wav FILE] [--sync-peer OFFSET_MS:PPM [--sync-mode MS:MODE]]\n");
+  exit(2);
+}
+
+static Options parseArgs(int argc, char** argv) {
+  Options opt;
+  for (int i = 1; i < argc; i++) {
+    const char* a = argv[i];
+    const char* next = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!strcmp(a, "--mode") && next) {
+      opt.mode = atoi(argv[++i]);
+    } else if (!strcmp(a, "--colour")) {
+      opt.is_white = false;
+    } else if (!strcmp(a, "--firmware")) {
+      opt.firmware = true;
+    } else if (!strcmp(a, "--verbose")) {
+      opt.verbose = true;
+    } else if (!strcmp(a, "--stats")) {
+      opt.stats = true;
+    } else if (!strcmp(a, "--no-idle")) {
+      opt.idle = false;
+    } else if (!strcmp(a, "--strip-ma") && next) {
+      opt.strip_ma = atof(argv[++i]);
+    } else if (!strcmp(a, "--battery-mah") && next) {
+      opt.battery_mah = atof(argv[++i]);
+    } else if (!strcmp(a, "--hours") && next) {
+      opt.duration_ms = (uint64_t)(atof(argv[++i]) * 3600000.0);
+    } else if (!strcmp(a, "--seconds") && next) {
+      opt.duration_ms = (uint64_t)(atof(argv[++i]) * 1000.0);
+    } else if (!strcmp(a, "--ms") && next) {
+      opt.duration_ms = strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(a, "--step-ms") && next) {
+      opt.step_ms = atoi(argv[++i]);
+    } else if (!strcmp(a, "--csv") && next) {
+      opt.csv_path = argv[++i];
+    } else if (!strcmp(a, "--patterns") && next) {
+      opt.patterns_path = argv[++i];
+    } else if (!strcmp(a, "--sample-ms") && next) {
+      opt.sample_ms = atoi(argv[++i]);
+#if AUDIO_ENABLED
+    } else if (!strcmp(a, "--wav") && next) {
+      opt.wav_path = argv[++i];
+#endif
+#if SYNC_ENABLED
+    } else if (!strcmp(a, "--sync-peer") && next) {
+      long long offset_ms;
+      if (sscanf(argv[++i], "%lld:%lf", &offset_ms, &opt.peer_ppm) != 2) usage();
+      opt.peer_offset_us = offset_ms * 1000;
+      opt.sync_peer = true;
+    } else if (!strcmp(a, "--sync-mode") && next) {
+      unsigned long long at_ms;
+      if (sscanf(argv[++i], "%llu:%d", &at_ms, &opt.peer_mode) != 2) usage();
+      opt.peer_mode_ms = at_ms;
+#endif
+    } else if (!strcmp(a, "--trace") && next) {
+      opt.trace_path = argv[++i];
+    } else if (!strcmp(a, "--send") && next) {
+      const char* colon = strchr(argv[++i], ':');
+      if (!colon) usage();
+      ScriptedLine line;
+      line.at_ms = strtoull(argv[i], nullptr, 10);
+      line.text = std::string(colon + 1) + "\n";
+      opt.lines.push_back(line);
+    } else if (!strcmp(a, "--touch") && next) {
+      ScriptedTouch t;
+      unsigned pin;
+      unsigned long long start, dur;
+      if (sscanf(argv[++i], "%u:%llu:%llu", &pin, &start, &dur) != 3) usage();
+      t.pin = pin;
+      t.start_ms = start;
+      t.duration_ms = dur;
+      opt.touches.push_back(t);
+    } else {
+      usage();
+    }
+  }
+  if (opt.mode < 0 || opt.step_ms == 0 || opt.sample_ms == 0) usage();
+  if ((opt.sync_peer && !opt.firmware) || (opt.peer_mode >= 0 && !opt.sync_peer)) usage();
+  return opt;
+}
+
+static void loadPatterns(const char* path) {  // as if flashed to the patterns partition
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  std::vector<uint8_t> image;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    image.insert(image.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  hal::setPartition(BYTECODE_PARTITION_LABEL, BYTECODE_PARTITION_SUBTYPE, image);
+}
+
+#if AUDIO_ENABLED
+static uint32_t readLe(const uint8_t* p, int bytes) {
+  uint32_t v = 0;
+  for (int i = bytes - 1; i >= 0; i--) v = v << 8 | p[i];
+  return v;
+}
+
+static void loadWav(const char* path) {  // 16 bit PCM, mixed down to mono and resampled to what the ADC samples at
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  std::vector<uint8_t> file;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    file.insert(file.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  if (file.size() < 12 || memcmp(file.data(), "RIFF", 4) || memcmp(file.data() + 8, "WAVE", 4)) {
+    fprintf(stderr, "%s: not a WAV file\n", path);
+    exit(1);
+  }
+  uint32_t channels = 0, rate = 0, bits = 0, format = 0;
+  const uint8_t* data = nullptr;
+  uint32_t data_size = 0;
+  for (size_t at = 12; at + 8 <= file.size();) {
+    const uint8_t* chunk = file.data() + at;
+    uint32_t size = readLe(chunk + 4, 4);
+    if (size > file.size() - at - 8) size = file.size() - at - 8;  // a truncated file plays what there is
+    if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+      format = readLe(chunk + 8, 2);
+      channels = readLe(chunk + 10, 2);
+      rate = readLe(chunk + 12, 4);
+      bits = readLe(chunk + 22, 2);
+    } else if (!memcmp(chunk, "data", 4)) {
+      data = chunk + 8;
+      data_size = size;
+    }
+    at += 8 + size + (size & 1);
+  }
+  if (format != 1 || bits != 16 || channels == 0 || rate == 0 || !data) {
+    fprintf(stderr, "%s: only 16 bit PCM WAV files are supported\n", path);
+    exit(1);
+  }
+  std::vector<int16_t> mono(data_size / (2 * channels));
+  for (size_t i = 0; i < mono.size(); i++) {
+    int32_t sum = 0;
+    for (uint32_t c = 0; c < channels; c++) sum += (int16_t)readLe(data + 2 * (i * channels + c), 2);
+    mono[i] = sum / (int32_t)channels;
+  }
+  std::vector<int16_t> samples((uint64_t)mono.size() * AUDIO_SAMPLE_RATE / rate);
+  for (size_t i = 0; i < samples.size(); i++) {  // linear interpolation is plenty for band levels
+    double t = (double)i * rate / AUDIO_SAMPLE_RATE;
+    size_t a = (size_t)t;
+    size_t b = a + 1 < mono.size() ? a + 1 : a;
+    samples[i] = (int16_t)lrint(mono[a] + (mono[b] - mono[a]) * (t - a));
+  }
+  hal::setAudio(samples);
+}
+
+static bool reportAudio() {  // false if sound took more than a frame to reach the strips
+  const CostCounter& latency = audioAnalyser.getLatency();
+  const CostCounter& analysis = audioAnalyser.getAnalysis();
+  if (analysis.count == 0) return true;
+  uint32_t period_us = 1000000 / RENDER_RATE_HZ;
+  printf("audio: %u blocks, %u beats, analysis %u us a block on average and %u at most, "
+         "sound to light %u us on average and %u us at most of the %u us frame period\n",
+         analysis.count, audioAnalyser.getBeats(), analysis.mean(), analysis.max_us, latency.mean(), latency.max_us,
+         period_us);
+  return latency.max_us <= period_us;
+}
+#endif
+
+#if SYNC_ENABLED
+class PeerTransport : public SyncTransport {
+
+  // another dress on the mock ESP-NOW air, which the sketch hears at once; sim_sync is built with a
+  // SYNC_LINK_US of 0 to match. It does not listen, it only leads.
+
+public:
+  bool begin() override {
+    return true;
+  }
+
+  bool send(const uint8_t* bytes, int length) override {
+    hal::airDeliver(bytes, length);
+    return true;
+  }
+
+  bool receive(SyncPacket& packet) override {
+    return false;
+  }
+};
+
+struct SyncPeer {
+  PeerTransport transport;
+  SyncClock clock;
+  int64_t offset_us;
+  double ppm;
+
+  uint64_t localUs() const {
+    return (uint64_t)(this->offset_us + (int64_t)hal::now() + (int64_t)(hal::now() * this->ppm / 1e6));
+  }
+};
+
+struct SyncResult {
+  int64_t max_error_us = 0;  // between the sketch's shared time and the peer's, after the first second
+  int64_t last_error_us = 0;
+  uint32_t mode_at_ms = 0;   // when the peer's mode change was for, in shared ms
+  uint32_t mode_shown_ms = 0;  // and the shared ms of the frame that first showed it
+  uint32_t shared_changes = 0;  // deferred ones, this dress's own or a peer's, made so far
+  int32_t max_shared_late_ms = 0;  // how long after its moment the latest of them was made
+  bool pending = false;  // the one at the front of the sketch's deferred queue, for pending_ms
+  uint32_t pending_ms = 0;
+};
+
+static void watchShared(SyncResult& result) {  // after each loop(), as the sketch applies its deferred changes
+  if (result.pending && (deferred_count == 0 || deferred[0].at_ms != result.pending_ms)) {
+    int32_t late = (int32_t)(last_render_ms - result.pending_ms);
+    if (late < 0) late = 1000000;  // made early is as far out of step as made late
+    if (late > result.max_shared_late_ms) result.max_shared_late_ms = late;
+    result.shared_changes++;
+    result.pending = false;
+  }
+  if (deferred_count > 0 && !result.pending) {
+    result.pending = true;
+    result.pending_ms = deferred[0].at_ms;
+  }
+}
+
+static bool reportShared(const SyncResult& result) {  // false if a shared change missed the frame it was for
+  if (result.shared_changes == 0) return true;
+  printf("sync: %u shared changes, made up to %d ms after the moment they were for\n", result.shared_changes,
+         (int)result.max_shared_late_ms);
+  return result.max_shared_late_ms <= 1000 / RENDER_RATE_HZ;
+}
+
+static int64_t syncError(const SyncPeer& peer) {
+  SyncEstimate estimate;
+  syncClock.latest(estimate);
+  return (int64_t)(estimate.sharedUs(SyncClock::localUs()) - peer.clock.sharedUs(peer.localUs()));
+}
+
+static bool reportSync(const Options& opt, const SyncResult& result) {  // false if the sketch did not keep in step
+  printf("sync: following %08x, %u beacons, %u dropped, the shared time %lld us off the peer's at the end and "
+         "%lld us at most\n", (unsigned)syncClock.getLeader(), syncClock.getBeacons(),
+         syncClock.getDroppedBeacons(), (long long)result.last_error_us, (long long)result.max_error_us);
+  bool ok = syncClock.getLeader() == 0 && result.max_error_us <= 1000;
+  if (opt.peer_mode >= 0) {
+    printf("sync: mode %d was for %u ms of shared time, and first shown at %u ms\n", opt.peer_mode, result.mode_at_ms,
+           result.mode_shown_ms);
+    int32_t late = (int32_t)(result.mode_shown_ms - result.mode_at_ms);
+    ok = ok && result.mode_shown_ms && late >= 0 && late <= 1000 / RENDER_RATE_HZ;  // within the frame it was for
+  }
+  return ok;
+}
+#endif
+
+#if EXPANDER_CHIPS
+static void addExpanders() {  // the boards the sketch expects, on the mock I2C bus
+  for (int b = 0; b < EXPANDER_CHIPS; b++) {
+    hal::addPca9685(PCA9685_ADDRESS + b);
+  }
+  for (int i = 0; i < NUMBER_OF_STRIPS; i++) {
+    stripPins[i].white = hal::expanderPin(i / PCA9685_STRIPS, 2 * i % PCA9685_CHANNELS);
+    stripPins[i].colour = hal::expanderPin(i / PCA9685_STRIPS, (2 * i + 1) % PCA9685_CHANNELS);
+  }
+}
+#endif
+
+static void applyTouches(const Options& opt, uint64_t now_ms) {
+  for (const ScriptedTouch& t : opt.touches) {  // release every scripted pin, then press the ones in an active window
+    hal::setTouch(t.pin, 70);
+    hal::setDigital(t.pin, HIGH);
+  }
+  for (const ScriptedTouch& t : opt.touches) {
+    if (now_ms >= t.start_ms && now_ms < t.start_ms + t.duration_ms) {
+      hal::setTouch(t.pin, 0);  // pads and buttons share the script
+      hal::setDigital(t.pin, LOW);
+    }
+  }
+}
+
+static void sendLines(Options& opt, uint64_t now_ms) {
+  for (ScriptedLine& line : opt.lines) {
+    if (now_ms >= line.at_ms && !line.text.empty()) {
+      Serial.receive((const uint8_t*)line.text.data(), line.text.size());
+      line.text.clear();  // sent
+    }
+  }
+}
+
+struct FileOut {  // lets TraceRecorder::dump write to a file
+  FILE* f;
+  size_t write(uint8_t c) {
+    return fputc(c, this->f) == EOF ? 0 : 1;
+  }
+};
+
+static bool writeTrace(const char* path) {
+  FileOut out = { fopen(path, "wb") };
+  if (!out.f) {
+    perror(path);
+    return false;
+  }
+  traceRecorder.dump(out);
+  fclose(out.f);
+  return true;
+}
+
+static void writeCsvHeader(FILE* f) {
+  fprintf(f, "time_ms");
+  for (int i = 0; i < NUMBER_OF_STRIPS; i++) {
+    fprintf(f, ",strip%d_white,strip%d_colour", i, i);
+  }
+  fprintf(f, "\n");
+}
+
+static void writeCsvRow(FILE* f, uint64_t now_ms) {
+  fprintf(f, "%llu", (unsigned long long)now_ms);
+  for (int i = 0; i < NUMBER_OF_STRIPS; i++) {
+    fprintf(f, ",%u,%u", hal::pin(stripPins[i].white).duty, hal::pin(stripPins[i].colour).duty);
+  }
+  fprintf(f, "\n");
+}
+
+// what the mode run renders after a frame, as Crossfade::nextChangeMs does for the firmware
+static uint32_t nextChangeMs(Pattern* pattern, uint32_t time_ms) {
+  for (int i = 0; i < NUMBER_OF_STRIPS; i++) {
+    if (ledStripArray[i].changed()) return 1;  // still dithering
+  }
+  uint32_t next = pattern->nextChangeMs(time_ms);
+  uint32_t limit = currentLimiter.nextChangeMs();
+  return limit < next ? limit : next;
+}
+
+static void reportBattery(const Options& opt, uint64_t sim_ms, uint32_t frames) {
+  if (sim_ms == 0) return;
+  double led_ma = 0;
+  for (int i = 0; i < NUMBER_OF_STRIPS; i++) {  // one side of a strip is on at a time, so the duties add
+    for (int c = 0; c < 2; c++) {
+      uint8_t p = c == 0 ? stripPins[i].white : stripPins[i].colour;
+      double full = 1u << hal::pin(p).resolution_bits;
+      led_ma += opt.strip_ma * hal::dutyIntegral(p) / (sim_ms * 1000.0) / full;
+    }
+  }
+  double awake = frames * (double)CPU_FRAME_US / (sim_ms * 1000.0);
+  if (awake > 1) awake = 1;
+  double locked = hal::sleepLockedUs() / (sim_ms * 1000.0);  // light sleep held off for this much of the time
+  double asleep = (1 - awake) * (1 - locked);
+  double cpu_ma = awake * CPU_ACTIVE_MA + (1 - awake - asleep) * CPU_IDLE_MA + asleep * CPU_SLEEP_MA;
+  if (!opt.idle) {  // loop() used to spin flat out, with no power management
+    asleep = 0;
+    cpu_ma = CPU_ACTIVE_MA;
+  }
+  printf("battery: LEDs %.1f mA + CPU %.1f mA (%.1f frames/s, light sleep %.0f%% of the time) = %.1f h on %.0f mAh\n",
+         led_ma, cpu_ma, frames * 1000.0 / sim_ms, asleep * 100, opt.battery_mah / (led_ma + cpu_ma), opt.battery_mah);
+}
+
+static double stripCurrentMa() {  // what the strips draw now, from their pins and the limiter's strip model
+  double ma = 0;
+  for (int i = 0; i < NUMBER_OF_STRIPS; i++) {
+    const hal::PinState& white = hal::pin(stripPins[i].white);
+    const hal::PinState& colour = hal::pin(stripPins[i].colour);
+    double full = 1u << white.resolution_bits;
+    ma += (LIMIT_STRIP_WHITE_MA * (double)white.duty + LIMIT_STRIP_COLOUR_MA * (double)colour.duty) / full;
+  }
+  return ma;
+}
+
+static bool reportCurrent(uint64_t sim_ms, double max_ma) {  // false if the strips ever drew over the peak budget
+  double step_ma = (LIMIT_STRIP_WHITE_MA > LIMIT_STRIP_COLOUR_MA ? LIMIT_STRIP_WHITE_MA : LIMIT_STRIP_COLOUR_MA) /
+                   (double)(1u << hal::pin(stripPins[0].white).resolution_bits);
+  printf("current: %.1f mA at most of the %d mA budget (%d mA sustained), %u frames limited, %.1f mA on average "
+         "by the limiter's count\n",
+         max_ma, CURRENT_PEAK_MA, CURRENT_SUSTAINED_MA, currentLimiter.getLimitedFrames(),
+         sim_ms ? currentLimiter.getEnergyUah(millis()) * 3600.0 / sim_ms : 0.0);
+  return max_ma <= CURRENT_PEAK_MA + 2 * NUMBER_OF_STRIPS * step_ma;  // dithering can add an LEDC step a pin
+}
+
+static bool reportI2c(uint64_t sim_ms, uint32_t frames) {  // false if a frame's writes would not fit in its period
+  const hal::State& s = hal::state();
+  if (s.i2c_transactions == 0) return true;
+  uint32_t period_us = 1000000 / RENDER_RATE_HZ;
+  printf("i2c: %u transactions, %llu bytes, bus busy %.1f%% of the time, %.0f us a frame on average, "
+         "%llu us at most of the %u us frame period, %u failed\n",
+         s.i2c_transactions, (unsigned long long)s.i2c_bytes, sim_ms ? s.i2c_bus_us / (sim_ms * 10.0) : 0.0,
+         frames ? (double)s.i2c_bus_us / frames : 0.0, (unsigned long long)s.i2c_max_burst_us, period_us,
+         s.i2c_failures);
+  return s.i2c_max_burst_us <= period_us && s.i2c_failures == 0;
+}
+
+static void report(uint64_t sim_ms, double wall_s) {
+  printf("simulated %.3f s in %.3f s wall (%.0fx real time)\n", sim_ms / 1000.0, wall_s,
+         wall_s > 0 ? sim_ms / 1000.0 / wall_s : 0.0);
+  printf("strip pin  mean_duty  min  max    changes      writes  (duty out of %u)\n", 1u << hal::pin(stripPins[0].white).resolution_bits);
+  for (int i = 0; i < NUMBER_OF_STRIPS; i++) {
+    for (int c = 0; c < 2; c++) {
+      uint8_t p = c == 0 ? stripPins[i].white : stripPins[i].colour;
+      const hal::PinState& s = hal::pin(p);
+      double mean = sim_ms ? hal::dutyIntegral(p) / (sim_ms * 1000.0) : 0.0;
+      printf("%5d %3u %10.2f %4u %4u %10u %11u  %s\n", i, p, mean, s.writes ? s.min_duty : s.duty,
+             s.writes ? s.max_duty : s.duty, s.changes, s.writes, c == 0 ? "white" : "colour");
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  Options opt = parseArgs(argc, argv);
+  Serial.setEnabled(opt.verbose);
+  if (opt.patterns_path) loadPatterns(opt.patterns_path);
+#if AUDIO_ENABLED
+  if (opt.wav_path) loadWav(opt.wav_path);
+#endif
+
+  FILE* csv = nullptr;
+  if (opt.csv_path) {
+    csv = fopen(opt.csv_path, "w");
+    if (!csv) {
+      perror(opt.csv_path);
+      return 1;
+    }
+    writeCsvHeader(csv);
+  }
+
+#if EXPANDER_CHIPS
+  addExpanders();
+#endif
+  for (int i = 0; i < NUMBER_OF_STRIPS; i++) {
+    hal::watchBridge(stripPins[i].white, stripPins[i].colour);
+  }
+
+  Pattern* pattern = nullptr;
+#if SYNC_ENABLED
+  SyncPeer peer;
+  SyncResult sync;
+  peer.offset_us = opt.peer_offset_us;
+  peer.ppm = opt.peer_ppm;
+  peer.clock.begin(&peer.transport, 0, peer.localUs());  // the lowest id there is
+#endif
+  if (opt.firmware) {
+    setup();
+  } else {
+    if (opt.idle) power.begin();
+    currentLimiter.begin(CURRENT_PEAK_MA, CURRENT_SUSTAINED_MA, CURRENT_BURST_MAS);  // as setup() does
+#if EXPANDER_CHIPS
+    attachExpanderStrips();
+#endif
+    programStore.begin();
+#if AUDIO_ENABLED
+    audioInput.begin();
+#endif
+    if (opt.mode >= TOTAL_MODES + programStore.getCount()) usage();
+    pattern = selectActivePattern(opt.mode, opt.is_white, ledStripArray, NUMBER_OF_STRIPS, patternPools[0]);
+  }
+
+  uint64_t start_ms = hal::now() / 1000;
+  uint64_t end_ms = start_ms + opt.duration_ms;
+  uint64_t next_sample_ms = start_ms;
+  uint64_t next_render_ms = start_ms;
+  uint32_t start_frames = renderScheduler.getTotalFrames();
+  uint32_t frames = 0;
+  double max_ma = 0;
+  hal::resetStats();
+
+  clock_t wall_start = clock();
+  while (hal::now() / 1000 < end_ms) {
+    uint64_t now_ms = hal::now() / 1000;
+    applyTouches(opt, now_ms - start_ms);
+    sendLines(opt, now_ms - start_ms);
+    if (opt.firmware) {
+#if SYNC_ENABLED
+      if (opt.sync_peer) {
+        peer.clock.update(peer.localUs());
+        if (opt.peer_mode >= 0 && sync.mode_at_ms == 0 && now_ms - start_ms >= opt.peer_mode_ms) {
+          Command command = { CMD_SET_MODE, opt.peer_mode };
+          sync.mode_at_ms = peer.clock.broadcast(command, peer.localUs());
+        }
+      }
+#endif
+      loop();  // loop() ends in delay(1), which moves the virtual clock
+#if SYNC_ENABLED
+      if (opt.sync_peer && now_ms - start_ms >= 1000) {
+        sync.last_error_us = syncError(peer);
+        int64_t error = sync.last_error_us < 0 ? -sync.last_error_us : sync.last_error_us;
+        if (error > sync.max_error_us) sync.max_error_us = error;
+      }
+      if (sync.mode_at_ms && !sync.mode_shown_ms && render_mode == opt.peer_mode) sync.mode_shown_ms = last_render_ms;
+      watchShared(sync);
+#endif
+    } else {
+      if (now_ms >= next_render_ms) {
+#if AUDIO_ENABLED
+        audioInput.poll();  // as renderFrame does
+#endif
+        uint32_t render_start = RuntimeStats::now();
+        pattern->update(millis());
+        uint32_t render_us = RuntimeStats::now() - render_start;
+        power.update(ledStripArray, NUMBER_OF_STRIPS);
+        runtimeStats.recordFrame(opt.mode, render_us, RuntimeStats::now() - render_start);
+        frames++;
+        uint32_t idle_ms = opt.idle ? nextChangeMs(pattern, millis()) : 1;
+        next_render_ms = now_ms + (idle_ms < RENDER_MAX_IDLE_MS ? idle_ms : RENDER_MAX_IDLE_MS);
+      }
+      delay(opt.step_ms);
+    }
+    if (csv && now_ms >= next_sample_ms) {
+      writeCsvRow(csv, now_ms - start_ms);
+      next_sample_ms += opt.sample_ms;
+    }
+    double ma = stripCurrentMa();
+    if (ma > max_ma) max_ma = ma;
+  }
+  double wall_s = double(clock() - wall_start) / CLOCKS_PER_SEC;
+
+  if (csv) fclose(csv);
+  if (opt.trace_path && !writeTrace(opt.trace_path)) return 1;
+  report(hal::now() / 1000 - start_ms, wall_s);
+  if (opt.stats) {
+    Serial.setEnabled(true);
+    runtimeStats.report(Serial, TOTAL_MODES + programStore.getCount());
+    currentLimiter.report(Serial);
+#if AUDIO_ENABLED
+    audioAnalyser.report(Serial);
+#endif
+  }
+  uint32_t total_frames = opt.firmware ? renderScheduler.getTotalFrames() - start_frames : frames;
+  reportBattery(opt, hal::now() / 1000 - start_ms, total_frames);
+  if (!reportCurrent(hal::now() / 1000 - start_ms, max_ma)) {
+    printf("the strips drew more than the current budget\n");
+    return 1;
+  }
+  if (!reportI2c(hal::now() / 1000 - start_ms, total_frames)) {
+    printf("the expanders could not keep up\n");
+    return 1;
+  }
+#if SYNC_ENABLED
+  if (opt.sync_peer && !reportSync(opt, sync)) {
+    printf("the sketch did not keep in step with the peer\n");
+    return 1;
+  }
+  if (!reportShared(sync)) {
+    printf("the sketch made a shared change after its moment\n");
+    return 1;
+  }
+#endif
+#if AUDIO_ENABLED
+  if (!reportAudio()) {
+    printf("sound took more than a frame to reach the strips\n");
+    return 1;
+  }
+#endif
+  if (hal::state().overlaps) {
+    printf("%u writes left both sides of an H-bridge on\n", hal::state().overlaps);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,239 @@
+// Checks the shared clock of multi/Sync.h between four simulated dresses, each with its own crystal: booted
+// at different times, with clocks seconds apart that run up to 50 ppm fast or slow. They talk through a
+// loopback stand-in for ESP-NOW that delays every packet by about SYNC_LINK_US, holds a few up for
+// milliseconds and loses some. The leader is switched off partway and comes back later, and a mode change
+// from one dress has to land at the same moment on all of them. Exits 1 on the first check that fails;
+// make check runs it.
+
+#include "Arduino.h"
+#include <deque>
+#include <vector>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+#include "../multi/Sync.h"
+
+#define NODES 4
+#define STEP_US 100             // of true time
+#define POLL_MS 10              // each dress runs update() this often, as loop() does
+#define JITTER_US 300           // packets take SYNC_LINK_US give or take half this
+#define HELD_PERCENT 3          // and these are held up for another 1 to 8 ms
+#define LOST_PERCENT 10
+#define MAX_PHASE_ERROR_US 1000
+
+static uint64_t true_us = 0;
+static int checks = 0;
+static uint32_t seed = 12345;
+
+static uint32_t random32() {  // the same run every time
+  seed = seed * 1664525 + 1013904223;
+  return seed >> 8;
+}
+
+static void check(bool ok, const char* what) {
+  checks++;
+  if (ok) return;
+  printf("synctest: %s, at %.3f s\n", what, true_us / 1e6);
+  exit(1);
+}
+
+class LoopbackTransport;
+
+struct Node {
+  uint32_t id;
+  int64_t offset_us;  // of its clock from true time at boot
+  double ppm;
+  bool on;
+  int poll_phase_ms;
+  SyncClock* clock;
+  LoopbackTransport* transport;
+  std::vector<Command> received;
+
+  uint64_t localUs(uint64_t t) const {
+    return (uint64_t)(this->offset_us + (int64_t)t + (int64_t)(t * this->ppm / 1e6));
+  }
+};
+
+static Node nodes[NODES];
+
+struct InFlight {
+  uint64_t arrives_us;
+  int to;
+  SyncPacket packet;
+};
+static std::vector<InFlight> air;
+
+class LoopbackTransport : public SyncTransport {
+
+  // one dress's radio on the simulated air, which every other dress that is on hears
+
+private:
+  int node;
+
+public:
+  std::deque<SyncPacket> inbox;
+
+  LoopbackTransport(int node)
+    : node(node) {}
+
+  bool begin() override {
+    return true;
+  }
+
+  bool send(const uint8_t* bytes, int length) override {
+    for (int i = 0; i < NODES; i++) {
+      if (i == this->node || !nodes[i].on || random32() % 100 < LOST_PERCENT) continue;
+      InFlight f;
+      f.arrives_us = true_us + SYNC_LINK_US - JITTER_US / 2 + random32() % JITTER_US;
+      if (random32() % 100 < HELD_PERCENT) f.arrives_us += 1000 + random32() % 7000;
+      f.to = i;
+      memcpy(f.packet.bytes, bytes, length);
+      f.packet.length = length;
+      air.push_back(f);
+    }
+    return true;
+  }
+
+  bool receive(SyncPacket& packet) override {
+    if (this->inbox.empty()) return false;
+    packet = this->inbox.front();
+    this->inbox.pop_front();
+    return true;
+  }
+};
+
+static void boot(int i) {
+  Node& n = nodes[i];
+  delete n.clock;
+  delete n.transport;
+  n.offset_us -= (int64_t)n.localUs(true_us);  // its clock starts again from 0
+  n.clock = new SyncClock();
+  n.transport = new LoopbackTransport(i);
+  n.clock->begin(n.transport, n.id, n.localUs(true_us));
+  n.on = true;
+}
+
+static uint64_t sharedUs(const Node& n) {  // as the render task reads it
+  SyncEstimate estimate;
+  n.clock->latest(estimate);
+  return estimate.sharedUs(n.localUs(true_us));
+}
+
+static int leaders(uint32_t& leader) {
+  int count = 0;
+  for (Node& n : nodes) {
+    if (n.on && n.clock->isLeading()) {
+      count++;
+      leader = n.id;
+    }
+  }
+  return count;
+}
+
+static double error_total = 0;
+static uint64_t error_samples = 0;
+static int64_t error_max = 0;
+
+// moves true time on to end_us; measuring, the spread of the shared time across the dresses that are on
+static void runTo(uint64_t end_us, bool measure) {
+  for (; true_us < end_us; true_us += STEP_US) {
+    for (size_t i = 0; i < air.size();) {
+      if (air[i].arrives_us > true_us) {
+        i++;
+        continue;
+      }
+      Node& n = nodes[air[i].to];
+      if (n.on) {
+        air[i].packet.rx_us = n.localUs(air[i].arrives_us);
+        n.transport->inbox.push_back(air[i].packet);
+      }
+      air.erase(air.begin() + i);
+    }
+    for (Node& n : nodes) {
+      if (!n.on || (true_us / 1000 + n.poll_phase_ms) % POLL_MS != 0 || true_us % 1000 != 0) continue;
+      n.clock->update(n.localUs(true_us));
+      Command command;
+      while (n.clock->nextCommand(command)) n.received.push_back(command);
+    }
+    if (!measure) continue;
+    uint64_t low = UINT64_MAX, high = 0;
+    for (Node& n : nodes) {
+      if (!n.on) continue;
+      uint64_t shared = sharedUs(n);
+      if (shared < low) low = shared;
+      if (shared > high) high = shared;
+    }
+    int64_t spread = (int64_t)(high - low);
+    error_total += spread;
+    error_samples++;
+    if (spread > error_max) error_max = spread;
+    if (spread > MAX_PHASE_ERROR_US) break;
+  }
+  if (measure) check(error_max <= MAX_PHASE_ERROR_US, "the dresses are more than a millisecond apart");
+}
+
+int main() {
+  const uint32_t ids[NODES] = { 0x300, 0x100, 0x200, 0x400 };
+  const int64_t offsets_us[NODES] = { 5000000, 8200000, 17000000, 2500000 };
+  const double ppm[NODES] = { 40, -35, 12, -50 };
+  for (int i = 0; i < NODES; i++) {
+    nodes[i] = { ids[i], offsets_us[i], ppm[i], false, 3 * i, nullptr, nullptr, {} };
+  }
+
+  for (int i = 0; i < NODES; i++) {  // switched on one after another
+    boot(i);
+    runTo(true_us + 150000, false);
+  }
+  runTo(3000000, false);
+  uint32_t leader = 0;
+  check(leaders(leader) == 1 && leader == 0x300, "the first dress on is not the only leader");
+  runTo(10000000, true);
+
+  nodes[0].on = false;  // the leader goes
+  uint32_t epochs[NODES];
+  for (int i = 0; i < NODES; i++) {
+    SyncEstimate estimate;
+    nodes[i].clock->latest(estimate);
+    epochs[i] = estimate.epoch;
+  }
+  runTo(11000000, false);
+  check(leaders(leader) == 1 && leader != 0x300, "no one dress took over");
+  uint32_t second_leader = leader;
+  runTo(20000000, true);
+  for (int i = 1; i < NODES; i++) {
+    SyncEstimate estimate;
+    nodes[i].clock->latest(estimate);
+    check(estimate.epoch == epochs[i], "the shared time stepped when the leader went");
+  }
+
+  Command change = { CMD_SET_MODE, 4, 0, 0 };  // a pad pressed on the dress with id 0x200
+  uint32_t at_ms = nodes[2].clock->broadcast(change, nodes[2].localUs(true_us));
+  uint64_t applied_us[NODES] = { 0 };
+  uint64_t until = true_us + SYNC_COMMAND_LEAD_MS * 2000;
+  while (true_us < until) {
+    runTo(true_us + STEP_US, false);
+    for (int i = 1; i < NODES; i++) {
+      if (applied_us[i] == 0 && sharedUs(nodes[i]) / 1000 >= at_ms) applied_us[i] = true_us;
+    }
+  }
+  for (int i = 1; i < NODES; i++) {
+    if (i == 2) continue;
+    check(nodes[i].received.size() == 1, "a shared command did not arrive exactly once");
+    check(nodes[i].received[0].type == CMD_SET_MODE && nodes[i].received[0].value == 4
+            && nodes[i].received[0].at_ms == at_ms, "a shared command arrived changed");
+  }
+  for (int i = 1; i < NODES; i++) {
+    int64_t apart = (int64_t)(applied_us[i] - applied_us[2]);
+    check(applied_us[i] && apart <= 1000 && apart >= -1000, "a shared command landed at different moments");
+  }
+
+  boot(0);  // the first leader back, it joins in rather than taking over
+  runTo(true_us + 2000000, false);
+  check(leaders(leader) == 1 && leader == second_leader, "a dress coming back took over the clock");
+  runTo(true_us + 8000000, true);
+
+  printf("synctest: %d checks passed, the dresses %.0f us apart on average and %lld us at most\n", checks,
+         error_total / error_samples, (long long)error_max);
+  return 0;
+}
@@ -0,0 +1,217 @@
+// Compares two pin write traces from the trace recorder (multi/Trace.h), or prints one.
+// A trace is either a file written by sim --trace, or a capture of the serial monitor with a dump in it
+// after a "TRACE" line, from typing "trace" on the dress; the last dump in a capture is used.
+//
+//   tracediff golden/multi_mode_2.trace build/multi_mode_2.trace      exit 1 if they differ
+//   tracediff capture.log build/golden.trace --align --tolerance-us 2000
+//   tracediff --print capture.log
+//
+// Each strip's white and colour pins are compared write by write over the time both traces cover.
+// --align shifts the second trace so its first write lines up with the first trace's, for a dump from
+// the dress against a simulated run of the same mode; --tolerance-us allows for the dress's timing jitter.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define TRACE_MAGIC "LTRC"
+#define TRACE_VERSION 1
+#define TRACE_MAX_STRIPS 64
+
+struct Event {
+  int64_t time_us;
+  uint8_t strip;
+  uint8_t side;  // 0 white, 1 colour
+  uint16_t duty;
+  uint16_t hpoint;
+};
+
+struct Trace {
+  std::string path;
+  uint8_t resolution_bits;
+  std::vector<Event> events;
+};
+
+static std::vector<uint8_t> readFile(const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    exit(2);
+  }
+  std::vector<uint8_t> data;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(f);
+  return data;
+}
+
+static void fail(const char* path, const char* message) {
+  fprintf(stderr, "%s: %s\n", path, message);
+  exit(2);
+}
+
+struct Reader {
+  const std::vector<uint8_t>& data;
+  size_t at;
+  const char* path;
+
+  uint8_t byte() {
+    if (this->at >= this->data.size()) fail(this->path, "trace ends early");
+    return this->data[this->at++];
+  }
+  uint32_t word() {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)byte() << (8 * i);
+    return value;
+  }
+  uint32_t varint() {
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      uint8_t b = byte();
+      value |= (uint32_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) return value;
+    }
+    fail(this->path, "bad varint");
+    return 0;
+  }
+};
+
+static Trace readTrace(const char* path) {
+  std::vector<uint8_t> data = readFile(path);
+  size_t start = std::string::npos;
+  for (size_t i = 0; i + 4 <= data.size(); i++) {  // the last dump, a file from the sim is just one
+    if (memcmp(&data[i], TRACE_MAGIC, 4)) continue;
+    bool after_marker = (i >= 6 && !memcmp(&data[i - 6], "TRACE\n", 6)) || (i >= 7 && !memcmp(&data[i - 7], "TRACE\r\n", 7));
+    if (i == 0 || after_marker) start = i;  // the magic can turn up inside a dump's events too
+  }
+  if (start == std::string::npos) fail(path, "no trace in it");
+
+  Reader in = { data, start + 4, path };
+  Trace trace;
+  trace.path = path;
+  if (in.byte() != TRACE_VERSION) fail(path, "unknown trace version");
+  trace.resolution_bits = in.byte();
+  uint32_t count = in.word();
+  int64_t time_us = in.word();
+  for (uint32_t i = 0; i < count; i++) {
+    Event e;
+    time_us += in.varint();
+    e.time_us = time_us;
+    uint8_t where = in.byte();
+    e.strip = where >> 1;
+    e.side = where & 1;
+    e.duty = in.varint();
+    e.hpoint = in.varint();
+    trace.events.push_back(e);
+  }
+  return trace;
+}
+
+static void print(const Trace& trace) {
+  printf("%s: %u writes, duty out of %u\n", trace.path.c_str(), (unsigned)trace.events.size(), 1u << trace.resolution_bits);
+  printf("time_us,strip,side,duty,hpoint\n");
+  for (const Event& e : trace.events) {
+    printf("%lld,%u,%s,%u,%u\n", (long long)e.time_us, e.strip, e.side ? "colour" : "white", e.duty, e.hpoint);
+  }
+}
+
+// every write to one pin inside the window
+static std::vector<Event> pinWrites(const Trace& trace, int strip, int side, int64_t from_us, int64_t to_us, int64_t shift_us) {
+  std::vector<Event> writes;
+  for (const Event& e : trace.events) {
+    if (e.strip != strip || e.side != side) continue;
+    Event shifted = e;
+    shifted.time_us += shift_us;
+    if (shifted.time_us >= from_us && shifted.time_us <= to_us) writes.push_back(shifted);
+  }
+  return writes;
+}
+
+static int diff(const Trace& a, const Trace& b, bool align, int64_t tolerance_us) {
+  if (a.events.empty() || b.events.empty()) {
+    printf("%s\n", a.events.empty() == b.events.empty() ? "both traces are empty" : "one trace is empty");
+    return a.events.empty() == b.events.empty() ? 0 : 1;
+  }
+  if (a.resolution_bits != b.resolution_bits) {
+    printf("traces have different resolutions, %u and %u bits\n", a.resolution_bits, b.resolution_bits);
+    return 1;
+  }
+  int64_t shift_us = align ? a.events.front().time_us - b.events.front().time_us : 0;
+  int64_t a_first = a.events.front().time_us, b_first = b.events.front().time_us + shift_us;
+  int64_t from_us = a_first > b_first ? a_first : b_first;
+  if (a_first != b_first) from_us++;  // one started mid way, so its first frame may only be part of one
+  int64_t a_last = a.events.back().time_us, b_last = b.events.back().time_us + shift_us;
+  int64_t to_us = a_last < b_last ? a_last : b_last;
+  printf("comparing %lld us to %lld us%s\n", (long long)from_us, (long long)to_us, align ? ", second trace aligned" : "");
+
+  uint32_t compared = 0, differing = 0;
+  for (int strip = 0; strip < TRACE_MAX_STRIPS; strip++) {
+    for (int side = 0; side < 2; side++) {
+      std::vector<Event> x = pinWrites(a, strip, side, from_us, to_us, 0);
+      std::vector<Event> y = pinWrites(b, strip, side, from_us, to_us, shift_us);
+      size_t n = x.size() < y.size() ? x.size() : y.size();
+      uint32_t bad = 0;
+      size_t first_bad = n;
+      for (size_t i = 0; i < n; i++) {
+        int64_t dt = x[i].time_us - y[i].time_us;
+        if (x[i].duty != y[i].duty || x[i].hpoint != y[i].hpoint || dt > tolerance_us || -dt > tolerance_us) {
+          if (bad++ == 0) first_bad = i;
+        }
+      }
+      compared += n;
+      if (bad == 0 && x.size() == y.size()) continue;
+      differing += bad + (x.size() > y.size() ? x.size() - y.size() : y.size() - x.size());
+      printf("strip %d %s: %u of %u writes differ", strip, side ? "colour" : "white", bad, (unsigned)n);
+      if (x.size() != y.size()) printf(", %u writes against %u", (unsigned)x.size(), (unsigned)y.size());
+      printf("\n");
+      if (first_bad < n) {
+        printf("  first at write %u: %lld us duty %u hpoint %u, against %lld us duty %u hpoint %u\n", (unsigned)first_bad,
+               (long long)x[first_bad].time_us, x[first_bad].duty, x[first_bad].hpoint,
+               (long long)y[first_bad].time_us, y[first_bad].duty, y[first_bad].hpoint);
+      } else {
+        const Event& extra = x.size() > y.size() ? x[n] : y[n];
+        printf("  first extra write at %lld us, duty %u hpoint %u\n", (long long)extra.time_us, extra.duty, extra.hpoint);
+      }
+    }
+  }
+  printf("%u writes compared, %u differ\n", compared, differing);
+  return differing ? 1 : 0;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: tracediff TRACE_A TRACE_B [--align] [--tolerance-us US]\n"
+          "       tracediff --print TRACE\n");
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  std::vector<const char*> paths;
+  bool align = false, print_only = false;
+  int64_t tolerance_us = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--align")) {
+      align = true;
+    } else if (!strcmp(argv[i], "--print")) {
+      print_only = true;
+    } else if (!strcmp(argv[i], "--tolerance-us") && i + 1 < argc) {
+      tolerance_us = atoll(argv[++i]);
+    } else if (argv[i][0] == '-') {
+      usage();
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (print_only && paths.size() == 1) {
+    print(readTrace(paths[0]));
+    return 0;
+  }
+  if (print_only || paths.size() != 2) usage();
+  return diff(readTrace(paths[0]), readTrace(paths[1]), align, tolerance_us);
+}
@@ -0,0 +1,307 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include "driver/i2s.h"
+#include "Stats.h"
+#include "Log.h"
+
+#if defined(ESP32) && !defined(HOST_BUILD)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+// Sound in, for the audio reactive modes. A microphone or line-in on GPIO 36 is sampled by the ADC through
+// I2S0, whose DMA fills one AUDIO_HOP block while the last is being read, and a task on the input core runs
+// each block through a fixed point FFT into a level per band and a beat count. The render task reads the
+// newest result at its next frame, so sound reaches the strips within a frame of its block ending; the
+// stats report how long that actually took. The sketch only has any of this when built with AUDIO_ENABLED.
+
+#define AUDIO_SAMPLE_RATE 16000
+#define AUDIO_FFT_SIZE 256       // 62.5 Hz per bin
+#define AUDIO_HOP 64             // samples per DMA block, 4 ms, an FFT of the last AUDIO_FFT_SIZE every block
+#define AUDIO_BANDS 6
+#define AUDIO_NOISE_FLOOR 24     // band energy below this is silence, not worth lighting up for
+#define AUDIO_BEAT_RATIO_PCT 150  // a beat is bass this far above its recent average
+#define AUDIO_BEAT_GAP_US 250000  // and at least this long after the last, 240 bpm at most
+#define AUDIO_PIN 36              // ADC1 channel 0
+#define AUDIO_CORE 1              // with loop(), away from the render task
+#define AUDIO_PRIORITY 3          // above loop() and the log, below the render task
+#define AUDIO_STACK_SIZE 3072
+
+// the first bin of each band and the end of the last: 62-187 Hz, to 437, to 1 kHz, to 2.5, to 5, to 8
+static const uint8_t AUDIO_BAND_BINS[AUDIO_BANDS + 1] = { 1, 3, 7, 17, 41, 81, 128 };
+
+struct AudioFeatures {
+  uint16_t band[AUDIO_BANDS];  // 0-65535, each against its own recent peak
+  uint32_t beats;              // since begin, a change is a beat
+  uint32_t block_end_us;       // micros() when the last sample that went into this arrived
+  uint32_t sequence;           // blocks analysed, 0 before the first
+};
+
+
+template <int N>
+class FixedFft {
+
+  // In place radix 2 FFT of 16 bit samples, halving at every stage so nothing overflows: the output is
+  // the spectrum divided by N. The twiddles are built once in begin().
+
+  static_assert((N & (N - 1)) == 0, "FixedFft size must be a power of two");
+
+private:
+  int16_t cos_table[N / 2];
+  int16_t sin_table[N / 2];
+
+public:
+  void begin() {
+    for (int i = 0; i < N / 2; i++) {
+      this->cos_table[i] = (int16_t)lrintf(cosf(2 * M_PI * i / N) * 32767);
+      this->sin_table[i] = (int16_t)lrintf(sinf(2 * M_PI * i / N) * 32767);
+    }
+  }
+
+  void transform(int16_t re[N], int16_t im[N]) const {
+    for (int i = 1, j = 0; i < N; i++) {  // bit reversed order
+      int bit = N >> 1;
+      for (; j & bit; bit >>= 1) j ^= bit;
+      j ^= bit;
+      if (i < j) {
+        int16_t t = re[i];
+        re[i] = re[j];
+        re[j] = t;
+        t = im[i];
+        im[i] = im[j];
+        im[j] = t;
+      }
+    }
+    for (int size = 2; size <= N; size <<= 1) {
+      int half = size >> 1;
+      int step = N / size;
+      for (int start = 0; start < N; start += size) {
+        for (int k = 0; k < half; k++) {
+          int32_t wr = this->cos_table[k * step];
+          int32_t wi = -this->sin_table[k * step];
+          int a = start + k;
+          int b = a + half;
+          int32_t tr = (re[b] * wr - im[b] * wi) >> 15;
+          int32_t ti = (re[b] * wi + im[b] * wr) >> 15;
+          re[b] = (re[a] - tr) >> 1;
+          im[b] = (im[a] - ti) >> 1;
+          re[a] = (re[a] + tr) >> 1;
+          im[a] = (im[a] + ti) >> 1;
+        }
+      }
+    }
+  }
+};
+
+
+class AudioAnalyser {
+
+  // Turns blocks of samples into AudioFeatures. process() runs on the audio task; latest() and noteShown()
+  // on the render task. The features are double buffered: process() fills the slot the newest block is not
+  // in and then publishes it, and latest() copies the newest one, trying again in the rare case another
+  // block was published while it copied, since process() may then be filling the slot it copied from.
+
+private:
+  FixedFft<AUDIO_FFT_SIZE> fft;
+  int16_t window[AUDIO_FFT_SIZE];   // Hann, Q15
+  int16_t history[AUDIO_FFT_SIZE];  // the last AUDIO_FFT_SIZE samples, oldest first
+  int16_t re[AUDIO_FFT_SIZE];
+  int16_t im[AUDIO_FFT_SIZE];
+  uint32_t peak[AUDIO_BANDS];    // slowly falling maximum of each band, for the gain
+  uint16_t shown[AUDIO_BANDS];   // levels, falling off smoothly after a peak
+  uint32_t bass_average;
+  uint32_t last_beat_us;
+  uint32_t beats;
+
+  AudioFeatures slots[2];
+  std::atomic<uint32_t> published;  // sequence of the newest block, in slots[sequence & 1]
+
+  CostCounter analysis;  // us per block, audio task
+  CostCounter latency;   // us from a block ending to the first frame showing it, render task
+  uint32_t last_shown;
+
+public:
+  AudioAnalyser()
+    : bass_average(0), last_beat_us(0), beats(0), published(0), analysis(), latency(), last_shown(0) {
+    memset(this->history, 0, sizeof(this->history));
+    memset(this->peak, 0, sizeof(this->peak));
+    memset(this->shown, 0, sizeof(this->shown));
+    memset(this->slots, 0, sizeof(this->slots));
+  }
+
+  void begin() {
+    this->fft.begin();
+    for (int i = 0; i < AUDIO_FFT_SIZE; i++) {
+      this->window[i] = (int16_t)lrintf((0.5f - 0.5f * cosf(2 * M_PI * i / AUDIO_FFT_SIZE)) * 32767);
+    }
+  }
+
+  void process(const int16_t block[AUDIO_HOP], uint32_t block_end_us) {
+    uint32_t start = RuntimeStats::now();
+    memmove(this->history, this->history + AUDIO_HOP, (AUDIO_FFT_SIZE - AUDIO_HOP) * sizeof(int16_t));
+    memcpy(this->history + AUDIO_FFT_SIZE - AUDIO_HOP, block, AUDIO_HOP * sizeof(int16_t));
+    for (int i = 0; i < AUDIO_FFT_SIZE; i++) {
+      this->re[i] = (this->history[i] * (int32_t)this->window[i]) >> 15;
+      this->im[i] = 0;
+    }
+    this->fft.transform(this->re, this->im);
+
+    uint32_t sequence = this->published.load(std::memory_order_relaxed) + 1;
+    AudioFeatures& out = this->slots[sequence & 1];
+    uint32_t energy[AUDIO_BANDS];
+    for (int b = 0; b < AUDIO_BANDS; b++) {
+      uint32_t sum = 0;
+      for (int bin = AUDIO_BAND_BINS[b]; bin < AUDIO_BAND_BINS[b + 1]; bin++) {
+        uint32_t x = this->re[bin] < 0 ? -this->re[bin] : this->re[bin];
+        uint32_t y = this->im[bin] < 0 ? -this->im[bin] : this->im[bin];
+        sum += x > y ? x + (y >> 2) + (y >> 3) : y + (x >> 2) + (x >> 3);  // |re + i im| to within 4%
+      }
+      energy[b] = sum / (AUDIO_BAND_BINS[b + 1] - AUDIO_BAND_BINS[b]);
+
+      this->peak[b] -= this->peak[b] >> 9;  // the gain recovers over a couple of seconds after something loud
+      if (energy[b] > this->peak[b]) this->peak[b] = energy[b];
+      uint32_t level = 0;
+      if (energy[b] >= AUDIO_NOISE_FLOOR) {
+        uint32_t peak = this->peak[b] > 4 * AUDIO_NOISE_FLOOR ? this->peak[b] : 4 * AUDIO_NOISE_FLOOR;
+        level = energy[b] * 65535 / peak;
+        if (level > 65535) level = 65535;
+      }
+      uint16_t falling = this->shown[b] - (this->shown[b] >> 3);  // about 30 ms to fall back
+      this->shown[b] = level > falling ? level : falling;
+      out.band[b] = this->shown[b];
+    }
+
+    uint32_t bass = energy[0];
+    if (bass * 100 > this->bass_average * AUDIO_BEAT_RATIO_PCT && bass >= 2 * AUDIO_NOISE_FLOOR
+        && block_end_us - this->last_beat_us >= AUDIO_BEAT_GAP_US) {
+      this->beats++;
+      this->last_beat_us = block_end_us;
+    }
+    this->bass_average += ((int32_t)bass - (int32_t)this->bass_average) >> 6;  // over about a quarter of a second
+
+    out.beats = this->beats;
+    out.block_end_us = block_end_us;
+    out.sequence = sequence;
+    this->published.store(sequence, std::memory_order_release);
+    this->analysis.add(RuntimeStats::now() - start);
+  }
+
+  bool latest(AudioFeatures& features) const {  // false until the first block
+    for (;;) {
+      uint32_t sequence = this->published.load(std::memory_order_acquire);
+      if (sequence == 0) return false;
+      features = this->slots[sequence & 1];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (this->published.load(std::memory_order_relaxed) == sequence) return true;  // its slot was not reused
+    }
+  }
+
+  void noteShown(const AudioFeatures& features, uint32_t now_us) {  // from a frame that showed these features
+    if (features.sequence == this->last_shown) return;
+    this->last_shown = features.sequence;
+    this->latency.add(now_us - features.block_end_us);
+  }
+
+  const CostCounter& getLatency() const {
+    return this->latency;
+  }
+
+  const CostCounter& getAnalysis() const {
+    return this->analysis;
+  }
+
+  uint32_t getBeats() const {
+    return this->beats;
+  }
+
+  template <typename Out>
+  void report(Out& out) {  // more lines for RuntimeStats::report
+    RuntimeStats::line(out, "audio_blocks", this->analysis.count);
+    RuntimeStats::line(out, "audio_beats", this->beats);
+    RuntimeStats::line(out, "audio_analysis_us_mean", this->analysis.mean());
+    RuntimeStats::line(out, "audio_analysis_us_max", this->analysis.max_us);
+    RuntimeStats::line(out, "audio_latency_us_mean", this->latency.mean());
+    RuntimeStats::line(out, "audio_latency_us_max", this->latency.max_us);
+  }
+};
+
+
+class AudioInput {
+
+  // The ADC through I2S0 with two DMA buffers of AUDIO_HOP samples: one fills while the task reads the
+  // other. The ADC's DC offset is tracked and taken off, so a biased line-in or an electret on a divider
+  // both come out centred. On the ESP32 a task blocks on the DMA; on the host poll() reads whatever whole
+  // blocks the virtual clock says have arrived, since nothing else would.
+
+private:
+  AudioAnalyser& analyser;
+  uint16_t raw[AUDIO_HOP];
+  int16_t block[AUDIO_HOP];
+  int32_t dc;  // 0-65535 scale, 8 fractional bits
+  uint32_t start_us;
+  uint64_t samples;
+
+#if defined(ESP32) && !defined(HOST_BUILD)
+  static void audioTask(void* arg) {
+    AudioInput* input = (AudioInput*)arg;
+    for (;;) {
+      input->readBlock(portMAX_DELAY);
+    }
+  }
+#endif
+
+public:
+  AudioInput(AudioAnalyser& analyser)
+    : analyser(analyser), dc(32768 << 8), start_us(0), samples(0) {}
+
+  void begin() {
+    this->analyser.begin();
+    i2s_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.mode = I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN;
+    config.sample_rate = AUDIO_SAMPLE_RATE;
+    config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+    config.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
+    config.communication_format = I2S_COMM_FORMAT_STAND_I2S;
+    config.dma_buf_count = 2;
+    config.dma_buf_len = AUDIO_HOP;
+    if (i2s_driver_install(I2S_NUM_0, &config, 0, nullptr) != 0) {
+      LOG_ERROR("Could not start the audio input");
+      return;
+    }
+    i2s_set_adc_mode(ADC_UNIT_1, ADC1_CHANNEL_0);
+    i2s_adc_enable(I2S_NUM_0);
+    this->start_us = micros();
+#if defined(ESP32) && !defined(HOST_BUILD)
+    xTaskCreatePinnedToCore(audioTask, "audio", AUDIO_STACK_SIZE, this, AUDIO_PRIORITY, nullptr, AUDIO_CORE);
+#endif
+  }
+
+  bool readBlock(TickType_t wait) {  // false if a whole block was not there
+    size_t bytes = 0;
+    i2s_read(I2S_NUM_0, this->raw, sizeof(this->raw), &bytes, wait);
+    if (bytes < sizeof(this->raw)) return false;
+    this->samples += AUDIO_HOP;
+#if defined(ESP32) && !defined(HOST_BUILD)
+    uint32_t block_end_us = micros();  // the DMA has just finished it
+#else
+    uint32_t block_end_us = this->start_us + (uint32_t)(this->samples * 1000000 / AUDIO_SAMPLE_RATE);
+#endif
+    for (int i = 0; i < AUDIO_HOP; i++) {
+      int32_t x = (int32_t)(this->raw[i] & 0x0FFF) << 4;
+      this->dc += ((x << 8) - this->dc) >> 10;  // follows over about 60 ms
+      int32_t s = x - (this->dc >> 8);
+      this->block[i] = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+    }
+    this->analyser.process(this->block, block_end_us);
+    return true;
+  }
+
+  void poll() {  // host only, the blocks due by now
+    while (readBlock(0)) {
+    }
+  }
+};
@@ -0,0 +1,139 @@
+#pragma once
+#include <stdint.h>
+#include "LEDStrip.h"
+
+// Baking turns a periodic Pattern into a table of keyframes per strip, which BakedPattern (Patterns.h)
+// plays back by interpolating between them. Each strip's output over one period is sampled every
+// millisecond and fitted with the fewest straight segments that stay within a tolerance of every sample,
+// so a frame of playback is a table lookup and a multiply whatever the original pattern cost.
+// Everything here is integer maths, so the host bake tool and the ESP32 produce the same tables.
+
+struct Keyframe {
+  uint16_t time_ms;  // from the start of the period
+  int16_t level;     // strip level 0-65535 halved to fit, negative when the strip is on its colour side
+};
+
+struct BakedTable {
+  uint16_t period_ms;
+  uint8_t num_strips;
+  bool follows_colour;     // levels were baked white, and are mirrored onto the colour side for colour
+  const Keyframe* keys;    // every strip's keyframes, one strip after another
+  const uint16_t* starts;  // strip i's keyframes are keys[starts[i]] up to keys[starts[i + 1]]
+};
+
+
+class KeyframeEncoder {
+
+  // Streaming piecewise linear fit. From the last keyframe (the anchor) it keeps the range of slopes
+  // that pass within the tolerance of every sample since; a sample whose own slope from the anchor falls
+  // outside that range cannot be reached by a straight line, so the sample before it becomes a keyframe.
+  // Slopes are kept as fractions and compared by cross multiplying, so there is no rounding.
+
+private:
+  uint16_t tolerance;
+  Keyframe* keys;
+  uint32_t capacity;
+  uint32_t count;
+
+  Keyframe anchor;
+  Keyframe previous;
+  int32_t lo_num, lo_den;  // lowest slope still allowed
+  int32_t hi_num, hi_den;  // highest slope still allowed
+  bool open;               // false until the first sample after the anchor narrows the range
+
+  static bool below(int32_t a_num, int32_t a_den, int32_t b_num, int32_t b_den) {  // a < b, both denominators > 0
+    return (int64_t)a_num * b_den < (int64_t)b_num * a_den;
+  }
+
+  void emit(const Keyframe& key) {
+    if (this->count < this->capacity) this->keys[this->count] = key;
+    this->count++;  // keeps counting when full, so the caller can see how much space it needed
+  }
+
+  void restart(const Keyframe& key) {
+    this->anchor = key;
+    this->previous = key;
+    this->open = false;
+  }
+
+public:
+  KeyframeEncoder(Keyframe* keys, uint32_t capacity, uint16_t tolerance)
+    : tolerance(tolerance), keys(keys), capacity(capacity), count(0), anchor(), previous(), lo_num(0), lo_den(1), hi_num(0),
+      hi_den(1), open(false) {}
+
+  void add(uint16_t time_ms, int16_t level) {  // samples must come in time order
+    Keyframe key = { time_ms, level };
+    if (this->count == 0) {
+      emit(key);
+      restart(key);
+      return;
+    }
+
+    int32_t dt = time_ms - this->anchor.time_ms;
+    int32_t rise = level - this->anchor.level;
+    if (this->open && (below(rise, dt, this->lo_num, this->lo_den) || below(this->hi_num, this->hi_den, rise, dt))) {
+      emit(this->previous);
+      restart(this->previous);
+      dt = time_ms - this->anchor.time_ms;
+      rise = level - this->anchor.level;
+    }
+
+    int32_t lo = rise - this->tolerance;
+    int32_t hi = rise + this->tolerance;
+    if (!this->open || below(this->lo_num, this->lo_den, lo, dt)) {
+      this->lo_num = lo;
+      this->lo_den = dt;
+    }
+    if (!this->open || below(hi, dt, this->hi_num, this->hi_den)) {
+      this->hi_num = hi;
+      this->hi_den = dt;
+    }
+    this->open = true;
+    this->previous = key;
+  }
+
+  uint32_t finish() {  // the last sample always ends the track, returns the number of keyframes
+    if (this->count > 0 && this->previous.time_ms != this->anchor.time_ms) emit(this->previous);
+    return this->count;
+  }
+};
+
+
+template <int N>
+class PatternBaker {
+
+  // Renders a pattern onto its own strips, never the real ones, and encodes what each strip shows.
+  // Patterns are configured against getStrips() before baking.
+
+private:
+  LEDStrip strips[N];
+
+public:
+  LEDStrip* getStrips() {
+    return this->strips;
+  }
+
+  // Fills keys and starts (N + 1 entries) for one period, sampled every millisecond from 0 to period_ms.
+  // Returns the number of keyframes needed, which is more than capacity if they did not all fit.
+  // Oscillators only run forwards, so strip i is sampled over the (i + 1)th period rather than rewinding.
+  template <typename P>
+  uint32_t bake(P& pattern, uint16_t period_ms, uint16_t tolerance, Keyframe* keys, uint32_t capacity, uint16_t starts[N + 1]) {
+    uint32_t total = 0;
+    for (int i = 0; i < N; i++) {
+      uint32_t base = (uint32_t)i * period_ms;
+      starts[i] = total;
+      KeyframeEncoder encoder(keys + (total < capacity ? total : capacity), total < capacity ? capacity - total : 0, tolerance);
+      for (uint32_t t = 0; t <= period_ms; t++) {
+        pattern.render(base + t);
+        encoder.add(t, level(this->strips[i]));
+      }
+      total += encoder.finish();
+    }
+    starts[N] = total;
+    return total;
+  }
+
+  static int16_t level(const LEDStrip& strip) {
+    return strip.getIsWhite() ? strip.getLevel() >> 1 : -(strip.getLevel() >> 1);
+  }
+};
@@ -0,0 +1,61 @@
+#pragma once
+#include "Bake.h"
+
+// Generated by host/bake.cpp, rebuild with make tables in host/. Do not edit.
+// Levels are strip levels 0-65535 halved, negative on the colour side.
+
+// wave, 1 Hz, 1000 ms period, 172 keyframes
+static const Keyframe BAKED_WAVE_KEYS[172] = {
+  { 0, 32767 }, { 28, 32514 }, { 56, 31762 }, { 85, 30485 }, { 116, 28604 }, { 150, 26013 }, { 190, 22415 }, { 258, 15561 },
+  { 315, 9878 }, { 354, 6425 }, { 387, 3959 }, { 418, 2126 }, { 447, 901 }, { 475, 203 }, { 503, 3 }, { 531, 310 },
+  { 559, 1113 }, { 588, 2442 }, { 619, 4370 }, { 653, 7005 }, { 694, 10736 }, { 810, 22414 }, { 850, 26012 }, { 884, 28603 },
+  { 915, 30484 }, { 944, 31762 }, { 972, 32513 }, { 1000, 32767 }, { 0, 24576 }, { 46, 20191 }, { 141, 10577 }, { 181, 6950 },
+  { 215, 4325 }, { 246, 2406 }, { 275, 1088 }, { 303, 297 }, { 331, 2 }, { 359, 213 }, { 387, 923 }, { 416, 2160 },
+  { 447, 4003 }, { 480, 6477 }, { 519, 9939 }, { 578, 15834 }, { 644, 22476 }, { 683, 25984 }, { 717, 28580 }, { 748, 30467 },
+  { 777, 31750 }, { 805, 32507 }, { 833, 32767 }, { 861, 32520 }, { 889, 31774 }, { 918, 30502 }, { 949, 28627 }, { 983, 26041 },
+  { 1000, 24576 }, { 0, 8192 }, { 36, 5219 }, { 68, 3050 }, { 98, 1502 }, { 126, 533 }, { 154, 52 }, { 182, 76 },
+  { 210, 603 }, { 239, 1664 }, { 269, 3271 }, { 301, 5497 }, { 338, 8610 }, { 386, 13246 }, { 474, 22157 }, { 514, 25789 },
+  { 548, 28419 }, { 579, 30342 }, { 608, 31666 }, { 636, 32463 }, { 664, 32764 }, { 692, 32559 }, { 720, 31855 }, { 749, 30623 },
+  { 780, 28786 }, { 814, 26234 }, { 853, 22764 }, { 913, 16762 }, { 978, 10226 }, { 1000, 8192 }, { 0, 0 }, { 28, 253 },
+  { 56, 1004 }, { 85, 2281 }, { 116, 4162 }, { 150, 6753 }, { 190, 10351 }, { 258, 17206 }, { 316, 22984 }, { 355, 26424 },
+  { 388, 28873 }, { 418, 30640 }, { 447, 31866 }, { 475, 32564 }, { 503, 32763 }, { 531, 32457 }, { 559, 31654 }, { 588, 30325 },
+  { 619, 28397 }, { 653, 25761 }, { 694, 22031 }, { 810, 10353 }, { 850, 6755 }, { 884, 4163 }, { 915, 2282 }, { 944, 1005 },
+  { 972, 253 }, { 1000, 0 }, { 0, 8191 }, { 45, 12474 }, { 141, 22190 }, { 181, 25817 }, { 215, 28442 }, { 246, 30360 },
+  { 275, 31678 }, { 303, 32469 }, { 331, 32764 }, { 358, 32570 }, { 386, 31877 }, { 415, 30657 }, { 445, 28896 }, { 478, 26453 },
+  { 517, 23017 }, { 575, 17242 }, { 643, 10385 }, { 683, 6783 }, { 717, 4186 }, { 748, 2300 }, { 777, 1016 }, { 805, 259 },
+  { 833, 0 }, { 861, 247 }, { 889, 992 }, { 918, 2264 }, { 949, 4140 }, { 983, 6725 }, { 1000, 8191 }, { 0, 24574 },
+  { 36, 27547 }, { 68, 29717 }, { 98, 31264 }, { 126, 32234 }, { 154, 32714 }, { 182, 32691 }, { 210, 32163 }, { 238, 31148 },
+  { 268, 29558 }, { 300, 27346 }, { 337, 24247 }, { 385, 19623 }, { 474, 10609 }, { 514, 6978 }, { 548, 4347 }, { 579, 2424 },
+  { 608, 1100 }, { 636, 304 }, { 664, 3 }, { 691, 191 }, { 719, 878 }, { 748, 2093 }, { 778, 3848 }, { 811, 6288 },
+  { 850, 9718 }, { 907, 15388 }, { 976, 22350 }, { 1000, 24574 },
+};
+static const uint16_t BAKED_WAVE_STARTS[7] = { 0, 28, 57, 86, 114, 143, 172, };
+static const BakedTable BAKED_WAVE = { 1000, 6, true, BAKED_WAVE_KEYS, BAKED_WAVE_STARTS };
+
+// slow wave, 0.25 Hz, 4000 ms period, 173 keyframes
+static const Keyframe BAKED_SLOW_WAVE_KEYS[173] = {
+  { 0, 32767 }, { 113, 32509 }, { 226, 31745 }, { 344, 30433 }, { 468, 28537 }, { 605, 25909 }, { 768, 22224 }, { 1080, 14331 },
+  { 1288, 9223 }, { 1439, 5961 }, { 1571, 3582 }, { 1693, 1869 }, { 1809, 733 }, { 1922, 122 }, { 2035, 25 }, { 2147, 435 },
+  { 2261, 1358 }, { 2380, 2832 }, { 2508, 4945 }, { 2650, 7823 }, { 2826, 11961 }, { 3233, 22246 }, { 3394, 25887 }, { 3531, 28518 },
+  { 3655, 30419 }, { 3772, 31726 }, { 3885, 32499 }, { 3997, 32766 }, { 4000, 32767 }, { 0, 24576 }, { 183, 20217 }, { 564, 10577 },
+  { 726, 6907 }, { 864, 4254 }, { 989, 2339 }, { 1106, 1034 }, { 1220, 259 }, { 1332, 0 }, { 1445, 251 }, { 1558, 1010 },
+  { 1675, 2303 }, { 1799, 4191 }, { 1935, 6788 }, { 2096, 10416 }, { 2370, 17325 }, { 2599, 23023 }, { 2755, 26458 }, { 2889, 28935 },
+  { 3012, 30723 }, { 3129, 31930 }, { 3242, 32598 }, { 3353, 32758 }, { 3465, 32417 }, { 3578, 31571 }, { 3696, 30180 }, { 3821, 28191 },
+  { 3961, 25429 }, { 4000, 24576 }, { 0, 8192 }, { 145, 5200 }, { 274, 3019 }, { 394, 1481 }, { 508, 507 }, { 621, 42 },
+  { 733, 89 }, { 846, 646 }, { 962, 1731 }, { 1083, 3380 }, { 1214, 5690 }, { 1363, 8861 }, { 1561, 13676 }, { 1895, 22134 },
+  { 2058, 25831 }, { 2196, 28489 }, { 2321, 30410 }, { 2439, 31729 }, { 2552, 32501 }, { 2664, 32766 }, { 2777, 32522 }, { 2891, 31760 },
+  { 3009, 30455 }, { 3133, 28565 }, { 3269, 25965 }, { 3431, 22312 }, { 3720, 15014 }, { 3940, 9564 }, { 4000, 8192 }, { 0, 0 },
+  { 112, 253 }, { 226, 1022 }, { 343, 2320 }, { 468, 4230 }, { 605, 6858 }, { 767, 10519 }, { 1067, 18103 }, { 1280, 23358 },
+  { 1433, 26686 }, { 1564, 29072 }, { 1686, 30814 }, { 1802, 31979 }, { 1914, 32616 }, { 2024, 32754 }, { 2135, 32399 }, { 2249, 31530 },
+  { 2368, 30104 }, { 2494, 28077 }, { 2634, 25292 }, { 2804, 21349 }, { 3237, 10424 }, { 3399, 6775 }, { 3535, 4180 }, { 3659, 2295 },
+  { 3776, 1005 }, { 3889, 248 }, { 4000, 0 }, { 0, 8191 }, { 183, 12549 }, { 564, 22190 }, { 726, 25859 }, { 863, 28495 },
+  { 988, 30415 }, { 1106, 31732 }, { 1219, 32502 }, { 1330, 32766 }, { 1443, 32525 }, { 1557, 31766 }, { 1675, 30464 }, { 1800, 28559 },
+  { 1936, 25957 }, { 2097, 22328 }, { 2383, 15108 }, { 2604, 9627 }, { 2759, 6227 }, { 2893, 3766 }, { 3015, 2007 }, { 3132, 813 },
+  { 3245, 158 }, { 3356, 11 }, { 3467, 360 }, { 3581, 1224 }, { 3700, 2643 }, { 3826, 4665 }, { 3966, 7446 }, { 4000, 8191 },
+  { 0, 24574 }, { 145, 27567 }, { 274, 29747 }, { 394, 31286 }, { 509, 32266 }, { 622, 32726 }, { 734, 32674 }, { 846, 32120 },
+  { 961, 31046 }, { 1082, 29402 }, { 1213, 27095 }, { 1362, 23928 }, { 1558, 19167 }, { 1895, 10633 }, { 2058, 6935 }, { 2195, 4295 },
+  { 2320, 2370 }, { 2438, 1046 }, { 2551, 271 }, { 2662, 1 }, { 2774, 232 }, { 2888, 980 }, { 3005, 2260 }, { 3129, 4133 },
+  { 3265, 6719 }, { 3424, 10289 }, { 3686, 16880 }, { 3924, 22826 }, { 4000, 24574 },
+};
+static const uint16_t BAKED_SLOW_WAVE_STARTS[7] = { 0, 29, 58, 87, 115, 144, 173, };
+static const BakedTable BAKED_SLOW_WAVE = { 4000, 6, true, BAKED_SLOW_WAVE_KEYS, BAKED_SLOW_WAVE_STARTS };
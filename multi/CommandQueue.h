@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+enum CommandType {
+  CMD_SET_MODE,    // value is the mode to switch to
+  CMD_SET_COLOUR,  // value is 1 for white, 0 for colour
+  CMD_SET_PARAM,   // value is the new setting of the PatternParameter in parameter
+};
+
+struct Command {
+  uint8_t type;
+  int32_t value;
+  uint8_t parameter;  // only for CMD_SET_PARAM
+  uint32_t at_ms;     // the render time to apply it at, for changes shared with other devices (Sync.h); 0 for at once
+};
+
+template <typename T, uint32_t SIZE>
+class SpscQueue {
+
+  // Lock-free single producer, single consumer ring buffer, for handing data between the two cores.
+  // push() is only ever called from one task and pop() only from one other, so neither side ever
+  // blocks or takes a lock: each side owns one index and only reads the other's.
+  // SIZE must be a power of two.
+
+  static_assert((SIZE & (SIZE - 1)) == 0, "SpscQueue SIZE must be a power of two");
+
+private:
+  T items[SIZE];
+  std::atomic<uint32_t> head;  // next slot to write, only stored by the producer
+  std::atomic<uint32_t> tail;  // next slot to read, only stored by the consumer
+  uint32_t dropped;            // pushes refused because the queue was full, producer side only
+
+public:
+  SpscQueue()
+    : head(0), tail(0), dropped(0) {}
+
+  bool push(const T& item) {  // producer side, returns false and drops the item if the queue is full
+    uint32_t h = this->head.load(std::memory_order_relaxed);
+    if (h - this->tail.load(std::memory_order_acquire) == SIZE) {
+      this->dropped++;
+      return false;
+    }
+    this->items[h & (SIZE - 1)] = item;
+    this->head.store(h + 1, std::memory_order_release);  // publishes the item to the consumer
+    return true;
+  }
+
+  bool pop(T& item) {  // consumer side, returns false if there is nothing to read
+    uint32_t t = this->tail.load(std::memory_order_relaxed);
+    if (t == this->head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = this->items[t & (SIZE - 1)];
+    this->tail.store(t + 1, std::memory_order_release);  // hands the slot back to the producer
+    return true;
+  }
+
+  uint32_t getDropped() const {
+    return this->dropped;
+  }
+};
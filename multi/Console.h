@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+#include "HardwareSerial.h"
+
+#ifndef CONSOLE_LINE_SIZE
+#define CONSOLE_LINE_SIZE 32  // longer commands are cut short
+#endif
+
+
+class SerialConsole {
+
+  // Commands typed into the serial monitor, a line at a time. update() reads whatever has arrived without
+  // waiting, and returns a line once its newline is in; the sketch decides what the words mean. When the
+  // port is shared, such as with control frames (Control.h), the sketch reads it and hands over the bytes
+  // that are the console's with feed() instead.
+
+private:
+  char line[CONSOLE_LINE_SIZE];
+  uint8_t length;
+
+public:
+  SerialConsole()
+    : length(0) {}
+
+  const char* feed(char c) {  // the line c completes, or nullptr
+    if (c == '\r') return nullptr;
+    if (c == '\n') {
+      this->line[this->length] = '\0';
+      this->length = 0;
+      return this->line[0] != '\0' ? this->line : nullptr;
+    }
+    if (this->length < CONSOLE_LINE_SIZE - 1) this->line[this->length++] = c;
+    return nullptr;
+  }
+
+  const char* update() {  // a complete line, or nullptr
+    while (Serial.available() > 0) {
+      const char* line = feed(Serial.read());
+      if (line) return line;
+    }
+    return nullptr;
+  }
+};
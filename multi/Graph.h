@@ -0,0 +1,161 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "Oscillator.h"
+#include "Noise.h"
+#include "Log.h"
+
+// A pattern described as a small graph instead of a class: source nodes (oscillators, noise, envelopes)
+// feed blend nodes (multiply, max, add, crossfade), and one node is the level of every strip, another
+// optionally how much of it is white. Graph is only the description, built once when a mode is selected;
+// GraphPattern in Patterns.h evaluates it every frame into a preallocated buffer of node values.
+// Nodes only take inputs from nodes added before them, so evaluating them in order is always right.
+// A node that comes out the same for every strip (an oscillator without a spread, a blend of such nodes)
+// is worked out once a frame and read by every strip from there; only the rest are worked out per strip.
+
+#define GRAPH_MAX_NODES 16
+#define GRAPH_NONE 0xFF
+
+enum GraphOp : uint8_t {
+  GRAPH_CONSTANT,    // value
+  GRAPH_OSCILLATOR,  // waveform, period_ms, duty, each strip step of the phase behind the one before
+  GRAPH_ENVELOPE,    // rises over attack_ms and falls over decay_ms, once every period_ms, with a step like an oscillator
+  GRAPH_NOISE,       // organic flicker, speed in 16.16 noise cells per ms, each strip its own seed unless shared
+  GRAPH_MULTIPLY,    // a * b
+  GRAPH_MAX,         // the brighter of a and b
+  GRAPH_ADD,         // a + b, saturating
+  GRAPH_CROSSFADE,   // from a at mix 0 to b at mix 65535
+};
+
+struct GraphNode {
+  uint8_t op;
+  uint8_t in[3];       // a, b and mix, for the blends
+  uint8_t waveform;    // a Waveform, oscillators
+  bool shared;         // noise that is the same on every strip
+  uint16_t value;      // constants, 0-65535
+  uint32_t period_ms;  // oscillators and envelopes
+  uint32_t duty;       // pulse width as a phase, oscillators
+  uint32_t step;       // phase between neighbouring strips, oscillators and envelopes
+  uint32_t speed;      // noise
+  uint32_t seed;       // noise
+  uint32_t attack;     // envelope breakpoints as phases, and the slopes between them in 65535/phase >> 16
+  uint32_t decay_end;
+  uint32_t rise;
+  uint32_t fall;
+};
+
+
+class Graph {
+
+  // Each method adds a node and returns its index, to pass to the nodes after it and to output(). A graph
+  // that runs out of room, or is given GRAPH_NONE, returns GRAPH_NONE from then on and renders as off.
+
+private:
+  uint8_t add(const GraphNode& node) {
+    for (int i = 0; i < 3; i++) {
+      if (node.in[i] != GRAPH_NONE && node.in[i] >= this->count) return fail();
+    }
+    if (this->count == GRAPH_MAX_NODES) return fail();
+    this->nodes[this->count] = node;
+    return this->count++;
+  }
+
+  uint8_t fail() {
+    if (!this->failed) LOG_ERROR("Graph does not fit in %d nodes, or uses a node that is not there", GRAPH_MAX_NODES);
+    this->failed = true;
+    return GRAPH_NONE;
+  }
+
+  static GraphNode node(uint8_t op, uint8_t a = GRAPH_NONE, uint8_t b = GRAPH_NONE, uint8_t mix = GRAPH_NONE) {
+    GraphNode n;
+    memset(&n, 0, sizeof(n));
+    n.op = op;
+    n.in[0] = a;
+    n.in[1] = b;
+    n.in[2] = mix;
+    return n;
+  }
+
+  uint8_t blend(uint8_t op, uint8_t a, uint8_t b, uint8_t mix = GRAPH_NONE) {
+    if (a == GRAPH_NONE || b == GRAPH_NONE || (op == GRAPH_CROSSFADE && mix == GRAPH_NONE)) return fail();
+    return add(node(op, a, b, mix));
+  }
+
+public:
+  GraphNode nodes[GRAPH_MAX_NODES];
+  uint8_t count;
+  uint8_t level;  // the outputs
+  uint8_t white_share;
+  bool failed;
+
+  Graph()
+    : count(0), level(GRAPH_NONE), white_share(GRAPH_NONE), failed(false) {}
+
+  void clear() {
+    this->count = 0;
+    this->level = GRAPH_NONE;
+    this->white_share = GRAPH_NONE;
+    this->failed = false;
+  }
+
+  uint8_t constant(uint16_t value) {
+    GraphNode n = node(GRAPH_CONSTANT);
+    n.value = value;
+    return add(n);
+  }
+
+  // spread is the fraction of a cycle each strip runs behind the one before, 0 for all together
+  uint8_t oscillator(Waveform waveform, uint32_t period_ms, float spread = 0, float duty = 0.5f) {
+    GraphNode n = node(GRAPH_OSCILLATOR);
+    n.waveform = waveform;
+    n.period_ms = period_ms ? period_ms : 1;
+    n.duty = duty >= 1 ? 0xFFFFFFFF : Oscillator::fractionToPhase(duty);
+    n.step = Oscillator::fractionToPhase(-spread);
+    return add(n);
+  }
+
+  uint8_t envelope(uint32_t attack_ms, uint32_t decay_ms, uint32_t period_ms, float spread = 0) {
+    GraphNode n = node(GRAPH_ENVELOPE);
+    if (period_ms < attack_ms + decay_ms) period_ms = attack_ms + decay_ms;
+    if (period_ms == 0) period_ms = 1;
+    n.period_ms = period_ms;
+    n.step = Oscillator::fractionToPhase(-spread);
+    n.attack = (uint32_t)(((uint64_t)attack_ms << 32) / period_ms);
+    n.decay_end = (uint32_t)(((uint64_t)(attack_ms + decay_ms) << 32) / period_ms - 1);
+    uint32_t rise = n.attack >> 16;
+    uint32_t fall = (n.decay_end - n.attack) >> 16;
+    n.rise = rise ? (65535u << 16) / rise : 0;
+    n.fall = fall ? (65535u << 16) / fall : 0;
+    return add(n);
+  }
+
+  uint8_t noise(float speed, uint32_t seed, bool shared = false) {  // speed as for ChaosEffect, around .002
+    GraphNode n = node(GRAPH_NOISE);
+    n.speed = (uint32_t)(speed * 65536 / 2 + 0.5f);
+    n.seed = seed;
+    n.shared = shared;
+    return add(n);
+  }
+
+  uint8_t multiply(uint8_t a, uint8_t b) {
+    return blend(GRAPH_MULTIPLY, a, b);
+  }
+
+  uint8_t max(uint8_t a, uint8_t b) {
+    return blend(GRAPH_MAX, a, b);
+  }
+
+  uint8_t add(uint8_t a, uint8_t b) {
+    return blend(GRAPH_ADD, a, b);
+  }
+
+  uint8_t crossfade(uint8_t a, uint8_t b, uint8_t mix) {
+    return blend(GRAPH_CROSSFADE, a, b, mix);
+  }
+
+  // level of every strip, and how much of it is white (0-65535), GRAPH_NONE for whichever is_white says
+  void output(uint8_t level, uint8_t white_share = GRAPH_NONE) {
+    this->level = this->failed ? GRAPH_NONE : level;
+    this->white_share = this->failed ? GRAPH_NONE : white_share;
+  }
+};
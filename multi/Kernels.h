@@ -0,0 +1,99 @@
+#pragma once
+#include <stdint.h>
+#include "Oscillator.h"
+#include "Noise.h"
+
+// Batched kernels evaluate one kind of pattern for all N strips in a single pass over contiguous
+// per-strip arrays, instead of one virtual Effect::update per strip. Anything that is the same for
+// every strip (the oscillator phase, the noise position) is worked out once per frame, and the
+// per-strip loop is straight integer math with a compile time trip count the compiler can unroll.
+// Kernels only fill their output arrays; the Pattern that owns one copies the outputs to its strips.
+
+
+template <int N>
+class SequenceKernel {
+
+  // one pulse that walks along the strips, each strip on for 1/num_strips of the period
+
+private:
+  Oscillator oscillator;
+  uint32_t phase_offset[N];
+  uint32_t duty;
+
+public:
+  uint16_t level[N];  // output brightness, 0 or 65535
+
+  void configure(uint32_t period_ms, int num_strips) {
+    this->oscillator.setPeriod(period_ms);
+    this->oscillator.setDuty(1.0f / num_strips);
+    this->duty = this->oscillator.getDuty();
+    for (int i = 0; i < N; i++) {
+      this->phase_offset[i] = Oscillator::fractionToPhase(-float(i) / num_strips);  // strip i starts i/num_strips into the period
+      this->level[i] = 0;
+    }
+  }
+
+  void setPeriod(uint32_t period_ms) {  // while running, the pulse carries on from where it is
+    this->oscillator.retune(1, period_ms);
+  }
+
+  void render(uint32_t time_ms) {
+    uint32_t phase = this->oscillator.update(time_ms);
+    for (int i = 0; i < N; i++) {
+      this->level[i] = Oscillator::pulse(phase + this->phase_offset[i], this->duty);
+    }
+  }
+
+  uint32_t msUntilEdge(int num_strips) const {  // from the last render to the next strip turning on or off
+    uint32_t soonest = 0xFFFFFFFF;
+    for (int i = 0; i < num_strips && i < N; i++) {
+      uint32_t on = this->oscillator.msUntil(0 - this->phase_offset[i]);
+      uint32_t off = this->oscillator.msUntil(this->duty - this->phase_offset[i]);
+      if (on < soonest) soonest = on;
+      if (off < soonest) soonest = off;
+    }
+    return soonest;
+  }
+};
+
+
+template <int N>
+class ChaosKernel {
+
+  // independent noise per strip, all strips moving through the noise at the same speed
+
+private:
+  uint32_t speed;  // noise lattice cells per ms in 16.16 fixed point
+  uint32_t seed[N];
+  uint32_t base_ms;        // the position moves on at speed from base_position at base_ms
+  uint32_t base_position;
+  uint32_t last_ms;
+
+public:
+  int32_t value[N];  // output, -32768 to 32767
+
+  void configure(uint32_t speed) {
+    this->speed = speed;
+    this->base_ms = 0;
+    this->base_position = 0;
+    this->last_ms = 0;
+    for (int i = 0; i < N; i++) {
+      this->seed[i] = i;
+      this->value[i] = 0;
+    }
+  }
+
+  void setSpeed(uint32_t speed) {  // while running, the noise carries on from where the last frame left it
+    this->base_position += (this->last_ms - this->base_ms) * this->speed;
+    this->base_ms = this->last_ms;
+    this->speed = speed;
+  }
+
+  void render(uint32_t time_ms) {
+    this->last_ms = time_ms;
+    uint32_t position = this->base_position + (time_ms - this->base_ms) * this->speed;  // wraps around the noise ring, which is seamless
+    for (int i = 0; i < N; i++) {
+      this->value[i] = Noise::fractal(this->seed[i], position);
+    }
+  }
+};
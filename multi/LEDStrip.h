@@ -1,45 +1,249 @@
-#include "esp32-hal-gpio.h"
 #pragma once
 
+#include "Gamma.h"
+#include "Output.h"
+#include "Trace.h"
+#include "Limiter.h"
+
+#ifndef LEDC_DITHER
+#define LEDC_DITHER 1  // spread the bits below LEDC_RESOLUTION_BITS over successive frames
+#endif
+#ifndef LEDC_DEAD_STEPS
+#define LEDC_DEAD_STEPS 8  // gap between the two sides of a mixed strip, 8/4096 of 200 us is 0.4 us
+#endif
+
+#define LEDC_DITHER_BITS (16 - LEDC_RESOLUTION_BITS)
+#define LEDC_DITHER_MASK ((1 << LEDC_DITHER_BITS) - 1)
+
 class LEDStrip {
   // A class that acts as an interface for controlling a single LEDStrip of fairy lights.
   // The pins given in the constructor should be PWM pins that drive the H-bridge powering
-  // the LEDStrip.
+  // the LEDStrip. Each pin gets its own LEDC channel at LEDC_RESOLUTION_BITS, unless the strip is
+  // given another OutputBackend (Output.h), such as the outputs of a PCA9685 (Pca9685.h).
+  // setWhite/setColour/setMix/setLevel only change the strip's shadow state for the frame being built.
+  // Nothing reaches the pins until commit(), which the Pattern calls once per frame for every strip,
+  // and which skips the write entirely when the strip has not changed since the last frame.
+  // Levels are perceived brightness, 0-65535. The commit maps them through GAMMA_TABLE to a duty, and
+  // with LEDC_DITHER the bits the LEDC can't represent are carried from frame to frame, so that on average
+  // the pin still gets the full 16 bit duty.
+  // setMix shows white and colour at once: the LEDC drives the white pin at the start of each PWM period
+  // and the colour pin after it, split by the white share, with LEDC_DEAD_STEPS between them so the
+  // H-bridge never has both sides on.
+  // Every write to the backend is also recorded in traceRecorder (Trace.h), under the strip's trace id,
+  // which counts up from 0 in the order the strips are built.
+  // commitAll passes the frame through currentLimiter (Limiter.h), which may scale every strip's duty down
+  // to keep the strips' current in budget. The shadow state keeps the level the pattern asked for.
 
 private:
-  uint8_t whitePin;
-  uint8_t colourPin;
-  uint8_t currentBrightness;
-  uint8_t activePin;
-  uint8_t inactivePin;
+  OutputBackend* output;
+  uint8_t traceId;
+  uint8_t whiteChannel;
+  uint8_t colourChannel;
+
+  // shadow state, what the current frame wants
+  uint8_t whiteShare;  // 255 all white, 0 all colour, anything between is mixed
+  uint16_t currentLevel;
+  uint32_t limit;  // duty scale from currentLimiter, LIMIT_FULL_SCALE for none
+  uint32_t whiteUa;  // draw fully on in each direction, for the limiter
+  uint32_t colourUa;
+
+  // what the H-bridge is actually being driven with
+  uint8_t committedShare;
+  uint16_t committedLevel;
+  uint32_t committedLimit;
+  uint32_t committedDuty;  // after gamma, 0-65536 so that full on is a whole number of LEDC steps
+  uint16_t ditherError;    // duty below LEDC_RESOLUTION_BITS not yet given to the pins
+  PinDrive whiteDrive;     // what each LEDC channel was last given
+  PinDrive colourDrive;
+  PinDrive nextWhite;      // worked out by releaseInactive, written by driveActive
+  PinDrive nextColour;
+
+  void drive(uint8_t channel, PinDrive& current, PinDrive next) {
+    if (next.duty == current.duty && (next.hpoint == current.hpoint || next.duty == 0)) return;
+    this->output->write(channel, next);
+    traceRecorder.record(this->traceId, &current == &this->colourDrive, next);
+    current = next;
+  }
+
+  static uint8_t allocateTraceId() {
+    static uint8_t nextTraceId = 0;
+    return nextTraceId++ % TRACE_MAX_STRIPS;
+  }
+
+  static PinDrive overlap(PinDrive a, PinDrive b) {  // the on time two drives have in common
+    uint32_t start = a.hpoint > b.hpoint ? a.hpoint : b.hpoint;
+    uint32_t end_a = a.hpoint + a.duty;
+    uint32_t end_b = b.hpoint + b.duty;
+    uint32_t end = end_a < end_b ? end_a : end_b;
+    PinDrive common = { (uint16_t)(end > start ? end - start : 0), (uint16_t)(end > start ? start : 0) };
+    return common;
+  }
+
+  uint32_t nextDuty() {  // this frame's duty in LEDC steps, with the dither carried from earlier frames
+    if (this->currentLevel != this->committedLevel || this->limit != this->committedLimit) {
+      uint32_t duty = gammaCorrect(this->currentLevel);
+      this->committedDuty = duty + (duty >> 15);  // stretch 65535 to 65536, full on then needs no dithering
+      if (this->limit < LIMIT_FULL_SCALE) {  // dithered like any other duty, so dim strips don't drop to off
+        this->committedDuty = ((uint64_t)this->committedDuty * this->limit) >> 16;
+      }
+    }
+    uint32_t duty = this->committedDuty >> LEDC_DITHER_BITS;
+#if LEDC_DITHER
+    this->ditherError += this->committedDuty & LEDC_DITHER_MASK;
+    if (this->ditherError > LEDC_DITHER_MASK) {  // a whole LEDC step has built up, give it out this frame
+      this->ditherError -= LEDC_DITHER_MASK + 1;
+      duty++;
+    }
+#endif
+    return duty;
+  }
 
 public:
-  LEDStrip(){};  // default constructor so empty object can be initialized
+  LEDStrip()  // an empty strip, off and white, with no backend, only the shadow state is used
+    : output(nullptr), traceId(0), whiteChannel(0), colourChannel(0), whiteShare(255), currentLevel(0),
+      limit(LIMIT_FULL_SCALE), committedShare(255), committedLevel(0), committedLimit(LIMIT_FULL_SCALE),
+      committedDuty(0), ditherError(0) {
+    setCurrentModel(LIMIT_STRIP_WHITE_MA, LIMIT_STRIP_COLOUR_MA);
+    PinDrive off = { 0, 0 };
+    this->whiteDrive = off;
+    this->colourDrive = off;
+    this->nextWhite = off;
+    this->nextColour = off;
+  }
+
   LEDStrip(uint8_t whitePin, uint8_t colourPin)
-    : whitePin(whitePin), colourPin(colourPin) {
-    this->currentBrightness = 0;
-    pinMode(whitePin, OUTPUT);  // set pin mode to output, (defaults to output typically, but good practice)
-    pinMode(colourPin, OUTPUT);
-    analogWrite(this->whitePin, 0);  // set both pins to low, so strip starts off
-    analogWrite(this->colourPin, 0);
-    setWhite();  // set the strip to start as white
+    : LEDStrip(LedcOutput::instance(), whitePin, colourPin) {}
+
+  LEDStrip(OutputBackend& output, uint8_t whitePin, uint8_t colourPin)  // pins as the backend numbers them
+    : LEDStrip() {
+    this->output = &output;
+    this->traceId = allocateTraceId();
+    this->whiteChannel = output.attach(whitePin);  // both pins low, so strip starts off
+    this->colourChannel = output.attach(colourPin);
   }
 
   void setWhite() {
-    this->activePin = this->whitePin;
-    this->inactivePin = this->colourPin;
-    setBrightness(this->currentBrightness);
+    this->whiteShare = 255;
   }
 
   void setColour() {
-    this->activePin = this->colourPin;
-    this->inactivePin = this->whitePin;
-    setBrightness(this->currentBrightness);
+    this->whiteShare = 0;
+  }
+
+  void setMix(uint8_t whiteShare) {  // share of the on time given to white, 0-255
+    this->whiteShare = whiteShare;
+  }
+
+  void setCurrentModel(uint32_t white_ma, uint32_t colour_ma) {  // what this strip draws fully on each way
+    this->whiteUa = white_ma * 1000;
+    this->colourUa = colour_ma * 1000;
+  }
+
+  uint32_t requestedUa() const {  // what the shadow state would draw without the limiter
+    uint32_t full = (this->whiteUa * this->whiteShare + this->colourUa * (255 - this->whiteShare)) / 255;
+    return CurrentLimiter::draw(gammaCorrect(this->currentLevel), full);
+  }
+
+  void setLevel(uint16_t level) {  // perceived brightness from 0-65535
+    this->currentLevel = level;
+  }
+
+  void setBrightness(uint8_t brightnessLevel) {  // brightness from 0-255
+    this->currentLevel = brightnessLevel * 257;
+  }
+
+  bool getIsWhite() const {  // mostly white, for a mixed strip
+    return this->whiteShare >= 128;
+  }
+
+  uint8_t getWhiteShare() const {
+    return this->whiteShare;
+  }
+
+  uint16_t getLevel() const {
+    return this->currentLevel;
+  }
+
+  bool changed() const {
+    if (this->whiteShare != this->committedShare || this->currentLevel != this->committedLevel) return true;
+    if (this->limit != this->committedLimit) return true;
+    return LEDC_DITHER && (this->committedDuty & LEDC_DITHER_MASK);  // still dithering a fraction
+  }
+
+  bool steady() const {  // both pins fully on or off, so nothing depends on the LEDC clock running
+    if (!this->output->stopsInLightSleep()) return true;
+    return (this->whiteDrive.duty == 0 || this->whiteDrive.duty >= LEDC_FULL_DUTY)
+           && (this->colourDrive.duty == 0 || this->colourDrive.duty >= LEDC_FULL_DUTY);
+  }
+
+  void releaseInactive() {  // first half of a commit, cuts each pin back to the on time it keeps next frame
+    uint32_t duty = nextDuty();
+    PinDrive off = { 0, 0 };
+    this->nextWhite = off;
+    this->nextColour = off;
+    if (this->whiteShare == 255) {
+      this->nextWhite.duty = duty;
+    } else if (this->whiteShare == 0) {
+      this->nextColour.duty = duty;
+    } else {
+      uint32_t room = LEDC_FULL_DUTY - 2 * LEDC_DEAD_STEPS;  // a gap after each side, the period wraps round
+      if (duty > room) duty = room;
+      uint32_t white = (duty * this->whiteShare + 127) / 255;
+      this->nextWhite.duty = white;
+      this->nextColour.duty = duty - white;
+      this->nextColour.hpoint = white + LEDC_DEAD_STEPS;
+    }
+    // the part of each pin's on time that is in both this frame and the next is clear of the other pin in
+    // either, so whichever period boundary the writes straddle the two sides never overlap
+    drive(this->whiteChannel, this->whiteDrive, overlap(this->whiteDrive, this->nextWhite));
+    drive(this->colourChannel, this->colourDrive, overlap(this->colourDrive, this->nextColour));
+  }
+
+  void driveActive() {  // second half of a commit, sets the pins to the shadow state
+    drive(this->whiteChannel, this->whiteDrive, this->nextWhite);
+    drive(this->colourChannel, this->colourDrive, this->nextColour);
+    this->committedShare = this->whiteShare;
+    this->committedLevel = this->currentLevel;
+    this->committedLimit = this->limit;
+  }
+
+  void commit() {
+    if (!changed()) return;
+    traceRecorder.stamp(micros());
+    releaseInactive();
+    driveActive();
+    this->output->flush();
+  }
+
+  static bool allSteady(const LEDStrip ledStripArray[], int num_strips) {
+    for (int i = 0; i < num_strips; i++) {
+      if (!ledStripArray[i].steady()) return false;
+    }
+    return true;
   }
 
-  void setBrightness(uint8_t brightnessLevel) {     // brightness from 0-255
-    analogWrite(this->inactivePin, 0);              // ensure inactive pin is off
-    analogWrite(this->activePin, brightnessLevel);  // set to brightness level
-    this->currentBrightness = brightnessLevel;
+  // Pushes the frame for every strip in one pass. Every pin is cut back before any is extended, so the
+  // H-bridges never see both sides on and the strips change together. Backends that batch their writes
+  // send the frame at the end, flushing one that has nothing waiting costs nothing.
+  // The strips of one commitAll are the whole load the limiter budgets for.
+  static void commitAll(LEDStrip ledStripArray[], int num_strips) {
+    traceRecorder.stamp(micros());
+    uint32_t requested = 0;
+    for (int i = 0; i < num_strips; i++) {
+      requested += ledStripArray[i].requestedUa();
+    }
+    uint32_t limit = currentLimiter.limit(requested, millis());
+    for (int i = 0; i < num_strips; i++) {
+      ledStripArray[i].limit = limit;
+    }
+    for (int i = 0; i < num_strips; i++) {
+      if (ledStripArray[i].changed()) ledStripArray[i].releaseInactive();
+    }
+    for (int i = 0; i < num_strips; i++) {
+      if (ledStripArray[i].changed()) ledStripArray[i].driveActive();
+    }
+    for (int i = 0; i < num_strips; i++) {
+      ledStripArray[i].output->flush();
+    }
   }
-};
\ No newline at end of file
+};
@@ -0,0 +1,191 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+
+// One cycle of (1 + cos) / 2 scaled to 0-65535, sampled at 256 points plus a guard entry so
+// neighbouring entries can always be interpolated. Shared by every Oscillator.
+static const uint16_t WAVE_TABLE[257] = {
+  65535, 65525, 65496, 65446, 65377, 65289, 65180, 65053, 64905, 64739, 64553, 64348,
+  64124, 63881, 63620, 63339, 63041, 62724, 62389, 62036, 61666, 61278, 60873, 60451,
+  60013, 59558, 59087, 58600, 58097, 57579, 57047, 56499, 55938, 55362, 54773, 54170,
+  53555, 52927, 52287, 51635, 50972, 50298, 49613, 48919, 48214, 47500, 46777, 46046,
+  45307, 44560, 43807, 43046, 42279, 41507, 40729, 39947, 39160, 38369, 37575, 36779,
+  35979, 35178, 34375, 33572, 32768, 31963, 31160, 30357, 29556, 28756, 27960, 27166,
+  26375, 25588, 24806, 24028, 23256, 22489, 21728, 20975, 20228, 19489, 18758, 18035,
+  17321, 16616, 15922, 15237, 14563, 13900, 13248, 12608, 11980, 11365, 10762, 10173,
+  9597, 9036, 8488, 7956, 7438, 6935, 6448, 5977, 5522, 5084, 4662, 4257,
+  3869, 3499, 3146, 2811, 2494, 2196, 1915, 1654, 1411, 1187, 982, 796,
+  630, 482, 355, 246, 158, 89, 39, 10, 0, 10, 39, 89,
+  158, 246, 355, 482, 630, 796, 982, 1187, 1411, 1654, 1915, 2196,
+  2494, 2811, 3146, 3499, 3869, 4257, 4662, 5084, 5522, 5977, 6448, 6935,
+  7438, 7956, 8488, 9036, 9597, 10173, 10762, 11365, 11980, 12608, 13248, 13900,
+  14563, 15237, 15922, 16616, 17321, 18035, 18758, 19489, 20228, 20975, 21728, 22489,
+  23256, 24028, 24806, 25588, 26375, 27166, 27960, 28756, 29556, 30357, 31160, 31963,
+  32767, 33572, 34375, 35178, 35979, 36779, 37575, 38369, 39160, 39947, 40729, 41507,
+  42279, 43046, 43807, 44560, 45307, 46046, 46777, 47500, 48214, 48919, 49613, 50298,
+  50972, 51635, 52287, 52927, 53555, 54170, 54773, 55362, 55938, 56499, 57047, 57579,
+  58097, 58600, 59087, 59558, 60013, 60451, 60873, 61278, 61666, 62036, 62389, 62724,
+  63041, 63339, 63620, 63881, 64124, 64348, 64553, 64739, 64905, 65053, 65180, 65289,
+  65377, 65446, 65496, 65525, 65535,
+};
+
+enum Waveform {
+  WAVE_SINE,    // smooth fade, starts at full brightness like cos
+  WAVE_SQUARE,  // on for the first half of the cycle
+  WAVE_PULSE,   // on for the first duty fraction of the cycle
+};
+
+class Oscillator {
+
+  // An integer phase accumulator (DDS) oscillator. The full 32 bit phase is one cycle.
+  // Each millisecond the phase advances by step + rem / den, and the remainder is carried exactly
+  // in frac, so the phase never drifts from the ideal no matter how long the dress has been on.
+  // Time is only ever used as a difference, so the millis() wrap after 49 days is seamless.
+
+private:
+  uint32_t phase;         // phase at last_time, without the offset
+  uint32_t phase_offset;  // added to the phase before the waveform is looked up
+  uint32_t step;          // whole phase increments per ms
+  uint32_t rem;           // fractional phase increment per ms, in units of 1/den
+  uint32_t den;
+  uint32_t frac;          // carried fraction, always < den
+  uint32_t max_fast_dt;   // largest time step that can be advanced without 64 bit math
+  uint32_t duty;          // pulse width as a fraction of the full phase
+  uint32_t last_time;
+  bool started;
+  Waveform waveform;
+
+  static uint32_t gcd(uint32_t a, uint32_t b) {
+    while (b) {
+      uint32_t t = a % b;
+      a = b;
+      b = t;
+    }
+    return a;
+  }
+
+  void sync(uint32_t time_ms) {  // set the phase directly from the absolute time
+    uint64_t r = (uint64_t)time_ms * this->rem;
+    this->phase = time_ms * this->step + (uint32_t)(r / this->den);
+    this->frac = r % this->den;
+  }
+
+public:
+  Oscillator()
+    : phase(0), phase_offset(0), step(0), rem(0), den(1), frac(0), max_fast_dt(0), duty(0x80000000),
+      last_time(0), started(false), waveform(WAVE_SINE) {}
+
+  // converts a fraction of a cycle (wrapping, so -0.25 is the same as 0.75) to a phase
+  static uint32_t fractionToPhase(float fraction) {
+    double f = fraction - floor(fraction);
+    return (uint32_t)(uint64_t)(f * 4294967296.0);
+  }
+
+  void setWaveform(Waveform waveform) {
+    this->waveform = waveform;
+  }
+
+  void setRate(uint32_t cycles, uint32_t per_ms) {  // the oscillator completes `cycles` cycles every `per_ms` ms
+    uint32_t g = gcd(cycles, per_ms);
+    if (g == 0) g = 1;
+    cycles /= g;
+    per_ms /= g;
+    if (per_ms == 0) per_ms = 1;
+    uint64_t total = (uint64_t)cycles << 32;
+    this->step = (uint32_t)(total / per_ms);
+    this->rem = (uint32_t)(total % per_ms);
+    this->den = per_ms;
+    this->max_fast_dt = (0xFFFFFFFFu - per_ms) / per_ms;
+    this->started = false;  // resync from the absolute time on the next update
+  }
+
+  void retune(uint32_t cycles, uint32_t per_ms) {  // a new rate from the current phase on, without a jump
+    bool started = this->started;
+    setRate(cycles, per_ms);
+    this->started = started;
+    this->frac = 0;
+  }
+
+  void setFrequency(float hz) {  // resolved to 1 mHz
+    setRate((uint32_t)(hz * 1000 + 0.5f), 1000000);
+  }
+
+  void setPeriod(uint32_t period_ms) {
+    setRate(1, period_ms);
+  }
+
+  void setPhaseOffset(uint32_t phase_offset) {
+    this->phase_offset = phase_offset;
+  }
+
+  void setDuty(float duty_cycle) {  // [0-1] fraction of the cycle to be on for, used by WAVE_PULSE
+    if (duty_cycle >= 1) {
+      this->duty = 0xFFFFFFFF;
+    } else if (duty_cycle <= 0) {
+      this->duty = 0;
+    } else {
+      this->duty = fractionToPhase(duty_cycle);
+    }
+  }
+
+  uint32_t update(uint32_t time_ms) {  // advances to time_ms and returns the phase including the offset
+    if (!this->started) {
+      sync(time_ms);
+      this->started = true;
+    } else {
+      uint32_t dt = time_ms - this->last_time;
+      if (dt <= this->max_fast_dt) {
+        uint32_t acc = this->frac + dt * this->rem;
+        this->phase += dt * this->step + acc / this->den;
+        this->frac = acc % this->den;
+      } else {
+        uint64_t acc = this->frac + (uint64_t)dt * this->rem;
+        this->phase += dt * this->step + (uint32_t)(acc / this->den);
+        this->frac = acc % this->den;
+      }
+    }
+    this->last_time = time_ms;
+    return this->phase + this->phase_offset;
+  }
+
+  // waveforms as pure functions of phase, so batched kernels can share one phase across many strips
+
+  static uint16_t sine(uint32_t phase) {  // (1 + cos) / 2, 0-65535
+    uint32_t i = phase >> 24;          // table entry
+    int32_t t = (phase >> 16) & 0xFF;  // position between this entry and the next
+    int32_t a = WAVE_TABLE[i];
+    int32_t b = WAVE_TABLE[i + 1];
+    return a + (((b - a) * t) >> 8);
+  }
+
+  static uint16_t pulse(uint32_t phase, uint32_t duty) {  // full on for the first duty of the cycle
+    return phase < duty ? 0xFFFF : 0;
+  }
+
+  // whole ms from the last update until the phase (offset included) next reaches target, which is when a
+  // pulse edge at target shows. A phase already at target waits a whole cycle, its edge has been shown.
+  uint32_t msUntil(uint32_t target) const {
+    uint64_t distance = (uint32_t)(target - this->phase - this->phase_offset);
+    if (distance == 0) distance = 1ull << 32;
+    uint64_t per_ms = (uint64_t)this->step * this->den + this->rem;  // phase per ms, in 1/den
+    if (per_ms == 0) return 0xFFFFFFFF;
+    uint64_t ms = (distance * this->den - this->frac + per_ms - 1) / per_ms;
+    return ms < 0xFFFFFFFF ? ms : 0xFFFFFFFF;
+  }
+
+  uint32_t getDuty() const {
+    return this->duty;
+  }
+
+  uint16_t level() const {  // current output, 0-65535
+    uint32_t p = this->phase + this->phase_offset;
+    switch (this->waveform) {
+      case WAVE_SQUARE:
+        return pulse(p, 0x80000000u);
+      case WAVE_PULSE:
+        return pulse(p, this->duty);
+      default:
+        return sine(p);
+    }
+  }
+};
@@ -1,7 +1,24 @@
-#include "HardwareSerial.h"
 #pragma once
 #include "Effects.h"
+#include "Kernels.h"
 #include "LEDStrip.h"
+#include "Log.h"
+#include "Bake.h"
+#include "Bytecode.h"
+#include "Graph.h"
+
+#ifndef NUMBER_OF_STRIPS
+#define NUMBER_OF_STRIPS 6  // the sketch defines this before including Patterns.h to size the patterns
+#endif
+
+// what setParameter can change on a running pattern, values are whole numbers in the units given
+enum PatternParameter : uint8_t {
+  PARAM_BRIGHTNESS,   // 0-255, solid, sequence, mix and graphs
+  PARAM_PERIOD_MS,    // sequence, one walk along every strip
+  PARAM_SPEED,        // chaos, in millionths of ChaosEffect's speed, so 2000 is the .002 the modes start with
+  PARAM_RATE,         // baked waves, playback speed in percent of the table's own
+  PARAM_WHITE_SHARE,  // 0-255, mix
+};
 
 class Pattern {
 
@@ -10,81 +27,697 @@ class Pattern {
   // must take (LEDStrip ledStripArray[], int num_strips) and can optionally take other arguments
   // to set up the effects in the desired way. The constructor of the derived class must fill in
   // every element of the effectArray defined in Pattern.
+  // Effects only write the strips' shadow state; update() commits every strip together at the end of the frame.
+  // Derived classes own their effects as fixed arrays of NUMBER_OF_STRIPS, and have a default constructor and
+  // a configure method with the same arguments as their constructor, so PatternPool can keep one of each
+  // and switch modes without touching the heap.
+  // Patterns where every strip runs the same maths can skip the effects and override render() to run a
+  // batched kernel from Kernels.h over all their strips at once; those take the strip count as a template parameter.
+  // nextChangeMs is the soonest any strip's output changes after a render, so those patterns override it too.
+  // setParameter changes a PatternParameter while the pattern runs, from the render task between frames, and
+  // carries on from the current frame rather than restarting; it is false for parameters a pattern lacks.
 
 protected:
 
   int num_strips;
-  Effect** effectArray;
+  LEDStrip* ledStripArray;
+  Effect* effectArray[NUMBER_OF_STRIPS];
+
+  void attach(LEDStrip ledStripArray[], int num_strips, int capacity = NUMBER_OF_STRIPS) {
+    this->ledStripArray = ledStripArray;
+    this->num_strips = num_strips < capacity ? num_strips : capacity;
+  }
+
+  void setStripsWhite(bool is_white) {
+    for (int i = 0; i < num_strips; i++) {
+      if (is_white) {
+        this->ledStripArray[i].setWhite();
+      } else {
+        this->ledStripArray[i].setColour();
+      }
+    }
+  }
 
 public:
-  Pattern(int num_strips)  // must be overridden in derived classes to create the appropriate
-                           // effectArray from additional args in the constructor
-    : num_strips(num_strips) {
-    this->effectArray = new Effect*[num_strips];
+  Pattern()
+    : num_strips(0), ledStripArray(nullptr) {}
+
+  Pattern(LEDStrip ledStripArray[], int num_strips) {  // must be overridden in derived classes to create the appropriate
+                                                       // effectArray from additional args in the constructor
+    attach(ledStripArray, num_strips);
   }
 
+  virtual ~Pattern() {}
+
   void update(unsigned long tims_ms) {  // takes current time in ms
     //Serial.println("Updating pattern");
+    render(tims_ms);
+    LEDStrip::commitAll(this->ledStripArray, this->num_strips);
+  }
+
+  void virtual render(unsigned long time_ms) {  // fills in the strips' shadow state for this frame
+    for (int i = 0; i < num_strips; i++) {
+      this->effectArray[i]->update(time_ms);
+    }
+  }
+
+  uint32_t virtual nextChangeMs(unsigned long time_ms) {  // after render(time_ms), or CHANGES_NEVER
+    uint32_t soonest = CHANGES_NEVER;
+    for (int i = 0; i < num_strips; i++) {
+      uint32_t next = this->effectArray[i]->nextChangeMs(time_ms);
+      if (next < soonest) soonest = next;
+    }
+    return soonest;
+  }
+
+  void virtual setIsWhite(bool is_white) {  // switch every effect between white and colour in place
     for (int i = 0; i < num_strips; i++) {
-      this->effectArray[i]->update(tims_ms);
+      this->effectArray[i]->setIsWhite(is_white);
     }
   }
 
-  ~Pattern() {
-    delete[] effectArray;
+  bool virtual setParameter(uint8_t parameter, int32_t value) {
+    return false;
   }
 };
 
 class SolidPattern : public Pattern {
 
+private:
+  SolidEffect effects[NUMBER_OF_STRIPS];
+
 public:
-  SolidPattern(LEDStrip ledStripArray[], int num_strips, uint8_t brightness, bool is_white)
-    : Pattern(num_strips) {
-    for (int i = 0; i < num_strips; i++) {
-      effectArray[i] = new SolidEffect(ledStripArray[i], brightness, is_white);
+  SolidPattern(){};
+
+  SolidPattern(LEDStrip ledStripArray[], int num_strips, uint8_t brightness, bool is_white) {
+    configure(ledStripArray, num_strips, brightness, is_white);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips, uint8_t brightness, bool is_white) {
+    attach(ledStripArray, num_strips);
+    for (int i = 0; i < this->num_strips; i++) {
+      effects[i].configure(&ledStripArray[i], brightness, is_white);
+      effectArray[i] = &effects[i];
+    }
+    LOG_DEBUG("Built solid pattern");
+  }
+
+  bool setParameter(uint8_t parameter, int32_t value) override {
+    if (parameter != PARAM_BRIGHTNESS || value < 0 || value > 255) return false;
+    for (int i = 0; i < this->num_strips; i++) {
+      this->ledStripArray[i].setBrightness(value);
     }
-    Serial.println("Built solid pattern");
+    return true;
   }
 };
 
 
+class MixPattern : public Pattern {
+
+  // every strip showing white and colour at once
+
+private:
+  MixEffect effects[NUMBER_OF_STRIPS];
+
+public:
+  MixPattern(){};
+
+  MixPattern(LEDStrip ledStripArray[], int num_strips, uint8_t white_share, uint8_t brightness) {
+    configure(ledStripArray, num_strips, white_share, brightness);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips, uint8_t white_share, uint8_t brightness) {
+    attach(ledStripArray, num_strips);
+    for (int i = 0; i < this->num_strips; i++) {
+      effects[i].configure(&ledStripArray[i], white_share, brightness);
+      effectArray[i] = &effects[i];
+    }
+    LOG_DEBUG("Built mix pattern");
+  }
+
+  bool setParameter(uint8_t parameter, int32_t value) override {
+    if (parameter != PARAM_BRIGHTNESS && parameter != PARAM_WHITE_SHARE) return false;
+    if (value < 0 || value > 255) return false;
+    for (int i = 0; i < this->num_strips; i++) {
+      if (parameter == PARAM_BRIGHTNESS) {
+        this->ledStripArray[i].setBrightness(value);
+      } else {
+        this->ledStripArray[i].setMix(value);
+      }
+    }
+    return true;
+  }
+};
+
+template <int N>
 class SequencePattern : public Pattern {
 
+  // a single lit strip that steps along all of them, once per period
+
+private:
+  SequenceKernel<N> kernel;
+  uint8_t brightness;
+
 public:
-  SequencePattern(LEDStrip ledStripArray[], int num_strips, int period_ms, uint8_t brightness, bool is_white)
-    : Pattern(num_strips) {
+  SequencePattern(){};
 
-    float duty_cycle = 1.0 / num_strips;
-    float phase_ratio = 1.0 / num_strips;
+  SequencePattern(LEDStrip ledStripArray[], int num_strips, int period_ms, uint8_t brightness, bool is_white) {
+    configure(ledStripArray, num_strips, period_ms, brightness, is_white);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips, int period_ms, uint8_t brightness, bool is_white) {
+    attach(ledStripArray, num_strips, N);
+    this->brightness = brightness;
+    this->kernel.configure(period_ms, this->num_strips);
+    setStripsWhite(is_white);
+    LOG_DEBUG("Built sequence pattern");
+  }
 
+  void render(unsigned long time_ms) override {
+    this->kernel.render(time_ms);
     for (int i = 0; i < num_strips; i++) {
-      effectArray[i] = new BlinkEffect(ledStripArray[i], period_ms, duty_cycle, i * phase_ratio, brightness, is_white);
+      this->ledStripArray[i].setBrightness(this->kernel.level[i] ? this->brightness : 0);
     }
-    Serial.println("Built sequence pattern");
+  }
+
+  uint32_t nextChangeMs(unsigned long time_ms) override {
+    return this->kernel.msUntilEdge(num_strips);
+  }
+
+  void setIsWhite(bool is_white) override {
+    setStripsWhite(is_white);
+  }
+
+  bool setParameter(uint8_t parameter, int32_t value) override {
+    if (parameter == PARAM_BRIGHTNESS && value >= 0 && value <= 255) {
+      this->brightness = value;
+    } else if (parameter == PARAM_PERIOD_MS && value > 0) {
+      this->kernel.setPeriod(value);
+    } else {
+      return false;
+    }
+    return true;
   }
 };
 
-class WavePattern : public Pattern {
+template <int N>
+class ChaosPattern : public Pattern {
+
+  // every strip flickers independently, swapping between white and colour
+
+private:
+  ChaosKernel<N> kernel;
+
 public:
-  WavePattern(LEDStrip ledStripArray[], int num_strips, float frequency, bool is_white)
-    : Pattern(num_strips) {
+  ChaosPattern(){};
+
+  ChaosPattern(LEDStrip ledStripArray[], int num_strips) {
+    configure(ledStripArray, num_strips);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips) {
+    attach(ledStripArray, num_strips, N);
+    float speed = .002;
+    this->kernel.configure(ChaosEffect::chaosSpeed(speed));
+    LOG_DEBUG("Built chaos pattern");
+  }
+
+  void render(unsigned long time_ms) override {
+    this->kernel.render(time_ms);
     for (int i = 0; i < num_strips; i++) {
-      effectArray[i] = new FadeEffect(ledStripArray[i], frequency, i * 360.0 / num_strips, is_white);
+      int32_t r = this->kernel.value[i];
+      if (r > 0) {
+        this->ledStripArray[i].setWhite();
+      } else {
+        this->ledStripArray[i].setColour();
+      }
+      int32_t magnitude = r < 0 ? -r : r;
+      this->ledStripArray[i].setLevel(magnitude > 32767 ? 65535 : magnitude << 1);
     }
-    Serial.print("Built Wave, is_white ");
-    Serial.println(is_white);
+  }
+
+  uint32_t nextChangeMs(unsigned long time_ms) override {
+    return 1;
+  }
+
+  void setIsWhite(bool is_white) override {}  // the noise picks the colour
+
+  bool setParameter(uint8_t parameter, int32_t value) override {
+    if (parameter != PARAM_SPEED || value <= 0) return false;
+    this->kernel.setSpeed(ChaosEffect::chaosSpeed(value / 1000000.0f));
+    return true;
   }
 };
 
 
-class ChaosPattern : public Pattern {
+template <int N>
+class ChaosPatternSingleColor : public Pattern {
+
+  // every strip flickers independently in one colour
+
+private:
+  ChaosKernel<N> kernel;
+
 public:
-  ChaosPattern(LEDStrip ledStripArray[], int num_strips)
-    : Pattern(num_strips) {
+  ChaosPatternSingleColor(){};
+
+  ChaosPatternSingleColor(LEDStrip ledStripArray[], int num_strips, bool is_white) {
+    configure(ledStripArray, num_strips, is_white);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips, bool is_white) {
+    attach(ledStripArray, num_strips, N);
     float speed = .002;
+    this->kernel.configure(ChaosEffect::chaosSpeed(speed));
+    setStripsWhite(is_white);
+    LOG_DEBUG("Built chaos pattern");
+  }
+
+  void render(unsigned long time_ms) override {
+    this->kernel.render(time_ms);
     for (int i = 0; i < num_strips; i++) {
-      effectArray[i] = new ChaosEffect(ledStripArray[i], speed, float(i));
+      this->ledStripArray[i].setLevel(this->kernel.value[i] + 32768);  // -32768-32767 to 0-65535
     }
-    Serial.println("Built chaos pattern");
   }
-};
\ No newline at end of file
+
+  uint32_t nextChangeMs(unsigned long time_ms) override {
+    return 1;
+  }
+
+  void setIsWhite(bool is_white) override {
+    setStripsWhite(is_white);
+  }
+  bool setParameter(uint8_t parameter, int32_t value) override {
+    if (parameter != PARAM_SPEED || value <= 0) return false;
+    this->kernel.setSpeed(ChaosEffect::chaosSpeed(value / 1000000.0f));
+    return true;
+  }
+};
+
+
+template <int N>
+class BakedPattern : public Pattern {
+
+  // plays back a table made by PatternBaker, interpolating each strip between its keyframes.
+  // Each strip keeps a cursor into its keyframes and the slope of the segment it is in, so a frame
+  // is a compare and a multiply per strip; the cursor only moves when a keyframe is passed.
+
+private:
+  const BakedTable* table;
+  bool is_white;
+  uint16_t cursor[N];     // index of the keyframe each strip's segment starts at
+  int32_t slope[N];       // level change per ms of that segment, 24.8
+  uint32_t period_start;  // playback time the current period began at
+  uint32_t rate;          // playback speed in percent, the table plays from base_play at base_ms at this rate
+  uint32_t base_ms;
+  uint32_t base_play;
+  uint32_t last_ms;
+
+  uint32_t playTime(uint32_t time_ms) const {  // table time for time_ms, the same as it when played at 100%
+    if (this->rate == 100) return this->base_play + (time_ms - this->base_ms);
+    return this->base_play + (uint32_t)((uint64_t)(time_ms - this->base_ms) * this->rate / 100);
+  }
+
+  void seek(int i, uint16_t index) {
+    const Keyframe& a = this->table->keys[index];
+    const Keyframe& b = this->table->keys[index + 1];
+    this->cursor[i] = index;
+    this->slope[i] = ((int32_t)(b.level - a.level) << 8) / (b.time_ms - a.time_ms);
+  }
+
+  void rewind() {
+    for (int i = 0; i < num_strips; i++) {
+      seek(i, this->table->starts[i]);
+    }
+  }
+
+public:
+  BakedPattern()
+    : table(nullptr), is_white(true), period_start(0), rate(100), base_ms(0), base_play(0), last_ms(0) {}
+
+  BakedPattern(LEDStrip ledStripArray[], int num_strips, const BakedTable* table, bool is_white) {
+    configure(ledStripArray, num_strips, table, is_white);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips, const BakedTable* table, bool is_white) {
+    attach(ledStripArray, num_strips < table->num_strips ? num_strips : table->num_strips, N);
+    this->table = table;
+    this->period_start = 0;
+    this->rate = 100;
+    this->base_ms = 0;
+    this->base_play = 0;
+    this->last_ms = 0;
+    rewind();
+    setIsWhite(is_white);
+    LOG_DEBUG("Built baked pattern, %u keyframes", table->starts[table->num_strips]);
+  }
+
+  void render(unsigned long time_ms) override {
+    this->last_ms = time_ms;
+    uint32_t play = playTime(time_ms);
+    uint32_t t = play - this->period_start;
+    if (t >= this->table->period_ms) {  // into a new period, or time jumped
+      t %= this->table->period_ms;
+      this->period_start = play - t;
+      rewind();
+    }
+
+    const Keyframe* keys = this->table->keys;
+    for (int i = 0; i < num_strips; i++) {
+      uint16_t index = this->cursor[i];
+      if (keys[index + 1].time_ms <= t) {  // passed a keyframe, find the new segment
+        uint16_t last = this->table->starts[i + 1] - 1;
+        do {
+          index++;
+        } while (index + 1 < last && keys[index + 1].time_ms <= t);
+        seek(i, index);
+      }
+
+      int32_t level = keys[index].level + ((this->slope[i] * (int32_t)(t - keys[index].time_ms) + 0x80) >> 8);
+      if (this->table->follows_colour) {  // the strips stay on the side setIsWhite put them
+        this->ledStripArray[i].setLevel(level << 1 | level >> 14);  // 0-32767 to 0-65535
+        continue;
+      }
+      if (level > 0 || (level == 0 && this->is_white)) {
+        this->ledStripArray[i].setWhite();
+      } else {
+        this->ledStripArray[i].setColour();
+      }
+      int32_t magnitude = level < 0 ? -level : level;
+      this->ledStripArray[i].setLevel(magnitude << 1 | magnitude >> 14);
+    }
+  }
+
+  uint32_t nextChangeMs(unsigned long time_ms) override {  // only flat segments can be slept through
+    uint32_t t = playTime(time_ms) - this->period_start;
+    uint32_t soonest = this->table->period_ms - t;
+    for (int i = 0; i < num_strips; i++) {
+      if (this->slope[i] != 0) return 1;
+      uint32_t next = this->table->keys[this->cursor[i] + 1].time_ms - t;
+      if (next < soonest) soonest = next;
+    }
+    if (this->rate == 100) return soonest;
+    return (uint32_t)(((uint64_t)soonest * 100 + this->rate - 1) / this->rate);  // table ms to real ms, rounded up
+  }
+
+  void setIsWhite(bool is_white) override {
+    this->is_white = is_white;
+    setStripsWhite(is_white);
+  }
+
+  bool setParameter(uint8_t parameter, int32_t value) override {
+    if (parameter != PARAM_RATE || value <= 0 || value > 10000) return false;
+    this->base_play = playTime(this->last_ms);
+    this->base_ms = this->last_ms;
+    this->rate = value;
+    return true;
+  }
+};
+
+
+template <int N>
+class BytecodePattern : public Pattern {
+
+  // runs a program from the patterns partition on every strip, see Bytecode.h
+
+private:
+  BytecodeProgram program;
+  bool is_white;
+  int32_t registers[N][BYTECODE_REGISTERS];  // each strip's, kept from frame to frame
+
+public:
+  BytecodePattern()
+    : is_white(true) {}
+
+  BytecodePattern(LEDStrip ledStripArray[], int num_strips, BytecodeProgram program, bool is_white) {
+    configure(ledStripArray, num_strips, program, is_white);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips, BytecodeProgram program, bool is_white) {
+    attach(ledStripArray, num_strips, N);
+    this->program = program;
+    memset(this->registers, 0, sizeof(this->registers));
+    setIsWhite(is_white);
+    LOG_DEBUG("Built bytecode pattern");
+  }
+
+  void render(unsigned long time_ms) override {
+    for (int i = 0; i < num_strips; i++) {
+      int32_t* r = this->registers[i];
+      r[0] = (int32_t)time_ms;
+      r[1] = i;
+      r[2] = num_strips;
+      r[3] = this->is_white;
+      BytecodeProgram::Output out = { 0, 0, -1 };
+      this->program.run(r, out);
+
+      LEDStrip& strip = this->ledStripArray[i];
+      if (out.mix >= 0) {
+        strip.setMix(out.mix);
+      } else if (out.dir > 0 || (out.dir == 0 && this->is_white)) {
+        strip.setWhite();
+      } else {
+        strip.setColour();
+      }
+      strip.setLevel(out.level);
+    }
+  }
+
+  uint32_t nextChangeMs(unsigned long time_ms) override {  // a program can change whenever it likes
+    return 1;
+  }
+
+  void setIsWhite(bool is_white) override {
+    this->is_white = is_white;
+    setStripsWhite(is_white);
+  }
+};
+
+
+#if AUDIO_ENABLED
+class AudioPattern : public Pattern {
+
+  // the strips split the bands between them, bass first, optionally swinging between white and colour on
+  // the beat. Each frame takes the analyser's newest features and tells it when they were shown.
+
+private:
+  BandEffect bands[NUMBER_OF_STRIPS];
+  BeatSwingEffect swings[NUMBER_OF_STRIPS];
+  AudioAnalyser* analyser;
+  AudioFeatures features;
+
+public:
+  AudioPattern()
+    : analyser(nullptr), features(){};
+
+  AudioPattern(LEDStrip ledStripArray[], int num_strips, AudioAnalyser* analyser, bool swing, bool is_white) {
+    configure(ledStripArray, num_strips, analyser, swing, is_white);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips, AudioAnalyser* analyser, bool swing, bool is_white) {
+    attach(ledStripArray, num_strips);
+    this->analyser = analyser;
+    this->features = AudioFeatures();
+    for (int i = 0; i < this->num_strips; i++) {
+      uint8_t band = i * AUDIO_BANDS / this->num_strips;
+      if (swing) {
+        swings[i].configure(&ledStripArray[i], &this->features, band, is_white);
+        effectArray[i] = &swings[i];
+      } else {
+        bands[i].configure(&ledStripArray[i], &this->features, band, is_white);
+        effectArray[i] = &bands[i];
+      }
+    }
+    LOG_DEBUG("Built audio pattern");
+  }
+
+  void render(unsigned long time_ms) override {
+    bool heard = this->analyser->latest(this->features);
+    Pattern::render(time_ms);
+    if (heard) this->analyser->noteShown(this->features, micros());
+  }
+};
+#endif
+
+
+template <int N>
+class GraphPattern : public Pattern {
+
+  // evaluates a Graph every frame. values holds every node's output for every strip, but a node that is
+  // the same on every strip only fills and is only read from its first column, so shared oscillators and
+  // the blends of them are worked out once a frame however many strips read them
+
+private:
+  Graph graph;
+  Oscillator oscillators[GRAPH_MAX_NODES];  // the phase of each oscillator and envelope node
+  bool varies[GRAPH_MAX_NODES];             // differs between strips
+  uint16_t values[GRAPH_MAX_NODES][N];
+  bool moves;  // has a node that changes with time
+  uint8_t brightness;
+
+  static uint16_t envelope(const GraphNode& node, uint32_t phase) {
+    if (phase < node.attack) return ((uint64_t)(phase >> 16) * node.rise) >> 16;
+    if (phase >= node.decay_end) return 0;
+    uint32_t level = ((uint64_t)((phase - node.attack) >> 16) * node.fall) >> 16;
+    return level < 65535 ? 65535 - level : 0;
+  }
+
+  static uint16_t wave(const GraphNode& node, uint32_t phase) {
+    switch (node.waveform) {
+      case WAVE_SQUARE:
+        return Oscillator::pulse(phase, 0x80000000u);
+      case WAVE_PULSE:
+        return Oscillator::pulse(phase, node.duty);
+      default:
+        return Oscillator::sine(phase);
+    }
+  }
+
+  void blend(const GraphNode& node, uint16_t* out, int strips) {
+    const uint16_t* a = this->values[node.in[0]];
+    const uint16_t* b = this->values[node.in[1]];
+    int step_a = this->varies[node.in[0]];  // 0 reads a shared node's first column for every strip
+    int step_b = this->varies[node.in[1]];
+    for (int i = 0; i < strips; i++) {
+      uint32_t x = a[i * step_a];
+      uint32_t y = b[i * step_b];
+      switch (node.op) {
+        case GRAPH_MULTIPLY:
+          out[i] = (x * y + 32768) >> 16;
+          break;
+        case GRAPH_MAX:
+          out[i] = x > y ? x : y;
+          break;
+        case GRAPH_ADD:
+          out[i] = x + y > 65535 ? 65535 : x + y;
+          break;
+        case GRAPH_CROSSFADE:
+          {
+            int64_t t = this->values[node.in[2]][i * this->varies[node.in[2]]];
+            out[i] = x + ((((int64_t)y - (int64_t)x) * t) >> 16);
+            break;
+          }
+      }
+    }
+  }
+
+public:
+  GraphPattern()
+    : moves(false), brightness(255){};
+
+  // build fills in the graph, and is called again each time the pattern is configured
+  GraphPattern(LEDStrip ledStripArray[], int num_strips, void (*build)(Graph& graph), bool is_white) {
+    configure(ledStripArray, num_strips, build, is_white);
+  }
+
+  void configure(LEDStrip ledStripArray[], int num_strips, void (*build)(Graph& graph), bool is_white) {
+    attach(ledStripArray, num_strips, N);
+    this->graph.clear();
+    build(this->graph);
+    this->moves = false;
+    this->brightness = 255;
+    for (int n = 0; n < this->graph.count; n++) {
+      const GraphNode& node = this->graph.nodes[n];
+      switch (node.op) {
+        case GRAPH_CONSTANT:
+          this->varies[n] = false;
+          this->values[n][0] = node.value;
+          break;
+        case GRAPH_OSCILLATOR:
+        case GRAPH_ENVELOPE:
+          this->varies[n] = node.step != 0;
+          this->oscillators[n] = Oscillator();
+          this->oscillators[n].setPeriod(node.period_ms);
+          this->moves = true;
+          break;
+        case GRAPH_NOISE:
+          this->varies[n] = !node.shared;
+          this->moves = true;
+          break;
+        default:
+          this->varies[n] = this->varies[node.in[0]] || this->varies[node.in[1]] ||
+                            (node.op == GRAPH_CROSSFADE && this->varies[node.in[2]]);
+          break;
+      }
+    }
+    setStripsWhite(is_white);
+    LOG_DEBUG("Built graph pattern of %d nodes", this->graph.count);
+  }
+
+  void render(unsigned long time_ms) override {
+    for (int n = 0; n < this->graph.count; n++) {
+      const GraphNode& node = this->graph.nodes[n];
+      uint16_t* out = this->values[n];
+      int strips = this->varies[n] ? this->num_strips : 1;
+      switch (node.op) {
+        case GRAPH_CONSTANT:
+          break;  // filled in by configure
+        case GRAPH_OSCILLATOR:
+          {
+            uint32_t phase = this->oscillators[n].update(time_ms);
+            for (int i = 0; i < strips; i++) out[i] = wave(node, phase + i * node.step);
+            break;
+          }
+        case GRAPH_ENVELOPE:
+          {
+            uint32_t phase = this->oscillators[n].update(time_ms);
+            for (int i = 0; i < strips; i++) out[i] = envelope(node, phase + i * node.step);
+            break;
+          }
+        case GRAPH_NOISE:
+          {
+            uint32_t position = time_ms * node.speed;  // wraps around the noise ring, which is seamless
+            for (int i = 0; i < strips; i++) out[i] = Noise::fractal(node.seed + i, position) + 32768;
+            break;
+          }
+        default:
+          blend(node, out, strips);
+          break;
+      }
+    }
+
+    uint8_t level = this->graph.level;
+    uint8_t white_share = this->graph.white_share;
+    for (int i = 0; i < num_strips; i++) {
+      uint32_t value = level == GRAPH_NONE ? 0 : this->values[level][i * this->varies[level]];
+      this->ledStripArray[i].setLevel((value * this->brightness * 257 + 32768) >> 16);
+      if (white_share != GRAPH_NONE) {
+        this->ledStripArray[i].setMix(this->values[white_share][i * this->varies[white_share]] >> 8);
+      }
+    }
+  }
+
+  uint32_t nextChangeMs(unsigned long time_ms) override {
+    return this->moves ? 1 : CHANGES_NEVER;
+  }
+
+  void setIsWhite(bool is_white) override {  // a graph with a white share output picks the colour itself
+    if (this->graph.white_share == GRAPH_NONE) setStripsWhite(is_white);
+  }
+
+  bool setParameter(uint8_t parameter, int32_t value) override {
+    if (parameter != PARAM_BRIGHTNESS || value < 0 || value > 255) return false;
+    this->brightness = value;
+    return true;
+  }
+};
+
+
+class PatternPool {
+
+  // One preallocated instance of every kind of Pattern. selectActivePattern reconfigures one of these
+  // in place, so changing mode or colour never allocates and the heap cannot fragment over a night of presses.
+
+public:
+  SolidPattern solid;
+  MixPattern mix;
+  SequencePattern<NUMBER_OF_STRIPS> sequence;
+  BakedPattern<NUMBER_OF_STRIPS> baked;  // the waves, played from BakedTables.h
+  ChaosPattern<NUMBER_OF_STRIPS> chaos;
+  ChaosPatternSingleColor<NUMBER_OF_STRIPS> chaosSingleColor;
+  BytecodePattern<NUMBER_OF_STRIPS> bytecode;  // the modes after TOTAL_MODES, from the patterns partition
+  GraphPattern<NUMBER_OF_STRIPS> graph;
+#if AUDIO_ENABLED
+  AudioPattern audio;
+#endif
+};
@@ -0,0 +1,179 @@
+#pragma once
+#include <stdint.h>
+#include <Wire.h>
+#include "Output.h"
+#include "Log.h"
+
+#ifndef PCA9685_ADDRESS
+#define PCA9685_ADDRESS 0x40  // the first board, with no address jumpers bridged, the rest follow on from it
+#endif
+#ifndef PCA9685_FREQUENCY_HZ
+#define PCA9685_FREQUENCY_HZ 1500  // close to the chip's 1526 Hz limit, to keep the PWM out of camera shots
+#endif
+#ifndef PCA9685_I2C_HZ
+#define PCA9685_I2C_HZ 1000000  // Fast-mode Plus, 6 boards with every channel changing take ~3.6 ms a frame
+#endif
+#ifndef PCA9685_MERGE_GAP
+#define PCA9685_MERGE_GAP 1  // unchanged channels worth resending to keep the changes either side in one block
+#endif
+
+#define PCA9685_CHANNELS 16
+#define PCA9685_STRIPS (PCA9685_CHANNELS / 2)
+#define PCA9685_OSCILLATOR_HZ 25000000
+#define PCA9685_STEPS 4096
+
+// registers
+#define PCA9685_MODE1 0x00
+#define PCA9685_MODE2 0x01
+#define PCA9685_LED0 0x06  // ON_L, ON_H, OFF_L, OFF_H for each channel from here
+#define PCA9685_ALL_LED 0xFA
+#define PCA9685_PRE_SCALE 0xFE
+#define PCA9685_MODE1_SLEEP 0x10
+#define PCA9685_MODE1_AI 0x20  // register address auto increment, for block writes
+#define PCA9685_MODE2_OUTDRV 0x04
+#define PCA9685_FULL 0x1000  // in ON full on, in OFF full off
+
+
+template <int CHIPS>
+class Pca9685Output : public OutputBackend {
+
+  // H-bridges on chained PCA9685 16 channel PWM expanders over I2C, for more strips than the LEDC has
+  // channels for. Output n is channel n % 16 of the board at PCA9685_ADDRESS + n / 16, and a strip takes two
+  // neighbouring outputs, so a board drives 8 strips.
+  // write() only updates a copy of the boards' LED registers. flush() sends the channels that changed,
+  // each board's as auto increment block writes of a run of channels, so a frame costs one transaction
+  // per board where anything changed. The board applies a block's registers together at the I2C stop,
+  // and a strip's two outputs are neighbours, so they always share a block: both sides of an H-bridge
+  // change at once, and a failed write leaves the strip as it was to be tried again next frame.
+  // The PCA9685 runs its PWM from its own oscillator, so the ESP32 can light sleep whatever the strips show.
+
+private:
+  TwoWire* wire;
+  uint8_t address;
+  uint16_t on[CHIPS * PCA9685_CHANNELS];   // the LED registers as last written
+  uint16_t off[CHIPS * PCA9685_CHANNELS];
+  uint16_t dirty[CHIPS];                   // channels written since the last flush
+  uint32_t failures;
+  uint32_t bytes;
+
+  static uint32_t steps(uint32_t ledc) {  // LEDC steps to PCA9685 steps
+#if LEDC_RESOLUTION_BITS <= 12
+    return ledc << (12 - LEDC_RESOLUTION_BITS);
+#else
+    return ledc >> (LEDC_RESOLUTION_BITS - 12);
+#endif
+  }
+
+  bool writeRegisters(uint8_t chip, uint8_t reg, const uint8_t* data, uint8_t count) {
+    this->wire->beginTransmission(this->address + chip);
+    this->wire->write(reg);
+    this->wire->write(data, count);
+    this->bytes += count + 2;
+    return this->wire->endTransmission() == 0;
+  }
+
+  bool writeRegister(uint8_t chip, uint8_t reg, uint8_t value) {
+    return writeRegisters(chip, reg, &value, 1);
+  }
+
+  bool sendRun(uint8_t chip, int first, int last) {
+    uint8_t block[PCA9685_CHANNELS * 4];
+    uint8_t count = 0;
+    for (int c = first; c <= last; c++) {
+      int output = chip * PCA9685_CHANNELS + c;
+      block[count++] = this->on[output] & 0xFF;
+      block[count++] = this->on[output] >> 8;
+      block[count++] = this->off[output] & 0xFF;
+      block[count++] = this->off[output] >> 8;
+    }
+    return writeRegisters(chip, PCA9685_LED0 + 4 * first, block, count);
+  }
+
+public:
+  Pca9685Output()
+    : wire(nullptr), address(PCA9685_ADDRESS), failures(0), bytes(0) {
+    for (int i = 0; i < CHIPS * PCA9685_CHANNELS; i++) {
+      this->on[i] = 0;
+      this->off[i] = PCA9685_FULL;
+    }
+    memset(this->dirty, 0, sizeof(this->dirty));
+  }
+
+  bool begin(TwoWire& wire, uint8_t address = PCA9685_ADDRESS) {  // after wire.begin, before any strip attaches
+    this->wire = &wire;
+    this->address = address;
+    uint8_t prescale = (PCA9685_OSCILLATOR_HZ + PCA9685_STEPS * PCA9685_FREQUENCY_HZ / 2) / (PCA9685_STEPS * PCA9685_FREQUENCY_HZ) - 1;
+    const uint8_t all_off[4] = { 0, 0, 0, PCA9685_FULL >> 8 };
+    bool ok = true;
+    for (uint8_t chip = 0; chip < CHIPS; chip++) {
+      bool found = writeRegister(chip, PCA9685_MODE1, PCA9685_MODE1_SLEEP | PCA9685_MODE1_AI)  // the prescaler only takes writes while asleep
+                   && writeRegister(chip, PCA9685_PRE_SCALE, prescale)
+                   && writeRegister(chip, PCA9685_MODE2, PCA9685_MODE2_OUTDRV)  // totem pole, into the H-bridge inputs
+                   && writeRegisters(chip, PCA9685_ALL_LED, all_off, sizeof(all_off))
+                   && writeRegister(chip, PCA9685_MODE1, PCA9685_MODE1_AI);
+      if (!found) {
+        LOG_ERROR("No PCA9685 answering at 0x%02x", address + chip);
+        ok = false;
+      }
+    }
+    delayMicroseconds(500);  // for the oscillator to start after sleep
+    LOG_INFO("%d PCA9685 boards at %u Hz, %s", CHIPS, PCA9685_FREQUENCY_HZ, ok ? "all found" : "some missing");
+    return ok;
+  }
+
+  uint8_t attach(uint8_t pin) override {  // every output was switched off by begin
+    return pin;
+  }
+
+  void write(uint8_t channel, PinDrive drive) override {
+    if (channel >= CHIPS * PCA9685_CHANNELS) return;
+    uint32_t duty = steps(drive.duty);
+    uint32_t start = steps(drive.hpoint);
+    uint16_t on = 0, off = PCA9685_FULL;
+    if (duty >= PCA9685_STEPS) {
+      on = PCA9685_FULL;
+      off = 0;
+    } else if (duty > 0) {
+      on = start % PCA9685_STEPS;
+      off = (start + duty) % PCA9685_STEPS;
+    }
+    if (on == this->on[channel] && off == this->off[channel]) return;
+    this->on[channel] = on;
+    this->off[channel] = off;
+    this->dirty[channel / PCA9685_CHANNELS] |= 1 << (channel % PCA9685_CHANNELS);
+  }
+
+  void flush() override {
+    if (this->wire == nullptr) return;
+    for (uint8_t chip = 0; chip < CHIPS; chip++) {
+      uint16_t dirty = this->dirty[chip];
+      while (dirty) {
+        int first = __builtin_ctz(dirty);
+        int last = first;
+        for (int c = first + 1; c < PCA9685_CHANNELS; c++) {
+          if (!(dirty & (1 << c))) continue;
+          if (c - last - 1 > PCA9685_MERGE_GAP) break;
+          last = c;
+        }
+        if (!sendRun(chip, first, last)) {
+          if (this->failures++ == 0) LOG_WARN("PCA9685 at 0x%02x stopped answering", this->address + chip);
+          break;  // the rest of this board waits for the next frame
+        }
+        dirty &= ~(uint16_t)(((1u << (last + 1)) - 1) & ~((1u << first) - 1));
+        this->dirty[chip] = dirty;
+      }
+    }
+  }
+
+  bool stopsInLightSleep() const override {
+    return false;
+  }
+
+  uint32_t getFailures() const {  // transactions that were not acknowledged
+    return this->failures;
+  }
+
+  uint32_t getBytes() const {  // sent since boot, register addresses included
+    return this->bytes;
+  }
+};
@@ -0,0 +1,310 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "Log.h"
+
+#if defined(ESP32) && !defined(HOST_BUILD)
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+#ifndef RENDER_MAX_IDLE_MS
+#define RENDER_MAX_IDLE_MS 1000  // longest the render task sleeps without a frame, so the stats still come round
+#endif
+
+enum CatchUpPolicy {
+  CATCH_UP_SKIP,   // after an overrun render one frame at the current time and drop the ticks that were missed
+  CATCH_UP_BURST,  // render the missed ticks back to back (up to max_burst), for anything that integrates over frames
+};
+
+
+#if defined(ESP32) && !defined(HOST_BUILD)
+
+class TickSource {
+
+  // A periodic esp_timer that wakes the task that called begin(), once per tick.
+  // Ticks that arrive while the task is busy are counted by the task notification, so none are lost.
+  // sleepUntil() swaps the periodic timer for a one shot, so nothing wakes the core until it is needed.
+
+private:
+  esp_timer_handle_t timer;
+  TaskHandle_t task;
+  uint32_t period_us;
+
+  static void onTimer(void* arg) {
+    xTaskNotifyGive(((TickSource*)arg)->task);
+  }
+
+public:
+  TickSource()
+    : timer(nullptr), task(nullptr), period_us(0) {}
+
+  void begin(uint32_t period_us) {
+    this->task = xTaskGetCurrentTaskHandle();
+    this->period_us = period_us;
+    esp_timer_create_args_t args = {};
+    args.callback = onTimer;
+    args.arg = this;
+    args.name = "render";
+    esp_timer_create(&args, &this->timer);
+    esp_timer_start_periodic(this->timer, period_us);
+  }
+
+  void wait() {  // blocks until the next tick, returns straight away if one is already pending
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+
+  bool sleepUntil(uint32_t wake_us) {  // blocks until wake_us or wake(), true if wake_us was reached
+    int32_t remaining = (int32_t)(wake_us - micros());
+    if (remaining > 0) {
+      esp_timer_stop(this->timer);
+      esp_timer_start_once(this->timer, remaining);
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);  // a tick left pending from before just wakes it early
+      esp_timer_stop(this->timer);
+      esp_timer_start_periodic(this->timer, this->period_us);  // ticks start again from now
+    }
+    return (int32_t)(micros() - wake_us) >= 0;
+  }
+
+  void wake() {  // from another task
+    xTaskNotifyGive(this->task);
+  }
+};
+
+#else
+
+class TickSource {
+
+  // Simulated timer for the host build: waiting moves the virtual clock forward to the next tick boundary.
+
+private:
+  uint32_t period_us;
+  uint32_t next_us;
+  bool woken;
+
+public:
+  TickSource()
+    : period_us(0), next_us(0), woken(false) {}
+
+  void begin(uint32_t period_us) {
+    this->period_us = period_us;
+    this->next_us = micros() + period_us;
+  }
+
+  void wait() {
+    int32_t remaining = (int32_t)(this->next_us - micros());
+    if (remaining > 0) {
+      delayMicroseconds(remaining);
+    }
+    while ((int32_t)(micros() - this->next_us) >= 0) {  // a real timer keeps firing on its own grid
+      this->next_us += this->period_us;
+    }
+  }
+
+  // loop() renders inline on the host, so a sleep only lasts a tick per call and loop() can still poll the
+  // scripted touches in between. The scheduler sleeps on at the next call until wake_us or wake(), as the
+  // firmware would, so nothing is rendered or picked up meanwhile.
+  bool sleepUntil(uint32_t wake_us) {
+    if (!this->woken) wait();
+    this->woken = false;
+    return (int32_t)(micros() - wake_us) >= 0;
+  }
+
+  void wake() {  // from loop(), so the next sleepUntil() returns at once
+    this->woken = true;
+  }
+};
+
+#endif
+
+
+class RenderScheduler {
+
+  // Runs rendering at a fixed rate from a hardware timer instead of as fast as loop() happens to spin.
+  // waitForFrame() blocks until the next tick and returns how many frames to render now, according to the
+  // catch-up policy. It also keeps jitter statistics on the actual time between frames.
+  // When the frame just rendered will not change for a while, idleFor() stops the ticks and the next
+  // waitForFrame() sleeps until then instead. Another task can cut the sleep short with wake(), after which
+  // waitForFrame() returns 0, wasWoken() is true and the caller decides whether there is anything to render.
+  // What it picks up may want a frame sooner than the sleep would end, which wakeWithin() sees to.
+
+private:
+  TickSource tickSource;
+  CatchUpPolicy policy;
+  uint32_t period_us;
+  uint32_t max_burst;
+  uint32_t next_tick_us;   // when the next frame is due
+  uint32_t last_frame_us;  // when the last frame started
+
+  // jitter accounting
+  uint32_t frames;
+  uint32_t missed_ticks;
+  uint32_t min_period_us;
+  uint32_t max_period_us;
+  uint32_t max_late_us;     // worst delay between a tick being due and its frame starting
+  uint64_t total_period_us;
+  uint64_t total_jitter_us;  // sum of |period - nominal period|
+  uint32_t max_frame_us;     // longest time from a frame starting to frameDone()
+  uint64_t total_frame_us;
+  uint32_t idles;            // sleeps through frames that would not have changed anything
+  uint64_t total_idle_us;
+  uint32_t total_frames;     // since begin(), not reset with the stats
+
+  // idling, the wake flag is how wake() and idleFor() on different cores avoid missing each other
+  std::atomic<bool> idling;
+  std::atomic<bool> wake_requested;
+  uint32_t idle_start_us;
+  uint32_t wake_us;
+  bool woken;  // the last waitForFrame() was cut short by wake()
+
+public:
+  RenderScheduler()
+    : policy(CATCH_UP_SKIP), period_us(5000), max_burst(4), next_tick_us(0), last_frame_us(0), total_frames(0),
+      idling(false), wake_requested(false), idle_start_us(0), wake_us(0), woken(false) {
+    resetStats();
+  }
+
+  void begin(uint32_t rate_hz, CatchUpPolicy policy = CATCH_UP_SKIP, uint32_t max_burst = 4) {
+    this->period_us = 1000000 / rate_hz;
+    this->policy = policy;
+    this->max_burst = max_burst;
+    this->tickSource.begin(this->period_us);
+    this->next_tick_us = micros() + this->period_us;
+    this->last_frame_us = micros();
+    this->total_frames = 0;
+    resetStats();
+  }
+
+  // Number of frames to render now, 0 while idling: after an idle was cut short by wake(), or a tick of one
+  // on the host. Anything that called wake() before this returns is picked up by the caller straight after,
+  // so the request is cleared here.
+  uint32_t waitForFrame() {
+    if (this->idling) {
+      bool due = this->tickSource.sleepUntil(this->wake_us);
+      this->woken = this->wake_requested.exchange(false);
+      if (!due) return 0;
+      endIdle();
+      this->total_frames++;
+      return 1;
+    }
+
+    uint32_t now;
+    int32_t late;
+    do {  // a notification left over from wake() is not a tick
+      this->tickSource.wait();
+      now = micros();
+      late = (int32_t)(now - this->next_tick_us);
+    } while (late < -(int32_t)(this->period_us / 2));
+
+    uint32_t due = 1;
+    if (late > 0) {
+      due += late / this->period_us;
+      if ((uint32_t)late > this->max_late_us) this->max_late_us = late;
+    }
+    this->next_tick_us += due * this->period_us;
+
+    uint32_t render = due;
+    if (this->policy == CATCH_UP_SKIP) {
+      render = 1;
+    } else if (render > this->max_burst) {
+      render = this->max_burst;
+    }
+    this->missed_ticks += due - render;
+
+    recordFrame(now);
+    this->total_frames += render;
+    this->wake_requested.store(false);
+    this->woken = false;
+    return render;
+  }
+
+  bool wasWoken() const {  // the last waitForFrame() returned 0 because of wake(), not a tick of the sleep
+    return this->woken;
+  }
+
+  // after frameDone(): the strips will not change for idle_ms, so sleep through the ticks until then
+  void idleFor(uint32_t idle_ms) {
+    if (idle_ms > RENDER_MAX_IDLE_MS) idle_ms = RENDER_MAX_IDLE_MS;
+    if (idle_ms * 1000 <= this->period_us) return;  // the next tick is soon enough
+    this->idle_start_us = micros();
+    this->wake_us = this->last_frame_us + idle_ms * 1000;
+    this->idling.store(true);
+    if (this->wake_requested.exchange(false)) endIdle();  // something arrived while the frame was rendering
+  }
+
+  // while idling: the next frame is wanted within idle_ms from now, the sleep ends then if not before
+  void wakeWithin(uint32_t idle_ms) {
+    if (!this->idling.load()) return;
+    if (idle_ms > RENDER_MAX_IDLE_MS) idle_ms = RENDER_MAX_IDLE_MS;
+    if (idle_ms * 1000 <= this->period_us) {
+      endIdle();
+      return;
+    }
+    uint32_t wake_us = micros() + idle_ms * 1000;
+    if ((int32_t)(wake_us - this->wake_us) < 0) this->wake_us = wake_us;
+  }
+
+  void endIdle() {  // back to a frame every tick, starting from now
+    if (!this->idling.load()) return;
+    this->idling.store(false);
+    uint32_t now = micros();
+    this->idles++;
+    this->total_idle_us += now - this->idle_start_us;
+    this->next_tick_us = now + this->period_us;
+    this->last_frame_us = now;
+  }
+
+  void wake() {  // from another task once there is something to render, such as a command
+    this->wake_requested.store(true);
+    if (this->idling.load()) this->tickSource.wake();
+  }
+
+  uint32_t getTotalFrames() const {
+    return this->total_frames;
+  }
+
+  void frameDone() {  // call once the frames returned by waitForFrame() have been rendered
+    uint32_t busy = micros() - this->last_frame_us;
+    if (busy > this->max_frame_us) this->max_frame_us = busy;
+    this->total_frame_us += busy;
+  }
+
+  uint32_t getPeriodUs() const {
+    return this->period_us;
+  }
+
+  void resetStats() {
+    this->frames = 0;
+    this->missed_ticks = 0;
+    this->min_period_us = 0xFFFFFFFF;
+    this->max_period_us = 0;
+    this->max_late_us = 0;
+    this->total_period_us = 0;
+    this->total_jitter_us = 0;
+    this->max_frame_us = 0;
+    this->total_frame_us = 0;
+    this->idles = 0;
+    this->total_idle_us = 0;
+  }
+
+  void printStats() {
+    LOG_INFO("frames %u, missed ticks %u, period us %u/%u/%u, jitter us %u, max late us %u, frame us %u/%u, idles %u for %u ms",
+             (unsigned)this->frames, (unsigned)this->missed_ticks, (unsigned)(this->frames ? this->min_period_us : 0),
+             (unsigned)(this->frames ? this->total_period_us / this->frames : 0), (unsigned)this->max_period_us,
+             (unsigned)(this->frames ? this->total_jitter_us / this->frames : 0), (unsigned)this->max_late_us,
+             (unsigned)(this->frames ? this->total_frame_us / this->frames : 0), (unsigned)this->max_frame_us,
+             (unsigned)this->idles, (unsigned)(this->total_idle_us / 1000));
+  }
+
+private:
+  void recordFrame(uint32_t now) {
+    uint32_t period = now - this->last_frame_us;
+    this->last_frame_us = now;
+    this->frames++;
+    if (period < this->min_period_us) this->min_period_us = period;
+    if (period > this->max_period_us) this->max_period_us = period;
+    this->total_period_us += period;
+    this->total_jitter_us += period > this->period_us ? period - this->period_us : this->period_us - period;
+  }
+};
@@ -0,0 +1,145 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include "Log.h"
+
+#if !defined(ESP32) || defined(HOST_BUILD)
+#include <chrono>
+#endif
+
+// Counters that stay on in the dress, so a field report can say whether it is dropping frames, leaking heap
+// over mode switches, or stalling on input: a histogram of loop() periods, the longest frame, what each
+// mode costs to render, how long input sampling takes, the heap, and how long mode switches take.
+// Recording is a few adds and compares; the sketch prints them all with report() when "stats" is typed
+// into the serial monitor, and the host simulator prints the same lines with --stats:
+//   STATS
+//   stats,name,value
+// The counters are written by the loop and render tasks and read by the log task without a lock, so a
+// report can be a frame out between counters. The 64 bit totals take two loads on the ESP32, so one caught
+// mid update can make a single mean in a report far out; the next report has it right again.
+
+#define STATS_MAX_MODES 40  // built in modes plus BYTECODE_MAX_PROGRAMS, higher modes share the last entry
+#define STATS_LOOP_BUCKETS 9
+
+// upper edges of the loop period histogram in us, the last bucket takes anything longer
+static const uint32_t STATS_LOOP_EDGES_US[STATS_LOOP_BUCKETS - 1] = { 1000, 2000, 5000, 10000, 20000, 50000, 100000, 500000 };
+
+struct CostCounter {
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t total_us;
+
+  void add(uint32_t us) {
+    this->count++;
+    this->total_us += us;
+    if (us > this->max_us) this->max_us = us;
+  }
+
+  uint32_t mean() const {
+    return this->count ? this->total_us / this->count : 0;
+  }
+};
+
+
+class RuntimeStats {
+
+  // Everything is since boot. Costs are timed with now(), which on the host is the machine's own clock,
+  // since the simulator's micros() only moves when it steps, which would make everything cost nothing.
+  // The loop period is the time loop() sees, so on the host it is simulated time like the rest of the run.
+
+private:
+  uint32_t loop_periods[STATS_LOOP_BUCKETS];
+  uint32_t max_loop_us;
+  uint32_t last_loop_us;
+  CostCounter frames;
+  CostCounter modes[STATS_MAX_MODES];
+  CostCounter input;
+  CostCounter switches;
+
+public:
+  template <typename Out>
+  static void line(Out& out, const char* name, uint32_t value) {  // one stats,name,value line
+    char text[64];
+    snprintf(text, sizeof(text), "stats,%s,%u", name, (unsigned)value);
+    out.println(text);
+  }
+
+  RuntimeStats()
+    : max_loop_us(0), last_loop_us(0), frames(), input(), switches() {
+    for (int i = 0; i < STATS_LOOP_BUCKETS; i++) this->loop_periods[i] = 0;
+    for (int i = 0; i < STATS_MAX_MODES; i++) this->modes[i] = CostCounter();
+  }
+
+  static uint32_t now() {  // us, for timing costs
+#if defined(ESP32) && !defined(HOST_BUILD)
+    return micros();
+#else
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  void loopStarted(uint32_t now_us) {  // micros() at the top of loop()
+    if (this->last_loop_us) {
+      uint32_t period = now_us - this->last_loop_us;
+      int bucket = 0;
+      while (bucket < STATS_LOOP_BUCKETS - 1 && period > STATS_LOOP_EDGES_US[bucket]) bucket++;
+      this->loop_periods[bucket]++;
+      if (period > this->max_loop_us) this->max_loop_us = period;
+    }
+    this->last_loop_us = now_us;
+  }
+
+  void recordFrame(int mode, uint32_t render_us, uint32_t frame_us) {  // the patterns' share, and the whole frame
+    if (mode < 0) mode = 0;
+    this->modes[mode < STATS_MAX_MODES ? mode : STATS_MAX_MODES - 1].add(render_us);
+    this->frames.add(frame_us);
+  }
+
+  void recordInput(uint32_t us) {  // one poll of the touch pads or button
+    this->input.add(us);
+  }
+
+  void recordModeSwitch(uint32_t us) {
+    this->switches.add(us);
+  }
+
+  template <typename Out>
+  void report(Out& out, int modes) {
+    out.println("STATS");
+    line(out, "uptime_ms", millis());
+    char name[32];
+    for (int i = 0; i < STATS_LOOP_BUCKETS; i++) {
+      if (i < STATS_LOOP_BUCKETS - 1) {
+        snprintf(name, sizeof(name), "loop_us_le_%u", (unsigned)STATS_LOOP_EDGES_US[i]);
+      } else {
+        snprintf(name, sizeof(name), "loop_us_over_%u", (unsigned)STATS_LOOP_EDGES_US[i - 1]);
+      }
+      line(out, name, this->loop_periods[i]);
+    }
+    line(out, "loop_us_max", this->max_loop_us);
+    line(out, "frames", this->frames.count);
+    line(out, "frame_us_mean", this->frames.mean());
+    line(out, "frame_us_max", this->frames.max_us);
+    if (modes > STATS_MAX_MODES) modes = STATS_MAX_MODES;
+    for (int i = 0; i < modes; i++) {
+      if (!this->modes[i].count) continue;
+      snprintf(name, sizeof(name), "mode_%d_frames", i);
+      line(out, name, this->modes[i].count);
+      snprintf(name, sizeof(name), "mode_%d_render_us_mean", i);
+      line(out, name, this->modes[i].mean());
+      snprintf(name, sizeof(name), "mode_%d_render_us_max", i);
+      line(out, name, this->modes[i].max_us);
+    }
+    line(out, "input_polls", this->input.count);
+    line(out, "input_us_mean", this->input.mean());
+    line(out, "input_us_max", this->input.max_us);
+    line(out, "heap_free", ESP.getFreeHeap());
+    line(out, "heap_min_free", ESP.getMinFreeHeap());
+    line(out, "mode_switches", this->switches.count);
+    line(out, "mode_switch_us_mean", this->switches.mean());
+    line(out, "mode_switch_us_max", this->switches.max_us);
+    line(out, "log_dropped", logger.getDropped());
+  }
+};
+
+static RuntimeStats runtimeStats;
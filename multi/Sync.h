@@ -0,0 +1,421 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include "esp_now.h"
+#include "CommandQueue.h"
+#include "Log.h"
+
+#if defined(ESP32) && !defined(HOST_BUILD)
+#include <WiFi.h>
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#endif
+
+// A time shared by every dress in range, so their patterns play in step, and mode and colour changes that
+// they all make at the same moment. One device leads and broadcasts a beacon with its time every
+// SYNC_BEACON_MS. The others fit a line through the last SYNC_SAMPLES beacons against their own clocks,
+// which gives both the offset and how fast their crystal drifts against the leader's, so between beacons
+// they keep the leader's time to well under a millisecond. A device that hears no leader for
+// SYNC_LEADER_TIMEOUT_MS starts leading, and of two leaders that hear each other the one with the higher
+// id gives way. A new leader carries on from the shared time it already had, so losing the leader does not
+// make anything jump. The messages go over a SyncTransport: ESP-NOW broadcasts on the dress, stand-ins on
+// the host.
+//
+//   beacon   SYNC_MAGIC, SYNC_BEACON, sender id (uint32), sequence (uint16), shared time in us (uint64)
+//   command  SYNC_MAGIC, SYNC_COMMAND, sender id, sequence, Command type, parameter, value (int32),
+//            the shared ms to apply it at (uint32)
+//
+// Everything is little endian. Commands are sent SYNC_COMMAND_REPEATS times, since broadcasts are not
+// acknowledged, and applied SYNC_COMMAND_LEAD_MS after they were made so every copy has time to arrive.
+
+#define SYNC_MAGIC 0x5D
+#define SYNC_PACKET_SIZE 20
+#define SYNC_BEACON_MS 100
+#define SYNC_LEADER_TIMEOUT_MS 500  // a follower that hears nothing from its leader for this long takes over
+#define SYNC_SAMPLES 16             // beacons the drift is fitted over
+#ifndef SYNC_LINK_US
+#define SYNC_LINK_US 400  // from a beacon being stamped to it being received, about what ESP-NOW takes
+#endif
+#define SYNC_OUTLIER_US 1000        // beacons this far off the fit were held up on the way, and are dropped
+#define SYNC_STEP_US 2000           // a correction bigger than this is a step of the shared time, not a slew
+#define SYNC_MAX_DRIFT_PPM 500      // crystals are within 50 ppm of each other, anything more is noise
+#define SYNC_COMMAND_LEAD_MS 100
+#define SYNC_COMMAND_REPEATS 3
+#define SYNC_NO_LEADER 0xFFFFFFFF
+
+enum SyncMessageType {
+  SYNC_BEACON = 1,
+  SYNC_COMMAND = 2,
+};
+
+struct SyncPacket {
+  uint8_t bytes[SYNC_PACKET_SIZE];
+  uint8_t length;
+  uint64_t rx_us;  // SyncClock::localUs() when it arrived
+
+  void put(int at, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) this->bytes[at + i] = value >> (8 * i);
+  }
+
+  uint64_t get(int at, int size) const {
+    uint64_t value = 0;
+    for (int i = size - 1; i >= 0; i--) value = value << 8 | this->bytes[at + i];
+    return value;
+  }
+};
+
+
+class SyncTransport {
+
+  // Broadcasts to every other device in range, without any promise that a packet arrives. receive() gives
+  // each packet that did with the local time it arrived at, stamped as close to the radio as the transport
+  // can, since that stamp is what the clocks are matched with.
+
+public:
+  virtual ~SyncTransport() {}
+  virtual bool begin() = 0;
+  virtual bool send(const uint8_t* bytes, int length) = 0;
+  virtual bool receive(SyncPacket& packet) = 0;  // false if nothing has arrived
+};
+
+
+struct SyncEstimate {
+  uint64_t ref_local_us;
+  int64_t offset_us;  // shared minus local time at ref_local_us
+  int32_t drift;      // how much faster the shared time runs than the local clock, in units of 2^-32
+  uint32_t epoch;     // changes whenever the shared time steps instead of slewing
+
+  uint64_t sharedUs(uint64_t local_us) const {
+    int64_t since = (int64_t)(local_us - this->ref_local_us);
+    return local_us + this->offset_us + ((since * this->drift) >> 32);
+  }
+};
+
+
+class SyncClock {
+
+  // update() runs the protocol and is called often, from loop(), with SyncClock::localUs(); broadcast() and
+  // nextCommand() are for the same task. latest() is for any other task (the render task): the estimate
+  // is double buffered, and latest() tries again in the rare case another was published while copying,
+  // since the next one after that is written into the slot it was copying from.
+
+private:
+  SyncTransport* transport;
+  uint32_t id;
+  bool leading;
+  uint32_t leader_id;
+  uint64_t last_heard_us;  // local time of the last beacon from the leader, or of begin()
+  uint64_t next_beacon_us;
+  uint16_t sequence;
+
+  int64_t sample_local[SYNC_SAMPLES];  // when each beacon arrived, and the leader's time minus that
+  int64_t sample_diff[SYNC_SAMPLES];
+  int samples;
+  int newest;
+  int outliers;  // in a row, enough of them and the leader's time has really moved
+
+  struct Outgoing {
+    Command command;
+    uint16_t sequence;
+    uint8_t repeats;  // copies still to send
+  };
+  Outgoing outgoing[4];
+
+  struct Seen {
+    uint32_t sender;
+    uint16_t sequence;
+  };
+  Seen seen[8];  // the last commands received, so the repeats are only applied once
+  int next_seen;
+  SpscQueue<Command, 8> commands;
+
+  SyncEstimate estimate;  // this task's copy
+  SyncEstimate slots[2];
+  std::atomic<uint32_t> published;
+
+  uint32_t beacons;
+  uint32_t dropped_beacons;
+  uint32_t elections;
+
+  void publish() {
+    uint32_t version = this->published.load(std::memory_order_relaxed) + 1;
+    this->slots[version & 1] = this->estimate;
+    this->published.store(version, std::memory_order_release);
+  }
+
+  void follow(uint32_t leader, uint64_t now_us) {
+    if (leader != this->leader_id) LOG_INFO("Following the clock of %08x", (unsigned)leader);
+    this->leading = false;
+    this->leader_id = leader;
+    this->last_heard_us = now_us;
+    this->samples = 0;
+    this->outliers = 0;
+  }
+
+  void addSample(uint64_t rx_us, uint64_t leader_us) {
+    int64_t diff = (int64_t)(leader_us - rx_us);
+    if (this->samples >= 4) {
+      int64_t residual = diff - (int64_t)(this->estimate.sharedUs(rx_us) - rx_us);
+      if (residual > SYNC_OUTLIER_US || residual < -SYNC_OUTLIER_US) {
+        this->dropped_beacons++;
+        if (++this->outliers < 4) return;
+        this->samples = 0;  // four in a row, it is the fit that is wrong
+      }
+    }
+    this->outliers = 0;
+    this->newest = (this->newest + 1) % SYNC_SAMPLES;
+    this->sample_local[this->newest] = (int64_t)rx_us;
+    this->sample_diff[this->newest] = diff;
+    if (this->samples < SYNC_SAMPLES) this->samples++;
+    fit(rx_us);
+  }
+
+  void fit(uint64_t now_us) {  // least squares line through the samples, relative to the newest
+    double mean_x = 0, mean_y = 0;
+    for (int i = 0; i < this->samples; i++) {
+      int s = (this->newest - i + SYNC_SAMPLES) % SYNC_SAMPLES;
+      mean_x += (double)(this->sample_local[s] - this->sample_local[this->newest]);
+      mean_y += (double)(this->sample_diff[s] - this->sample_diff[this->newest]);
+    }
+    mean_x /= this->samples;
+    mean_y /= this->samples;
+    double sxx = 0, sxy = 0;
+    for (int i = 0; i < this->samples; i++) {
+      int s = (this->newest - i + SYNC_SAMPLES) % SYNC_SAMPLES;
+      double x = (double)(this->sample_local[s] - this->sample_local[this->newest]) - mean_x;
+      double y = (double)(this->sample_diff[s] - this->sample_diff[this->newest]) - mean_y;
+      sxx += x * x;
+      sxy += x * y;
+    }
+    double slope = sxx > 0 ? sxy / sxx : 0;
+    double limit = SYNC_MAX_DRIFT_PPM / 1e6;
+    if (slope > limit) slope = limit;
+    if (slope < -limit) slope = -limit;
+
+    uint64_t before = this->estimate.sharedUs(now_us);
+    this->estimate.ref_local_us = this->sample_local[this->newest] + (int64_t)llround(mean_x);
+    this->estimate.offset_us = this->sample_diff[this->newest] + (int64_t)llround(mean_y);
+    this->estimate.drift = (int32_t)llround(slope * 4294967296.0);
+    int64_t moved = (int64_t)(this->estimate.sharedUs(now_us) - before);
+    if (moved > SYNC_STEP_US || moved < -SYNC_STEP_US) {
+      this->estimate.epoch++;
+      LOG_INFO("Shared time stepped by %d ms", (int)(moved / 1000));
+    }
+    publish();
+  }
+
+  void sendBeacon(uint64_t now_us) {
+    SyncPacket packet;
+    packet.bytes[0] = SYNC_MAGIC;
+    packet.bytes[1] = SYNC_BEACON;
+    packet.put(2, this->id, 4);
+    packet.put(6, this->sequence++, 2);
+    packet.put(8, this->estimate.sharedUs(localNow(now_us)), 8);
+    this->transport->send(packet.bytes, 16);
+  }
+
+  void sendCommand(const Outgoing& out) {
+    SyncPacket packet;
+    packet.bytes[0] = SYNC_MAGIC;
+    packet.bytes[1] = SYNC_COMMAND;
+    packet.put(2, this->id, 4);
+    packet.put(6, out.sequence, 2);
+    packet.bytes[8] = out.command.type;
+    packet.bytes[9] = out.command.parameter;
+    packet.put(10, (uint32_t)out.command.value, 4);
+    packet.put(14, out.command.at_ms, 4);
+    this->transport->send(packet.bytes, 18);
+  }
+
+  uint64_t localNow(uint64_t now_us) const {  // the time at the radio, for stamps: taken again if it can be
+#if defined(ESP32) && !defined(HOST_BUILD)
+    return localUs();
+#else
+    return now_us;
+#endif
+  }
+
+  void handle(const SyncPacket& packet, uint64_t now_us) {
+    if (packet.length < 8 || packet.bytes[0] != SYNC_MAGIC) return;
+    uint32_t sender = packet.get(2, 4);
+    uint16_t sequence = packet.get(6, 2);
+    if (sender == this->id) return;
+
+    if (packet.bytes[1] == SYNC_BEACON && packet.length >= 16) {
+      if (this->leading && sender > this->id) return;  // they will follow us once they hear our beacon
+      bool leader_lost = (int64_t)(now_us - this->last_heard_us) > SYNC_LEADER_TIMEOUT_MS * 1000LL;
+      if (this->leading || sender < this->leader_id || (sender != this->leader_id && leader_lost)) {
+        follow(sender, now_us);
+      }
+      if (sender != this->leader_id) return;
+      this->beacons++;
+      this->last_heard_us = now_us;
+      addSample(packet.rx_us, packet.get(8, 8) + SYNC_LINK_US);
+    } else if (packet.bytes[1] == SYNC_COMMAND && packet.length >= 18) {
+      for (const Seen& s : this->seen) {
+        if (s.sender == sender && s.sequence == sequence) return;  // a repeat
+      }
+      this->seen[this->next_seen] = { sender, sequence };
+      this->next_seen = (this->next_seen + 1) % 8;
+      Command command = { packet.bytes[8], (int32_t)packet.get(10, 4), packet.bytes[9], (uint32_t)packet.get(14, 4) };
+      if (!this->commands.push(command)) LOG_WARN("Dropped a shared command");
+    }
+  }
+
+public:
+  SyncClock()
+    : transport(nullptr), id(0), leading(false), leader_id(SYNC_NO_LEADER), last_heard_us(0), next_beacon_us(0),
+      sequence(0), samples(0), newest(0), outliers(0), next_seen(0), estimate(), published(0), beacons(0),
+      dropped_beacons(0), elections(0) {
+    for (Outgoing& out : this->outgoing) out.repeats = 0;
+    for (Seen& s : this->seen) s = { SYNC_NO_LEADER, 0 };
+    publish();
+  }
+
+  static uint64_t localUs() {  // this device's clock, which does not wrap
+#if defined(ESP32) && !defined(HOST_BUILD)
+    return esp_timer_get_time();
+#else
+    return hal::now();
+#endif
+  }
+
+  void begin(SyncTransport* transport, uint32_t id, uint64_t now_us) {  // shared time starts as local time
+    this->transport = transport;
+    this->id = id;
+    this->last_heard_us = now_us;
+    this->next_beacon_us = now_us;
+    this->sequence = (uint16_t)now_us;  // so a reboot does not repeat the sequences the others remember
+  }
+
+  void update(uint64_t now_us) {
+    SyncPacket packet;
+    while (this->transport->receive(packet)) {
+      handle(packet, now_us);
+    }
+
+    if (!this->leading && (int64_t)(now_us - this->last_heard_us) > SYNC_LEADER_TIMEOUT_MS * 1000LL) {
+      this->leading = true;  // carries on from the shared time as it stands, drift and all
+      this->leader_id = this->id;
+      this->elections++;
+      this->next_beacon_us = now_us;
+      LOG_INFO("Leading the shared clock");
+    }
+    if (this->leading && (int64_t)(now_us - this->next_beacon_us) >= 0) {
+      sendBeacon(now_us);
+      this->next_beacon_us += SYNC_BEACON_MS * 1000;
+      if ((int64_t)(now_us - this->next_beacon_us) >= 0) this->next_beacon_us = now_us + SYNC_BEACON_MS * 1000;
+    }
+
+    for (Outgoing& out : this->outgoing) {
+      if (out.repeats == 0) continue;
+      sendCommand(out);
+      out.repeats--;
+    }
+  }
+
+  // sends command to every other device and returns the shared ms everyone applies it at, to put in its at_ms
+  uint32_t broadcast(Command command, uint64_t now_us) {
+    uint32_t at_ms = (uint32_t)(this->estimate.sharedUs(now_us) / 1000) + SYNC_COMMAND_LEAD_MS;
+    if (at_ms == 0) at_ms = 1;  // 0 is at once
+    command.at_ms = at_ms;
+    Outgoing* slot = &this->outgoing[0];
+    for (Outgoing& out : this->outgoing) {
+      if (out.repeats < slot->repeats) slot = &out;  // a free one, or the one closest to done
+    }
+    *slot = { command, this->sequence++, SYNC_COMMAND_REPEATS };
+    sendCommand(*slot);
+    slot->repeats--;
+    return at_ms;
+  }
+
+  bool nextCommand(Command& command) {  // from another device, with at_ms set
+    return this->commands.pop(command);
+  }
+
+  void latest(SyncEstimate& estimate) const {
+    for (;;) {
+      uint32_t version = this->published.load(std::memory_order_acquire);
+      estimate = this->slots[version & 1];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (this->published.load(std::memory_order_relaxed) == version) return;
+    }
+  }
+
+  uint64_t sharedUs(uint64_t now_us) const {  // for the task that calls update()
+    return this->estimate.sharedUs(now_us);
+  }
+
+  bool isLeading() const {
+    return this->leading;
+  }
+
+  uint32_t getLeader() const {
+    return this->leader_id;
+  }
+
+  uint32_t getBeacons() const {
+    return this->beacons;
+  }
+
+  uint32_t getDroppedBeacons() const {
+    return this->dropped_beacons;
+  }
+
+  uint32_t getElections() const {
+    return this->elections;
+  }
+};
+
+
+class EspNowTransport : public SyncTransport {
+
+  // Broadcasts on ESP-NOW, which needs the WiFi radio on but never joins a network. Packets are received
+  // on the WiFi task, stamped there and queued for update() on loop()'s.
+
+private:
+  SpscQueue<SyncPacket, 8> inbox;
+
+  static EspNowTransport*& instance() {  // the receive callback has no argument to find us by
+    static EspNowTransport* transport = nullptr;
+    return transport;
+  }
+
+  static void received(const uint8_t* mac, const uint8_t* data, int length) {
+    SyncPacket packet;
+    packet.rx_us = SyncClock::localUs();
+    if (length > SYNC_PACKET_SIZE || instance() == nullptr) return;
+    memcpy(packet.bytes, data, length);
+    packet.length = length;
+    instance()->inbox.push(packet);
+  }
+
+public:
+  bool begin() override {
+#if defined(ESP32) && !defined(HOST_BUILD)
+    WiFi.mode(WIFI_STA);           // after PowerManager::begin, which turned it off
+    esp_wifi_set_ps(WIFI_PS_NONE);  // a sleeping modem misses beacons
+#endif
+    if (esp_now_init() != ESP_OK) {
+      LOG_ERROR("Could not start ESP-NOW for the shared clock");
+      return false;
+    }
+    instance() = this;
+    esp_now_register_recv_cb(received);
+    esp_now_peer_info_t peer;
+    memset(&peer, 0, sizeof(peer));
+    memset(peer.peer_addr, 0xFF, ESP_NOW_ETH_ALEN);  // broadcast
+    peer.ifidx = WIFI_IF_STA;
+    return esp_now_add_peer(&peer) == ESP_OK;
+  }
+
+  bool send(const uint8_t* bytes, int length) override {
+    static const uint8_t broadcast[ESP_NOW_ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    return esp_now_send(broadcast, bytes, length) == ESP_OK;
+  }
+
+  bool receive(SyncPacket& packet) override {
+    return this->inbox.pop(packet);
+  }
+};
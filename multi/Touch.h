@@ -0,0 +1,170 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "CommandQueue.h"
+
+#define TOUCH_DEBOUNCE_MS 30       // a touch has to last this long to count as a press
+#define TOUCH_RELEASE_MS 60        // no touch interrupt for this long means the pad was let go
+#define TOUCH_LONG_PRESS_MS 800    // holding a pad this long also sends a long press
+#define TOUCH_BASELINE_MS 1000     // how often an idle pad's untouched reading is resampled
+#define TOUCH_BASELINE_SAMPLES 8   // readings averaged for the first baseline
+
+enum TouchGesture {
+  TOUCH_PRESS,       // sent once a touch has lasted TOUCH_DEBOUNCE_MS
+  TOUCH_LONG_PRESS,  // sent once a touch has lasted TOUCH_LONG_PRESS_MS, after the press
+  TOUCH_RELEASE,     // sent when a press ends
+};
+
+struct TouchEvent {
+  uint8_t pin;
+  uint8_t gesture;
+};
+
+
+class TouchPad {
+
+  // One capacitive touch pad, sensed by the touch peripheral's threshold interrupt instead of touchRead.
+  // The interrupt fires repeatedly while the reading is under the threshold; the ISR only records when,
+  // and update() turns that into debounced press / long press / release gestures.
+  // The threshold follows the pad's untouched reading (its baseline), which drifts with wire length,
+  // humidity and what the dress is touching, so no hand tuned threshold per pad is needed.
+
+private:
+  uint8_t pin;
+  uint8_t threshold_percent;  // a touch is a reading under this percentage of the baseline
+  uint32_t baseline_x16;      // untouched reading, in 1/16ths
+  uint16_t threshold;
+
+  std::atomic<uint32_t> touches;     // interrupts seen, written by the ISR
+  std::atomic<uint32_t> last_touch;  // millis() of the last interrupt, written by the ISR
+
+  enum State { IDLE, DEBOUNCE, PRESSED, HELD };
+  State state;
+  uint32_t press_start;
+  uint32_t last_baseline;
+
+  static void IRAM_ATTR onTouch(void* arg) {
+    TouchPad* pad = (TouchPad*)arg;
+    pad->last_touch.store(millis(), std::memory_order_relaxed);
+    pad->touches.fetch_add(1, std::memory_order_release);
+  }
+
+  void arm() {  // (re)attach the interrupt at the threshold for the current baseline
+    this->threshold = (this->baseline_x16 / 16) * this->threshold_percent / 100;
+    touchDetachInterrupt(this->pin);
+    touchAttachInterruptArg(this->pin, onTouch, this, this->threshold);
+  }
+
+  bool touching(uint32_t now) const {
+    return this->touches.load(std::memory_order_acquire) != 0
+           && (int32_t)(now - this->last_touch.load(std::memory_order_relaxed)) < TOUCH_RELEASE_MS;
+  }
+
+  void trackBaseline(uint32_t now) {  // only called while idle, so the reading is of an untouched pad
+    this->last_baseline = now;
+    uint32_t reading = touchRead(this->pin);
+    if (reading <= this->threshold) return;  // being touched just under the interrupt's radar, don't learn it
+    this->baseline_x16 += (int32_t)(reading * 16 - this->baseline_x16) / 8;  // slow moving average
+    uint16_t threshold = (this->baseline_x16 / 16) * this->threshold_percent / 100;
+    if (threshold != this->threshold) arm();
+  }
+
+public:
+  TouchPad()
+    : pin(0), threshold_percent(30), baseline_x16(0), threshold(0), touches(0), last_touch(0), state(IDLE),
+      press_start(0), last_baseline(0) {}
+
+  void begin(uint8_t pin, uint8_t threshold_percent) {
+    this->pin = pin;
+    this->threshold_percent = threshold_percent;
+    uint32_t total = 0;
+    for (int i = 0; i < TOUCH_BASELINE_SAMPLES; i++) {
+      total += touchRead(pin);
+    }
+    this->baseline_x16 = total * 16 / TOUCH_BASELINE_SAMPLES;
+    this->last_baseline = millis();
+    arm();
+  }
+
+  void update(uint32_t now, SpscQueue<TouchEvent, 16>& events) {
+    bool touched = touching(now);
+    TouchEvent event = { this->pin, TOUCH_PRESS };
+    switch (this->state) {
+      case IDLE:
+        if (touched) {
+          this->state = DEBOUNCE;
+          this->press_start = now;
+        } else if (now - this->last_baseline >= TOUCH_BASELINE_MS) {
+          trackBaseline(now);
+        }
+        break;
+      case DEBOUNCE:
+        if (!touched) {
+          this->state = IDLE;  // too short, a glitch
+        } else if (now - this->press_start >= TOUCH_DEBOUNCE_MS) {
+          this->state = PRESSED;
+          events.push(event);
+        }
+        break;
+      case PRESSED:
+        if (!touched) {
+          this->state = IDLE;
+          event.gesture = TOUCH_RELEASE;
+          events.push(event);
+        } else if (now - this->press_start >= TOUCH_LONG_PRESS_MS) {
+          this->state = HELD;
+          event.gesture = TOUCH_LONG_PRESS;
+          events.push(event);
+        }
+        break;
+      case HELD:
+        if (!touched) {
+          this->state = IDLE;
+          event.gesture = TOUCH_RELEASE;
+          events.push(event);
+        }
+        break;
+    }
+  }
+
+  uint16_t getBaseline() const {
+    return this->baseline_x16 / 16;
+  }
+
+  uint16_t getThreshold() const {
+    return this->threshold;
+  }
+};
+
+
+template <int N>
+class TouchInput {
+
+  // All the touch pads, and the queue their gestures are delivered through.
+  // update() runs on the input core; nothing here is ever touched by the render task.
+
+private:
+  TouchPad pads[N];
+  SpscQueue<TouchEvent, 16> events;
+
+public:
+  void begin(const uint8_t pins[N], uint8_t threshold_percent) {
+    for (int i = 0; i < N; i++) {
+      this->pads[i].begin(pins[i], threshold_percent);
+    }
+  }
+
+  void update(uint32_t now) {
+    for (int i = 0; i < N; i++) {
+      this->pads[i].update(now, this->events);
+    }
+  }
+
+  bool nextEvent(TouchEvent& event) {
+    return this->events.pop(event);
+  }
+
+  const TouchPad& pad(int i) const {
+    return this->pads[i];
+  }
+};
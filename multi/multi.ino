@@ -1,14 +1,53 @@
+#ifndef EXPANDER_CHIPS
+#define EXPANDER_CHIPS 0  // PCA9685 boards to drive the strips through instead of the ESP32's pins, 8 strips each
+#endif
+
+#if EXPANDER_CHIPS
+#define NUMBER_OF_STRIPS (EXPANDER_CHIPS * 8)
+#else
+#define NUMBER_OF_STRIPS 6  // defined before Patterns.h so every pattern is sized for exactly this many strips
+#endif
+
+#ifndef AUDIO_ENABLED
+#define AUDIO_ENABLED 0  // 1 with a microphone or line-in on GPIO 36, adds the audio modes, see Audio.h
+#endif
+
 // our code
 #include "LEDStrip.h"
 #include "Patterns.h"
+#include "BakedTables.h"
+#include "Transition.h"
+#include "Scheduler.h"
+#include "CommandQueue.h"
+#include "Log.h"
+#include "Power.h"
+#include "Console.h"
+#include "Stats.h"
+#include "Control.h"
+#ifndef BENCHMARK
+#define BENCHMARK 0  // 1 prints timings of every effect, mode and mode switch over serial at boot, see Bench.h
+#endif
+#if BENCHMARK
+#include "Bench.h"
+#endif
+#ifndef SYNC_ENABLED
+#define SYNC_ENABLED 0  // 1 to play in step with the other dresses in range over ESP-NOW, see Sync.h
+#endif
+#if SYNC_ENABLED
+#include "Sync.h"
+#endif
+#include "Touch.h"
+#if EXPANDER_CHIPS
+#include "Pca9685.h"
+#endif
 
 // touch settings
 #define TOUCH_PIN_MODE 4    // GPIO 4 is a touch pin, will toggle active pattern
 #define TOUCH_PIN_COLOR 15  // GPIO 15 is a touch pin, will toggle colour
-#define TOUCH_THRESHOLD_SHORT 20  // values less than this are touches, the normal untouched value is ~70
-#define TOUCH_THRESHOLD_LONG 15 // the longer wire is baselined lower values
-#define TOUCH_DELAY_MS 350  // wait this long between touch detections, to avoid multiple detections for same press
-unsigned long last_touch_time = 0;
+#define TOUCH_THRESHOLD_PERCENT 30  // readings under this percentage of a pad's untouched baseline are touches,
+                                    // (~20 for the short wire's ~70 baseline, the longer wire baselines lower)
+const uint8_t touchPins[2] = { TOUCH_PIN_MODE, TOUCH_PIN_COLOR };
+TouchInput<2> touchInput;  // interrupt driven, with per pad debounce and adaptive thresholds
 
 // LED strip settings
 #define STRIP_0_WHITE 13
@@ -29,7 +68,14 @@ unsigned long last_touch_time = 0;
 #define STRIP_5_WHITE 22
 #define STRIP_5_COLOUR 23
 
-#define NUMBER_OF_STRIPS 6
+#if EXPANDER_CHIPS
+// with the strips on expanders these pins are free, and the boards chain off the ESP32's default I2C pins.
+// The baked wave modes only have tables for the first 6 strips, the others stay off in those modes.
+#define EXPANDER_SDA 21
+#define EXPANDER_SCL 22
+Pca9685Output<EXPANDER_CHIPS> expander;
+LEDStrip ledStripArray[NUMBER_OF_STRIPS];  // attached to the expander's outputs in setup()
+#else
 LEDStrip ledStripArray[NUMBER_OF_STRIPS] = {
   LEDStrip(STRIP_0_WHITE, STRIP_0_COLOUR),
   LEDStrip(STRIP_1_WHITE, STRIP_1_COLOUR),
@@ -38,113 +84,578 @@ LEDStrip ledStripArray[NUMBER_OF_STRIPS] = {
   LEDStrip(STRIP_4_WHITE, STRIP_4_COLOUR),
   LEDStrip(STRIP_5_WHITE, STRIP_5_COLOUR),
 };
+#endif
+
+#define RENDER_RATE_HZ 200        // patterns are updated at this fixed rate from a hardware timer
+#define STATS_INTERVAL_MS 10000  // how often the frame timing statistics are printed
+#define RENDER_CORE 0            // loop() and the input handling run on core 1, rendering gets core 0 to itself
+#define RENDER_PRIORITY 5        // above loop(), so input work never delays a frame
+#define RENDER_STACK_SIZE 4096
+#define TRANSITION_MS 400       // mode and colour changes crossfade over this long
+#define CURRENT_PEAK_MA (50 * NUMBER_OF_STRIPS)       // the strips together never draw more than this, see Limiter.h
+#define CURRENT_SUSTAINED_MA (40 * NUMBER_OF_STRIPS)  // nor more than this on average, once the burst is used up
+#define CURRENT_BURST_MAS (100 * NUMBER_OF_STRIPS)    // mA s over the sustained budget before it applies
+#define INPUT_POLL_MS 10         // how often loop() checks the touch pads
+#define DEFERRED_COMMANDS 4      // commands the render task can hold until the moment they are for
+#define DEFER_MAX_MS 1000        // ones for further off than this come from a clock not in step yet, and apply at once
+RenderScheduler renderScheduler;  // sleeps instead of rendering while the pattern is not changing
+PowerManager power;
+unsigned long last_stats_time = 0;
 
-Pattern* activePattern;
+// Input and rendering only share the command queue: loop() pushes mode and colour changes,
+// and the render task applies them between frames. The render task owns the crossfade and the patterns.
+SpscQueue<Command, 16> commandQueue;
 
-#define TOTAL_MODES 6
+// every pattern is preallocated here, mode changes reconfigure one in place. There are two pools so the
+// incoming pattern of a crossfade never reconfigures the outgoing one, whichever modes they are.
+PatternPool patternPools[2];
+Crossfade<NUMBER_OF_STRIPS> crossfade;
+ProgramStore programStore;  // more modes, run from the patterns partition without reflashing the sketch
+SerialConsole console;  // "trace" dumps the last pin writes (Trace.h), "stats" prints the counters (Stats.h)
+ControlParser control;  // binary frames from host/ledctl on the same port, see Control.h
+SpscQueue<ControlFrame, 4> controlReplies;  // from loop() to the log task, the only task that prints
+bool replies_waiting = false;  // loop() side, until the log task has been asked to send them
+#if BENCHMARK
+Benchmark benchmark;
+#endif
+#if SYNC_ENABLED
+EspNowTransport syncTransport;
+SyncClock syncClock;  // run by loop(), read by the render task for the time to render at
+#endif
+Command deferred[DEFERRED_COMMANDS];  // render task side, shared changes waiting for their moment
+int deferred_count = 0;
+#if AUDIO_ENABLED
+AudioAnalyser audioAnalyser;  // fed by the audio task on core 1, read by the audio modes
+AudioInput audioInput(audioAnalyser);
+#endif
+
+// the Arduino IDE generates these prototypes, they are written out so the sketch also builds as plain C++ on the host
+Pattern* selectActivePattern(int mode, bool is_white, LEDStrip ledStripArray[], int num_strips, PatternPool& patternPool);
+void switchPattern(uint32_t time_ms);
+void reportModeSwitch(unsigned long switch_start);
+void handleTouch(const TouchEvent& event);
+void renderTask(void* arg);
+void renderFrame();
+unsigned long renderTimeMs();
+bool applyCommands(uint32_t time_ms);
+void applyCommand(const Command& command, uint32_t time_ms);
+uint32_t msUntilDeferred(uint32_t time_ms);
+void sendCommand(const Command& command);
+void sendShared(Command command);
+void setParameter(uint8_t parameter, int32_t value);
+void attachExpanderStrips();
+void handleConsole(const char* line);
+void dumpTrace();
+void dumpStats();
+void handleControl(const ControlFrame& frame);
+void replyControl(const ControlFrame& request, uint8_t status);
+void sendControlReplies();
+void buildSparklingWave(Graph& graph);
+void buildBreathingSequence(Graph& graph);
+
+#if AUDIO_ENABLED
+#define TOTAL_MODES 11  // built in, the programs in the patterns partition come after these
+#else
+#define TOTAL_MODES 9
+#endif
 int mode = 0;
 bool is_white = true;  // should be true for white, false for colour
 
+// what the render task is showing, only touched by the render task
+int render_mode = 0;
+bool render_is_white = true;
+unsigned long last_render_ms = 0;
+uint32_t render_epoch = 0;  // of the shared time, a change means it stepped and the pattern restarts
+bool clock_stepped = false;
+
 void setup() {
   // put your setup code here, to run once:
   Serial.begin(115200);  // for debug prints
+  logger.begin();  // log messages are printed from a low priority task, never from the render path
 
   pinMode(TOUCH_PIN_MODE, INPUT);
   pinMode(TOUCH_PIN_COLOR, INPUT);
+  touchInput.begin(touchPins, TOUCH_THRESHOLD_PERCENT);
 
-  // TODO: disable wifi and bluetooth, reduces power draw
+  power.begin();  // radios off, and the CPU slows down and light sleeps while nothing needs it
+  currentLimiter.begin(CURRENT_PEAK_MA, CURRENT_SUSTAINED_MA, CURRENT_BURST_MAS);
+#if SYNC_ENABLED
+  if (syncTransport.begin()) {  // the WiFi radio back on, just for ESP-NOW
+    syncClock.begin(&syncTransport, (uint32_t)(ESP.getEfuseMac() >> 16), SyncClock::localUs());  // the unique end of the MAC
+  }
+#endif
+#if EXPANDER_CHIPS
+  attachExpanderStrips();
+#endif
   mode = 0;
   is_white = true;
-  activePattern = selectActivePattern(mode, is_white, ledStripArray, NUMBER_OF_STRIPS);
+  programStore.begin();
+#if AUDIO_ENABLED
+  audioInput.begin();
+#endif
+#if BENCHMARK
+  runBenchmarks(benchmark, BENCH_RUNS, ledStripArray, NUMBER_OF_STRIPS, patternPools[0], selectActivePattern,
+                TOTAL_MODES + programStore.getCount());
+#endif
+  crossfade.begin(ledStripArray, NUMBER_OF_STRIPS, TRANSITION_MS);
+  switchPattern(renderTimeMs());  // fades in from off
+
+#ifdef HOST_BUILD
+  renderScheduler.begin(RENDER_RATE_HZ, CATCH_UP_SKIP);  // there is no second core on the host, loop() renders inline
+#else
+  xTaskCreatePinnedToCore(renderTask, "render", RENDER_STACK_SIZE, nullptr, RENDER_PRIORITY, nullptr, RENDER_CORE);
+#endif
 }
 
 
 void loop() {
-  unsigned long time_ms = millis();  // get current time
-  if (gotTouch(TOUCH_PIN_MODE, TOUCH_THRESHOLD_SHORT)) {    // check if we got a touch, if we did, change mode
-    mode++;
-    mode %= TOTAL_MODES;
-    delete activePattern;  // delete data that will have its reference overwritten, prevent memory leak
-    activePattern = selectActivePattern(mode, is_white, ledStripArray, NUMBER_OF_STRIPS);
+  // input only, rendering happens in renderTask on the other core
+  runtimeStats.loopStarted(micros());
+  uint32_t input_start = RuntimeStats::now();
+  touchInput.update(millis());
+  runtimeStats.recordInput(RuntimeStats::now() - input_start);
+  TouchEvent event;
+  while (touchInput.nextEvent(event)) {
+    handleTouch(event);
   }
 
-  if (gotTouch(TOUCH_PIN_COLOR, TOUCH_THRESHOLD_LONG)) {  // check if we got a touch, if we did, change mode
-    is_white = !is_white;
-    delete activePattern;  // delete data that will have its reference overwritten, prevent memory leak
-    activePattern = selectActivePattern(mode, is_white, ledStripArray, NUMBER_OF_STRIPS);
+  while (Serial.available() > 0) {  // control frames and commands typed into the serial monitor share the port
+    uint8_t c = Serial.read();
+    if (control.feed(c, millis())) {
+      handleControl(control.frame());
+    } else if (!control.tookLast()) {
+      const char* line = console.feed(c);
+      if (line) handleConsole(line);
+    }
+  }
+  if (replies_waiting && logger.post(sendControlReplies)) replies_waiting = false;  // or try again next poll
+
+#if SYNC_ENABLED
+  syncClock.update(SyncClock::localUs());
+  Command shared;
+  while (syncClock.nextCommand(shared)) {  // a pad pressed on another dress
+    if (shared.type == CMD_SET_MODE) {
+      if (shared.value < 0 || shared.value >= TOTAL_MODES + programStore.getCount()) {
+        LOG_WARN("No mode %d here to change to with the others", (int)shared.value);
+        continue;
+      }
+      mode = shared.value;
+    } else if (shared.type == CMD_SET_COLOUR) {
+      is_white = shared.value;
+    }
+    sendCommand(shared);
+  }
+#endif
+
+#ifdef HOST_BUILD
+  renderFrame();  // waits for the next simulated tick, which is what paces the host loop
+  logger.drain();  // and there is no log task either
+#else
+  delay(INPUT_POLL_MS);  // gives core 1 back to the idle task between polls
+#endif
+}
+
+
+#if EXPANDER_CHIPS
+void attachExpanderStrips() {
+  Wire.begin(EXPANDER_SDA, EXPANDER_SCL, PCA9685_I2C_HZ);
+  expander.begin(Wire);
+  for (int i = 0; i < NUMBER_OF_STRIPS; i++) {
+    ledStripArray[i] = LEDStrip(expander, 2 * i, 2 * i + 1);  // white and colour on neighbouring outputs
+  }
+}
+#endif
+
+
+void handleConsole(const char* line) {
+  if (!strcmp(line, "trace")) {
+    if (!logger.post(dumpTrace)) LOG_WARN("Still printing the last report");
+  } else if (!strcmp(line, "stats")) {
+    if (!logger.post(dumpStats)) LOG_WARN("Still printing the last report");
+  } else {
+    LOG_WARN("Unknown command: %s", line);
+  }
+}
+
+
+void dumpTrace() {  // run by the log task, so the binary goes out in one piece after the messages before it
+  Serial.println("TRACE");
+  uint32_t count = traceRecorder.dump(Serial);
+  Serial.println();
+  LOG_INFO("Dumped %u pin writes", count);
+}
+
+
+void handleControl(const ControlFrame& frame) {  // queues the change for the render task and answers at once
+  switch (frame.type) {
+    case CONTROL_SET_MODE:
+      {
+        if (frame.length != 1) return replyControl(frame, CONTROL_BAD_LENGTH);
+        if (frame.payload[0] >= TOTAL_MODES + programStore.getCount()) return replyControl(frame, CONTROL_BAD_VALUE);
+        mode = frame.payload[0];
+        Command command = { CMD_SET_MODE, mode };
+        sendShared(command);
+        return replyControl(frame, CONTROL_OK);
+      }
+    case CONTROL_SET_COLOUR:
+      {
+        if (frame.length != 1) return replyControl(frame, CONTROL_BAD_LENGTH);
+        is_white = frame.payload[0] != 0;
+        Command command = { CMD_SET_COLOUR, is_white };
+        sendShared(command);
+        return replyControl(frame, CONTROL_OK);
+      }
+    case CONTROL_SET_PARAM:
+      {
+        if (frame.length < 5) return replyControl(frame, CONTROL_BAD_LENGTH);
+        int parameter = findControlParameter(frame.payload + 4, frame.length - 4);
+        if (parameter < 0) return replyControl(frame, CONTROL_UNKNOWN_PARAM);
+        Command command = { CMD_SET_PARAM, frame.value(0), (uint8_t)parameter };
+        sendShared(command);
+        return replyControl(frame, CONTROL_OK);
+      }
+    case CONTROL_QUERY:
+      return replyControl(frame, CONTROL_OK);
+    default:
+      return replyControl(frame, CONTROL_UNKNOWN_TYPE);
+  }
+}
+
+
+void replyControl(const ControlFrame& request, uint8_t status) {
+  ControlFrame reply;
+  reply.type = request.type | CONTROL_REPLY;
+  reply.length = 1;
+  reply.payload[0] = status;
+  if (request.type == CONTROL_QUERY) {
+    reply.payload[1] = mode;
+    reply.payload[2] = is_white;
+    reply.payload[3] = TOTAL_MODES + programStore.getCount();
+    reply.setValue(4, ESP.getFreeHeap());
+    reply.length = 8;
+  }
+  if (!controlReplies.push(reply)) LOG_WARN("Control replies are not being sent");
+  replies_waiting = true;
+}
+
+
+void sendControlReplies() {  // run by the log task, so a reply never lands in the middle of a message
+  ControlFrame reply;
+  uint8_t bytes[CONTROL_FRAME_SIZE];
+  while (controlReplies.pop(reply)) {
+    Serial.write(bytes, reply.encode(bytes));
+  }
+}
+
+
+void dumpStats() {  // run by the log task too, the report is longer than a message
+  runtimeStats.report(Serial, TOTAL_MODES + programStore.getCount());
+  currentLimiter.report(Serial);
+#if SYNC_ENABLED
+  RuntimeStats::line(Serial, "sync_leading", syncClock.isLeading());
+  RuntimeStats::line(Serial, "sync_beacons", syncClock.getBeacons());
+  RuntimeStats::line(Serial, "sync_dropped_beacons", syncClock.getDroppedBeacons());
+  RuntimeStats::line(Serial, "sync_elections", syncClock.getElections());
+#endif
+#if AUDIO_ENABLED
+  audioAnalyser.report(Serial);
+#endif
+}
+
+
+void renderTask(void* arg) {
+  renderScheduler.begin(RENDER_RATE_HZ, CATCH_UP_SKIP);  // the tick source wakes whichever task calls begin()
+  for (;;) {
+    renderFrame();
+  }
+}
+
+
+void renderFrame() {
+  // wait for the render timer, pick up any mode or colour change at the frame boundary, then render
+  uint32_t frames = renderScheduler.waitForFrame();
+  if (frames == 0 && !renderScheduler.wasWoken()) return;  // still idling
+  unsigned long time_ms = renderTimeMs();  // get current time
+  if (applyCommands(time_ms)) {
+    renderScheduler.endIdle();
+    if (frames == 0) frames = 1;
+  }
+  if (clock_stepped) {  // patterns play from the absolute time, so start the one playing again from the new one
+    clock_stepped = false;
+    switchPattern(time_ms);
+    renderScheduler.endIdle();
+    if (frames == 0) frames = 1;
+  }
+  if (frames == 0) {  // woken from an idle with nothing to do now, but a shared change may be due before it ends
+    renderScheduler.wakeWithin(msUntilDeferred(time_ms));
+    return;
   }
 
-  int val = touchRead(TOUCH_PIN_COLOR);
-  Serial.println(val);
+  uint32_t frame_start = RuntimeStats::now();
+  unsigned long frame_ms = renderScheduler.getPeriodUs() / 1000;
+#if AUDIO_ENABLED && defined(HOST_BUILD)
+  audioInput.poll();  // no audio task on the host either, so the frame picks up the blocks that have arrived
+#endif
+  for (uint32_t i = frames; i > 0; i--) {
+    crossfade.update(time_ms - (i - 1) * frame_ms);  // catching up replays missed ticks at their own times
+  }
+  uint32_t render_us = RuntimeStats::now() - frame_start;
+  renderScheduler.frameDone();
+  power.update(ledStripArray, NUMBER_OF_STRIPS);
+  uint32_t idle_ms = crossfade.nextChangeMs(time_ms);  // nothing to render until the output next changes
+  uint32_t due_ms = msUntilDeferred(time_ms);
+  renderScheduler.idleFor(due_ms < idle_ms ? due_ms : idle_ms);  // or a shared change is due
+  runtimeStats.recordFrame(render_mode, render_us, RuntimeStats::now() - frame_start);
+
+  if (time_ms - last_stats_time >= STATS_INTERVAL_MS) {
+    last_stats_time = time_ms;
+    renderScheduler.printStats();
+    renderScheduler.resetStats();
+  }
+}
+
+
+unsigned long renderTimeMs() {  // what patterns are rendered at, the shared time when the dresses are in step
+#if SYNC_ENABLED
+  SyncEstimate estimate;
+  syncClock.latest(estimate);
+  unsigned long time_ms = (unsigned long)(estimate.sharedUs(SyncClock::localUs()) / 1000);
+  if (estimate.epoch != render_epoch) {
+    render_epoch = estimate.epoch;
+    clock_stepped = true;
+  } else if ((int32_t)(time_ms - last_render_ms) < 0) {
+    time_ms = last_render_ms;  // slewing back a little, which patterns must never see as time going backwards
+  }
+  last_render_ms = time_ms;
+  return time_ms;
+#else
+  return millis();
+#endif
+}
+
+
+bool applyCommands(uint32_t time_ms) {  // true if any were applied
+  Command command;
+  bool applied = false;
+  while (commandQueue.pop(command)) {
+    int32_t wait_ms = (int32_t)(command.at_ms - time_ms);
+    if (command.at_ms && wait_ms > 0 && wait_ms <= DEFER_MAX_MS && deferred_count < DEFERRED_COMMANDS) {
+      deferred[deferred_count++] = command;
+      continue;
+    }
+    applyCommand(command, time_ms);
+    applied = true;
+  }
+  while (deferred_count > 0 && (int32_t)(deferred[0].at_ms - time_ms) <= 0) {  // kept in the order they came
+    applyCommand(deferred[0], time_ms);
+    applied = true;
+    deferred_count--;
+    for (int i = 0; i < deferred_count; i++) deferred[i] = deferred[i + 1];
+  }
+  return applied;
+}
+
+
+void applyCommand(const Command& command, uint32_t time_ms) {  // at the frame's time_ms
+  unsigned long switch_start = RuntimeStats::now();
+  switch (command.type) {
+    case CMD_SET_MODE:
+      render_mode = command.value;
+      switchPattern(time_ms);
+      break;
+    case CMD_SET_COLOUR:
+      render_is_white = command.value;
+      switchPattern(time_ms);  // crossfading to the other side is a flip across every H-bridge
+      break;
+    case CMD_SET_PARAM:
+      setParameter(command.parameter, command.value);
+      return;  // not a mode switch
+  }
+  reportModeSwitch(switch_start);
+}
+
+
+uint32_t msUntilDeferred(uint32_t time_ms) {  // or CHANGES_NEVER
+  if (deferred_count == 0) return CHANGES_NEVER;
+  int32_t wait_ms = (int32_t)(deferred[0].at_ms - time_ms);
+  return wait_ms > 0 ? wait_ms : 0;
+}
+
+
+void setParameter(uint8_t parameter, int32_t value) {  // on the live pattern, which carries on from this frame
+  Pattern* pattern = crossfade.current();
+  if (pattern && pattern->setParameter(parameter, value)) {
+    LOG_INFO("Set parameter %u to %d", parameter, (int)value);
+  } else {
+    LOG_WARN("Mode %d has no parameter %u, or not %d", render_mode, parameter, (int)value);
+  }
+}
+
+
+void sendCommand(const Command& command) {  // from loop(), to the render task
+  commandQueue.push(command);
+  renderScheduler.wake();
+}
+
 
-  activePattern->update(time_ms);  // continually update the active pattern
-  delay(1);                        // give processor some chill time, may remove
+void sendShared(Command command) {  // a change from this dress, made at the same moment by every dress in step with it
+#if SYNC_ENABLED
+  command.at_ms = syncClock.broadcast(command, SyncClock::localUs());
+#endif
+  sendCommand(command);
 }
 
 
-Pattern* selectActivePattern(int mode, bool is_white, LEDStrip ledStripArray[], int num_strips) {
+void switchPattern(uint32_t time_ms) {
+  // configure the pattern for the render mode in the bank the crossfade is not showing, then fade to it from
+  // time_ms, the time of the frame it first shows in. Reading the clock again here could land after that frame.
+  Pattern* pattern = selectActivePattern(render_mode, render_is_white, crossfade.nextBuffer(), NUMBER_OF_STRIPS,
+                                         patternPools[crossfade.nextBank()]);
+  if (!pattern) {  // a mode with no program behind it, keep showing what is there
+    LOG_WARN("No mode %d to switch to, staying on the current pattern", render_mode);
+    return;
+  }
+  crossfade.start(pattern, time_ms);
+}
+
+
+Pattern* selectActivePattern(int mode, bool is_white, LEDStrip ledStripArray[], int num_strips, PatternPool& patternPool) {
   Pattern* pattern;
-  Serial.println(mode);
   switch (mode) {
 
     case 0:  // off
       {
         uint8_t brightness = 0;
-        Serial.println("Selecting mode 0");
-        pattern = new SolidPattern(ledStripArray, num_strips, brightness, is_white);
+        LOG_INFO("Selecting mode 0");
+        patternPool.solid.configure(ledStripArray, num_strips, brightness, is_white);
+        pattern = &patternPool.solid;
         return pattern;
       }
     case 1:  // solid white or colour
       {
         uint8_t brightness = 255;
-        Serial.println("Selecting mode 1");
-        pattern = new SolidPattern(ledStripArray, num_strips, brightness, is_white);
+        LOG_INFO("Selecting mode 1");
+        patternPool.solid.configure(ledStripArray, num_strips, brightness, is_white);
+        pattern = &patternPool.solid;
         return pattern;
       }
     case 2:  // wave
       {
-        Serial.println("Selecting mode 2");
-        float frequency = 1.;  // Hz
-        pattern = new WavePattern(ledStripArray, num_strips, frequency, is_white);
+        LOG_INFO("Selecting mode 2");
+        patternPool.baked.configure(ledStripArray, num_strips, &BAKED_WAVE, is_white);  // 1 Hz
+        pattern = &patternPool.baked;
         return pattern;
       }
     case 3:  // slow wave
       {
-        Serial.println("Selecting mode 3");
-        float frequency = .25;  // Hz
-        pattern = new WavePattern(ledStripArray, num_strips, frequency, is_white);
+        LOG_INFO("Selecting mode 3");
+        patternPool.baked.configure(ledStripArray, num_strips, &BAKED_SLOW_WAVE, is_white);  // 0.25 Hz
+        pattern = &patternPool.baked;
         return pattern;
       }
     case 4:  // sequence
       {
-        Serial.println("Selecting mode 4");
+        LOG_INFO("Selecting mode 4");
         int period_ms = 6000;
         uint8_t brightness = 255;
-        pattern = new SequencePattern(ledStripArray, num_strips, period_ms, brightness, is_white);
+        patternPool.sequence.configure(ledStripArray, num_strips, period_ms, brightness, is_white);
+        pattern = &patternPool.sequence;
         return pattern;
       }
     case 5:  // chaos
       {
-        Serial.println("Selecting mode 5");
-        pattern = new ChaosPattern(ledStripArray, num_strips);
+        LOG_INFO("Selecting mode 5");
+        patternPool.chaos.configure(ledStripArray, num_strips);
+        pattern = &patternPool.chaos;
+        return pattern;
+      }
+    case 6:  // white and colour together
+      {
+        LOG_INFO("Selecting mode 6");
+        uint8_t white_share = 128;
+        uint8_t brightness = 255;
+        patternPool.mix.configure(ledStripArray, num_strips, white_share, brightness);
+        pattern = &patternPool.mix;
+        return pattern;
+      }
+    case 7:  // wave with a sparkle
+      {
+        LOG_INFO("Selecting mode 7");
+        patternPool.graph.configure(ledStripArray, num_strips, buildSparklingWave, is_white);
+        pattern = &patternPool.graph;
+        return pattern;
+      }
+    case 8:  // sequence that breathes
+      {
+        LOG_INFO("Selecting mode 8");
+        patternPool.graph.configure(ledStripArray, num_strips, buildBreathingSequence, is_white);
+        pattern = &patternPool.graph;
+        return pattern;
+      }
+#if AUDIO_ENABLED
+    case 9:   // the strips follow the sound, bass to treble
+    case 10:  // and swap white and colour on the beat
+      {
+        LOG_INFO("Selecting mode %d", mode);
+        patternPool.audio.configure(ledStripArray, num_strips, &audioAnalyser, mode == 10, is_white);
+        pattern = &patternPool.audio;
+        return pattern;
+      }
+#endif
+    default:  // a program from the patterns partition
+      {
+        int index = mode - TOTAL_MODES;
+        if (index >= programStore.getCount()) break;
+        LOG_INFO("Selecting mode %d, program %s", mode, programStore.name(index));
+        patternPool.bytecode.configure(ledStripArray, num_strips, programStore.program(index), is_white);
+        pattern = &patternPool.bytecode;
         return pattern;
       }
   }
+  return nullptr;  // mode is always kept below TOTAL_MODES plus the number of programs
+}
+
+void buildSparklingWave(Graph& graph) {
+  // the wave at three quarters, with the odd strip flaring to full where its noise peaks
+  uint8_t wave = graph.multiply(graph.oscillator(WAVE_SINE, 1000, 1.0f / 6), graph.constant(49152));
+  uint8_t noise = graph.noise(.02, 1);
+  uint8_t squared = graph.multiply(noise, noise);
+  uint8_t sparkle = graph.multiply(squared, squared);
+  graph.output(graph.max(wave, sparkle));
+}
+
+void buildBreathingSequence(Graph& graph) {
+  // the sequence of mode 4, its brightness swelling and fading together on every strip every 4 s
+  uint8_t step = graph.oscillator(WAVE_PULSE, 6000, 1.0f / 6, 1.0f / 6);
+  uint8_t breath = graph.crossfade(graph.constant(16384), graph.constant(65535), graph.oscillator(WAVE_SINE, 4000));
+  graph.output(graph.multiply(step, breath));
 }
 
-bool gotTouch(int pin, int threshold) {
-  // check if the touch mode sensor has been triggered
-  int val = touchRead(pin);
-  // Serial.print("------------ ");
-  // Serial.println(val);
-  unsigned long current_time = millis();
-  if (val < threshold && current_time - last_touch_time > TOUCH_DELAY_MS) {
-    last_touch_time = current_time;
+void handleTouch(const TouchEvent& event) {
+  // mode pad: press for the next mode, hold to turn the lights off. colour pad: press to swap white and colour
+  if (event.gesture == TOUCH_RELEASE) return;
+  LOG_DEBUG("Got touch for pin %d", event.pin);
 
-    Serial.print("Got touch for pin ");
-    Serial.println(pin);
-    return true;
-  } else {
-    return false;
+  if (event.pin == TOUCH_PIN_MODE) {
+    if (event.gesture == TOUCH_PRESS) {
+      mode++;
+      mode %= TOTAL_MODES + programStore.getCount();
+    } else {
+      mode = 0;  // off
+    }
+    Command command = { CMD_SET_MODE, mode };
+    sendShared(command);
+  } else if (event.pin == TOUCH_PIN_COLOR && event.gesture == TOUCH_PRESS) {
+    is_white = !is_white;
+    Command command = { CMD_SET_COLOUR, is_white };
+    sendShared(command);
   }
+}
+
+void reportModeSwitch(unsigned long switch_start) {
+  // how long the switch took, and the heap, which should not move now that patterns are preallocated
+  unsigned long switch_time = (uint32_t)(RuntimeStats::now() - switch_start);
+  runtimeStats.recordModeSwitch(switch_time);
+  LOG_INFO("Mode switch took %lu us, free heap %u, min free heap %u", switch_time, (unsigned)ESP.getFreeHeap(),
+           (unsigned)ESP.getMinFreeHeap());
 }
\ No newline at end of file
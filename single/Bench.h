@@ -0,0 +1,175 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include "Patterns.h"
+#include "Log.h"
+
+#if !defined(ESP32) || defined(HOST_BUILD)
+#include <chrono>
+#endif
+
+// Micro-benchmarks of the render path: the effects on their own, a full frame of every mode's Pattern::update
+// committed to the strips, and mode switches through selectActivePattern. On the ESP32 they are timed in CPU
+// cycles with ESP.getCycleCount, on the host in ns from the steady clock, less the cost of reading the clock.
+// Results are printed as lines of
+//   bench,name,unit,runs,min,median,p99,heap_delta
+// where heap_delta is the most free heap any one run lost, so a capture of the serial monitor or the host's
+// output can be kept and compared with the next version's (host/bench.cpp --baseline).
+
+#ifndef BENCH_RUNS
+#define BENCH_RUNS 1000  // runs of each benchmark, at most BENCH_MAX_RUNS
+#endif
+#define BENCH_MAX_RUNS 4096
+#define BENCH_MAX_RESULTS 64
+#define BENCH_NAME_SIZE 24
+
+struct BenchResult {
+  char name[BENCH_NAME_SIZE];
+  uint32_t runs;
+  uint32_t min;
+  uint32_t median;
+  uint32_t p99;
+  int32_t heap_delta;  // bytes of free heap the worst run lost, when the benchmark checks the heap
+};
+
+
+class Benchmark {
+
+  // Runs a body many times, timing each run on its own so the spread shows as well as the typical cost.
+  // The body gets the run's index, which the render benchmarks use as the time in ms, so each run does the
+  // work of a new frame rather than repeating the same one.
+
+private:
+  uint32_t samples[BENCH_MAX_RUNS];
+  BenchResult results[BENCH_MAX_RESULTS];
+  uint32_t count;
+  uint32_t overhead;  // ticks to read the clock twice
+
+public:
+  Benchmark()
+    : count(0), overhead(0) {}
+
+  static uint32_t ticks() {
+#if defined(ESP32) && !defined(HOST_BUILD)
+    return ESP.getCycleCount();
+#else
+    return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  static const char* unit() {
+#if defined(ESP32) && !defined(HOST_BUILD)
+    return "cycles";
+#else
+    return "ns";
+#endif
+  }
+
+  void calibrate() {  // the cheapest of many empty timings is what every sample carries on top of its body
+    uint32_t cheapest = 0xFFFFFFFF;
+    for (int i = 0; i < 1000; i++) {
+      uint32_t start = ticks();
+      uint32_t took = ticks() - start;
+      if (took < cheapest) cheapest = took;
+    }
+    this->overhead = cheapest;
+  }
+
+  template <typename Body>
+  const BenchResult& run(const char* name, uint32_t runs, bool check_heap, Body body) {
+    if (runs > BENCH_MAX_RUNS) runs = BENCH_MAX_RUNS;
+    if (runs == 0) runs = 1;
+    int32_t worst_heap = 0;
+    for (uint32_t i = 0; i < runs; i++) {
+      uint32_t heap_before = check_heap ? ESP.getFreeHeap() : 0;
+      uint32_t start = ticks();
+      body(i);
+      uint32_t took = ticks() - start;
+      this->samples[i] = took > this->overhead ? took - this->overhead : 0;
+      if (check_heap) {
+        int32_t lost = (int32_t)(heap_before - ESP.getFreeHeap());
+        if (lost > worst_heap) worst_heap = lost;
+      }
+    }
+    std::sort(this->samples, this->samples + runs);
+
+    BenchResult& result = this->results[this->count < BENCH_MAX_RESULTS ? this->count++ : BENCH_MAX_RESULTS - 1];
+    snprintf(result.name, sizeof(result.name), "%s", name);
+    result.runs = runs;
+    result.min = this->samples[0];
+    result.median = this->samples[runs / 2];
+    result.p99 = this->samples[(uint64_t)runs * 99 / 100];
+    result.heap_delta = worst_heap;
+    print(result);
+    return result;
+  }
+
+  static void printHeader() {
+    Serial.println("bench,name,unit,runs,min,median,p99,heap_delta");
+  }
+
+  static void print(const BenchResult& result) {  // straight to Serial, a whole run would overflow the log ring
+    char line[96];
+    snprintf(line, sizeof(line), "bench,%s,%s,%u,%u,%u,%u,%d", result.name, unit(), (unsigned)result.runs,
+             (unsigned)result.min, (unsigned)result.median, (unsigned)result.p99, (int)result.heap_delta);
+    Serial.println(line);
+  }
+
+  uint32_t getCount() const {
+    return this->count;
+  }
+
+  const BenchResult& getResult(uint32_t i) const {
+    return this->results[i];
+  }
+};
+
+
+typedef Pattern* (*PatternSelector)(int mode, bool is_white, LEDStrip ledStripArray[], int num_strips, PatternPool& patternPool);
+
+// The whole suite, for the sketches' BENCHMARK build and host/bench.cpp. The pattern benchmarks render onto
+// the sketch's own strips and commit to the pins, as a frame does; logging is turned off while it runs so
+// the timings are of the work, not of formatting messages nobody will read.
+inline void runBenchmarks(Benchmark& bench, uint32_t runs, LEDStrip strips[], int num_strips, PatternPool& pool,
+                          PatternSelector select, int modes) {
+  logger.setLevel(LOG_LEVEL_NONE);
+  bench.calibrate();
+  Benchmark::printHeader();
+
+  static LEDStrip shadow;  // effects only write the shadow state, so they need no pins
+  char name[BENCH_NAME_SIZE];
+  {
+    static FadeEffect fade;
+    fade.configure(&shadow, 1.0f, 0, true);
+    bench.run("fade_effect", runs, false, [&](uint32_t i) { fade.update(i); });
+  }
+  {
+    static BlinkEffect blink;
+    blink.configure(&shadow, 1000, 0.5f, 0, 255, true);
+    bench.run("blink_effect", runs, false, [&](uint32_t i) { blink.update(i); });
+  }
+  {
+    static ChaosEffect chaos;
+    chaos.configure(&shadow, 0.002f, 1);
+    bench.run("chaos_effect", runs, false, [&](uint32_t i) { chaos.update(i); });
+  }
+  {
+    static ChaosEffectSingleColor chaos;
+    chaos.configure(&shadow, 0.002f, 1, true);
+    bench.run("chaos_single_effect", runs, false, [&](uint32_t i) { chaos.update(i); });
+  }
+
+  for (int mode = 0; mode < modes; mode++) {
+    Pattern* pattern = select(mode, true, strips, num_strips, pool);
+    if (pattern == nullptr) continue;
+    snprintf(name, sizeof(name), "mode_%d_update", mode);
+    bench.run(name, runs, false, [&](uint32_t i) { pattern->update(i); });
+  }
+  for (int mode = 0; mode < modes; mode++) {
+    snprintf(name, sizeof(name), "mode_%d_switch", mode);
+    bench.run(name, runs, true, [&](uint32_t i) { select(mode, i & 1, strips, num_strips, pool); });
+  }
+
+  logger.setLevel(LOG_LEVEL);
+}
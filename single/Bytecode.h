@@ -0,0 +1,268 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "esp_partition.h"
+#include "Oscillator.h"
+#include "Noise.h"
+#include "Log.h"
+
+// Patterns as small per-strip programs for a register machine, so new modes can be shipped as data.
+// Programs are assembled on the host (host/pasm.cpp) into an image that is flashed to the "patterns" data
+// partition, and run in place from the memory mapped flash: nothing is copied to RAM but each strip's registers.
+//
+// Every frame each strip runs its program once from the top, with r0 the time in ms, r1 the strip's index,
+// r2 the number of strips and r3 1 for white or 0 for colour from the colour pad. The other registers keep
+// their values from frame to frame, so programs can hold state. Branches only jump forwards, so a strip runs
+// at most BYTECODE_MAX_LENGTH instructions a frame; a frame of every strip stays within
+// BYTECODE_FRAME_BUDGET_US on the ESP32, a small part of the render period.
+//
+// Image layout, little endian:
+//   ProgramImageHeader, then count ProgramEntry, then the instructions of every program.
+
+#define BYTECODE_MAGIC 0x5044454C  // "LEDP"
+#define BYTECODE_VERSION 1
+#define BYTECODE_REGISTERS 16
+#define BYTECODE_MAX_LENGTH 64        // instructions per program
+#define BYTECODE_MAX_PROGRAMS 32
+#define BYTECODE_NAME_SIZE 16
+#define BYTECODE_FRAME_BUDGET_US 100  // 6 strips of BYTECODE_MAX_LENGTH at 240 MHz, measure with the render stats
+#define BYTECODE_PARTITION_LABEL "patterns"
+#define BYTECODE_PARTITION_SUBTYPE ((esp_partition_subtype_t)0x40)
+
+enum Opcode {
+  OP_END,    //             stop for this frame
+  OP_LI,     // a imm       a = imm, sign extended from 16 bits
+  OP_LIH,    // a imm       high 16 bits of a = imm, after OP_LI for a 32 bit constant
+  OP_MOV,    // a b         a = b
+  OP_ADD,    // a b c       a = b + c
+  OP_SUB,    // a b c       a = b - c
+  OP_MUL,    // a b c       a = b * c, wrapping, which is how a time becomes a phase
+  OP_MULQ,   // a b c       a = b * c >> 16, for scaling by a 16.16 fraction
+  OP_DIV,    // a b c       a = b / c, 0 when c is 0, wrapping like the others
+  OP_MIN,    // a b c
+  OP_MAX,    // a b c
+  OP_AND,    // a b c
+  OP_OR,     // a b c
+  OP_XOR,    // a b c
+  OP_SHL,    // a b c       a = b << c
+  OP_SHR,    // a b c       a = b >> c, keeping the sign
+  OP_ADDI,   // a imm       a += imm
+  OP_SIN,    // a b         a = (1 + cos) / 2 of phase b, 0-65535
+  OP_TRI,    // a b         a = triangle of phase b, full at phase 0, 0-65535
+  OP_PULSE,  // a b c       a = 65535 for the first c of phase b's cycle, else 0
+  OP_NOISE,  // a b c       a = smooth noise at position b (16.16 lattice cells) with seed c, -32768 to 32767
+  OP_ENV,    // a b c       a = attack over the first c of phase b's cycle then decay over the rest, 0-65535
+  OP_JMP,    // c           skip c instructions
+  OP_JLT,    // a b c       skip c instructions if a < b
+  OP_JGE,    // a b c       skip c instructions if a >= b
+  OP_JEQ,    // a b c       skip c instructions if a == b
+  OP_JNE,    // a b c       skip c instructions if a != b
+  OP_LEVEL,  // a           the strip's level, clamped to 0-65535
+  OP_DIR,    // a           which side of the H-bridge: > 0 white, < 0 colour, 0 the colour pad's choice
+  OP_MIX,    // a           white and colour together, a is the white share clamped to 0-255
+  OP_COUNT,
+};
+
+struct Instruction {
+  uint8_t op;
+  uint8_t a;  // registers, or for OP_LI, OP_LIH and OP_ADDI b and c are the immediate, high byte first
+  uint8_t b;
+  uint8_t c;
+};
+
+struct ProgramImageHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+};
+
+struct ProgramEntry {
+  char name[BYTECODE_NAME_SIZE];  // nul terminated
+  uint16_t start;                 // first instruction, counted from the end of the entries
+  uint16_t length;                // instructions
+};
+
+
+class BytecodeProgram {
+
+  // One validated program, pointing into the image wherever that is mapped. Validation is done once when
+  // the image is opened, so run() can trust every register number and branch.
+
+private:
+  const Instruction* code;
+  uint16_t length;
+
+  static int32_t immediate(const Instruction& in) {
+    return (int16_t)(in.b << 8 | in.c);
+  }
+
+  static int32_t clamp(int32_t x, int32_t lo, int32_t hi) {
+    return x < lo ? lo : x > hi ? hi : x;
+  }
+
+public:
+  // what a run leaves for the strip
+  struct Output {
+    int32_t level;  // 0-65535
+    int8_t dir;     // > 0 white, < 0 colour, 0 the colour pad's choice
+    int16_t mix;    // white share 0-255, or -1 for one side only
+  };
+
+  BytecodeProgram()
+    : code(nullptr), length(0) {}
+
+  BytecodeProgram(const Instruction* code, uint16_t length)
+    : code(code), length(length) {}
+
+  static bool validate(const Instruction* code, uint16_t length) {
+    if (length == 0 || length > BYTECODE_MAX_LENGTH) return false;
+    for (uint16_t pc = 0; pc < length; pc++) {
+      const Instruction& in = code[pc];
+      if (in.op >= OP_COUNT || in.a >= BYTECODE_REGISTERS) return false;
+      bool immediate = in.op == OP_LI || in.op == OP_LIH || in.op == OP_ADDI;
+      bool branch = in.op >= OP_JMP && in.op <= OP_JNE;
+      if (branch && (in.c == 0 || pc + 1 + in.c > length)) return false;  // forwards, and at most to the end
+      if (!immediate && in.b >= BYTECODE_REGISTERS) return false;
+      if (!immediate && !branch && in.c >= BYTECODE_REGISTERS) return false;
+    }
+    return true;
+  }
+
+  bool valid() const {
+    return this->code != nullptr;
+  }
+
+  uint16_t getLength() const {
+    return this->length;
+  }
+
+  void run(int32_t r[BYTECODE_REGISTERS], Output& out) const {
+    const Instruction* code = this->code;
+    uint16_t pc = 0;
+    while (pc < this->length) {
+      const Instruction& in = code[pc++];
+      int32_t* a = &r[in.a];
+      int32_t b = r[in.b & (BYTECODE_REGISTERS - 1)];
+      int32_t c = r[in.c & (BYTECODE_REGISTERS - 1)];
+      switch (in.op) {
+        case OP_END: return;
+        case OP_LI: *a = immediate(in); break;
+        case OP_LIH: *a = (int32_t)(((uint32_t)*a & 0xFFFF) | (uint32_t)immediate(in) << 16); break;
+        case OP_MOV: *a = b; break;
+        case OP_ADD: *a = (int32_t)((uint32_t)b + (uint32_t)c); break;
+        case OP_SUB: *a = (int32_t)((uint32_t)b - (uint32_t)c); break;
+        case OP_MUL: *a = (int32_t)((uint32_t)b * (uint32_t)c); break;
+        case OP_MULQ: *a = (int32_t)(((int64_t)b * c) >> 16); break;
+        case OP_DIV: *a = c == -1 ? (int32_t)(0u - (uint32_t)b) : c ? b / c : 0; break;  // INT32_MIN / -1 traps
+        case OP_MIN: *a = b < c ? b : c; break;
+        case OP_MAX: *a = b > c ? b : c; break;
+        case OP_AND: *a = b & c; break;
+        case OP_OR: *a = b | c; break;
+        case OP_XOR: *a = b ^ c; break;
+        case OP_SHL: *a = (int32_t)((uint32_t)b << (c & 31)); break;
+        case OP_SHR: *a = b >> (c & 31); break;
+        case OP_ADDI: *a = (int32_t)((uint32_t)*a + (uint32_t)immediate(in)); break;
+        case OP_SIN: *a = Oscillator::sine(b); break;
+        case OP_TRI: {
+          int32_t distance = (int32_t)((uint32_t)b - 0x80000000u);  // from the middle of the cycle
+          uint32_t level = (uint32_t)(distance < 0 ? -(int64_t)distance : distance) >> 15;
+          *a = level > 65535 ? 65535 : level;
+          break;
+        }
+        case OP_PULSE: *a = Oscillator::pulse(b, c); break;
+        case OP_NOISE: *a = Noise::fractal(c, b); break;
+        case OP_ENV: {
+          uint32_t phase = b, attack = c;
+          if (phase < attack) {
+            *a = (uint32_t)(((uint64_t)phase * 65535) / attack);
+          } else {
+            *a = 65535 - (uint32_t)(((uint64_t)(phase - attack) * 65535) / (0xFFFFFFFFu - attack + 1ull));
+          }
+          break;
+        }
+        case OP_JMP: pc += in.c; break;
+        case OP_JLT: if (*a < b) pc += in.c; break;
+        case OP_JGE: if (*a >= b) pc += in.c; break;
+        case OP_JEQ: if (*a == b) pc += in.c; break;
+        case OP_JNE: if (*a != b) pc += in.c; break;
+        case OP_LEVEL: out.level = clamp(*a, 0, 65535); break;
+        case OP_DIR: out.dir = *a > 0 ? 1 : *a < 0 ? -1 : 0; break;
+        case OP_MIX: out.mix = clamp(*a, 0, 255); break;
+      }
+    }
+  }
+};
+
+
+class ProgramStore {
+
+  // The image in the patterns partition, mapped into the data address space once at boot and left there.
+  // A missing partition or a bad image just means there are no extra modes.
+
+private:
+  const ProgramImageHeader* header;
+  const ProgramEntry* entries;
+  const Instruction* code;
+  uint16_t count;
+
+public:
+  ProgramStore()
+    : header(nullptr), entries(nullptr), code(nullptr), count(0) {}
+
+  bool begin() {
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, BYTECODE_PARTITION_SUBTYPE,
+                                                                BYTECODE_PARTITION_LABEL);
+    if (partition == nullptr) {
+      LOG_INFO("No patterns partition, only the built in modes");
+      return false;
+    }
+    const void* mapped;
+    esp_partition_mmap_handle_t handle;
+    if (esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &mapped, &handle) != ESP_OK) {
+      LOG_ERROR("Could not map the patterns partition");
+      return false;
+    }
+    return open(mapped, partition->size);
+  }
+
+  bool open(const void* image, uint32_t size) {  // checks every program before any is used
+    const ProgramImageHeader* header = (const ProgramImageHeader*)image;
+    if (size < sizeof(ProgramImageHeader) || header->magic != BYTECODE_MAGIC || header->version != BYTECODE_VERSION
+        || header->count > BYTECODE_MAX_PROGRAMS) {
+      LOG_WARN("Patterns partition holds no program image");
+      return false;
+    }
+    uint32_t code_offset = sizeof(ProgramImageHeader) + header->count * sizeof(ProgramEntry);
+    if (code_offset > size) return false;
+    const ProgramEntry* entries = (const ProgramEntry*)(header + 1);
+    const Instruction* code = (const Instruction*)((const uint8_t*)image + code_offset);
+    uint32_t instructions = (size - code_offset) / sizeof(Instruction);
+    for (uint16_t i = 0; i < header->count; i++) {
+      const ProgramEntry& entry = entries[i];
+      if (entry.start + entry.length > instructions || memchr(entry.name, 0, BYTECODE_NAME_SIZE) == nullptr
+          || !BytecodeProgram::validate(code + entry.start, entry.length)) {
+        LOG_ERROR("Pattern program %u is invalid, ignoring the image", i);
+        return false;
+      }
+    }
+    this->header = header;
+    this->entries = entries;
+    this->code = code;
+    this->count = header->count;
+    LOG_INFO("Loaded %u pattern programs", this->count);
+    return true;
+  }
+
+  uint16_t getCount() const {
+    return this->count;
+  }
+
+  const char* name(uint16_t index) const {
+    return index < this->count ? this->entries[index].name : "";
+  }
+
+  BytecodeProgram program(uint16_t index) const {
+    if (index >= this->count) return BytecodeProgram();
+    return BytecodeProgram(this->code + this->entries[index].start, this->entries[index].length);
+  }
+};
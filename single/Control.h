@@ -0,0 +1,173 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "Patterns.h"
+
+// Binary control frames on the serial port, for changing the mode, colour and pattern parameters of a
+// running dress from a program (host/ledctl.cpp) instead of reflashing it. Frames and the text commands of
+// SerialConsole share the port: a frame starts with CONTROL_SYNC, which typed text never contains, and
+// every other byte goes to the console.
+//
+//   CONTROL_SYNC, type, payload length, payload, CRC-8 (poly 0x07) of type, length and payload
+//
+// Requests, with their payloads:
+//   CONTROL_SET_MODE    mode
+//   CONTROL_SET_COLOUR  1 for white, 0 for colour
+//   CONTROL_SET_PARAM   value (int32, little endian), then the parameter's name, see controlParameters
+//   CONTROL_QUERY       nothing
+// Every request is answered with a frame of its type | CONTROL_REPLY, whose payload starts with a
+// ControlStatus. A query's reply goes on with the mode, 1 if white, the number of modes, and the free heap
+// (uint32). A status of CONTROL_OK means the change is queued for the render task, which applies it at the
+// next frame; a parameter the mode playing then lacks is logged there and otherwise ignored.
+
+#define CONTROL_SYNC 0xA5
+#define CONTROL_MAX_PAYLOAD 24
+#define CONTROL_TIMEOUT_MS 100  // a frame with a gap this long in it is abandoned, so a lost byte can't hold the port
+#define CONTROL_FRAME_SIZE (CONTROL_MAX_PAYLOAD + 4)
+
+enum ControlType {
+  CONTROL_SET_MODE = 1,
+  CONTROL_SET_COLOUR = 2,
+  CONTROL_SET_PARAM = 3,
+  CONTROL_QUERY = 4,
+  CONTROL_REPLY = 0x80,  // or'd into the type of the request it answers
+};
+
+enum ControlStatus {
+  CONTROL_OK,
+  CONTROL_BAD_LENGTH,
+  CONTROL_BAD_VALUE,
+  CONTROL_UNKNOWN_PARAM,
+  CONTROL_UNKNOWN_TYPE,
+};
+
+struct ControlFrame {
+  uint8_t type;
+  uint8_t length;
+  uint8_t payload[CONTROL_MAX_PAYLOAD];
+
+  static uint8_t crc(const uint8_t* data, int length) {
+    uint8_t crc = 0;
+    for (int i = 0; i < length; i++) {
+      crc ^= data[i];
+      for (int bit = 0; bit < 8; bit++) crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+  }
+
+  int encode(uint8_t out[CONTROL_FRAME_SIZE]) const {  // the bytes to send, returns how many
+    out[0] = CONTROL_SYNC;
+    out[1] = this->type;
+    out[2] = this->length;
+    memcpy(out + 3, this->payload, this->length);
+    out[3 + this->length] = crc(out + 1, 2 + this->length);
+    return 4 + this->length;
+  }
+
+  int32_t value(int at) const {  // little endian int32 in the payload
+    return (int32_t)((uint32_t)this->payload[at] | (uint32_t)this->payload[at + 1] << 8 | (uint32_t)this->payload[at + 2] << 16
+                     | (uint32_t)this->payload[at + 3] << 24);
+  }
+
+  void setValue(int at, uint32_t value) {
+    for (int i = 0; i < 4; i++) this->payload[at + i] = value >> (8 * i);
+  }
+};
+
+struct ControlParameter {
+  const char* name;
+  uint8_t parameter;  // a PatternParameter
+};
+
+static const ControlParameter controlParameters[] = {
+  { "brightness", PARAM_BRIGHTNESS },
+  { "period_ms", PARAM_PERIOD_MS },
+  { "speed", PARAM_SPEED },
+  { "rate", PARAM_RATE },
+  { "white_share", PARAM_WHITE_SHARE },
+};
+
+inline int findControlParameter(const uint8_t* name, int length) {  // the PatternParameter, or -1
+  for (const ControlParameter& p : controlParameters) {
+    if ((int)strlen(p.name) == length && !memcmp(p.name, name, length)) return p.parameter;
+  }
+  return -1;
+}
+
+
+class ControlParser {
+
+  // Takes the port's bytes one at a time and says when a whole frame with a good CRC has arrived. It holds
+  // a single frame and never allocates; bytes outside a frame are left for the console. A frame with a bad
+  // CRC is dropped and counted, and parsing goes back to looking for CONTROL_SYNC.
+
+private:
+  enum State : uint8_t { IDLE, TYPE, LENGTH, PAYLOAD, CHECK };
+
+  ControlFrame current;
+  State state;
+  uint8_t received;
+  uint32_t last_ms;
+  uint32_t errors;
+  bool took;  // the last byte fed was part of a frame
+
+public:
+  ControlParser()
+    : current(), state(IDLE), received(0), last_ms(0), errors(0), took(false) {}
+
+  bool feed(uint8_t c, uint32_t now_ms) {  // true when c completes a frame, which frame() then holds
+    if (this->state != IDLE && now_ms - this->last_ms > CONTROL_TIMEOUT_MS) {
+      this->state = IDLE;
+      this->errors++;
+    }
+    this->last_ms = now_ms;
+    this->took = this->state != IDLE || c == CONTROL_SYNC;
+    switch (this->state) {
+      case IDLE:
+        if (c == CONTROL_SYNC) this->state = TYPE;
+        return false;
+      case TYPE:
+        this->current.type = c;
+        this->state = LENGTH;
+        return false;
+      case LENGTH:
+        if (c > CONTROL_MAX_PAYLOAD) {
+          this->state = IDLE;
+          this->errors++;
+          return false;
+        }
+        this->current.length = c;
+        this->received = 0;
+        this->state = c ? PAYLOAD : CHECK;
+        return false;
+      case PAYLOAD:
+        this->current.payload[this->received++] = c;
+        if (this->received == this->current.length) this->state = CHECK;
+        return false;
+      case CHECK:
+        {
+          this->state = IDLE;
+          uint8_t header[2 + CONTROL_MAX_PAYLOAD];
+          header[0] = this->current.type;
+          header[1] = this->current.length;
+          memcpy(header + 2, this->current.payload, this->current.length);
+          if (ControlFrame::crc(header, 2 + this->current.length) == c) return true;
+          this->errors++;
+          return false;
+        }
+    }
+    return false;
+  }
+
+  bool tookLast() const {  // the last byte fed belonged to a frame, good or not, so it is not the console's
+    return this->took;
+  }
+
+  const ControlFrame& frame() const {
+    return this->current;
+  }
+
+  uint32_t getErrors() const {
+    return this->errors;
+  }
+};
@@ -1,5 +1,13 @@
 #pragma once
 #include "LEDStrip.h"
+#include "Oscillator.h"
+#include "Noise.h"
+#include "Log.h"
+#if AUDIO_ENABLED
+#include "Audio.h"  // only the multi sketch has the audio modes, and only when it is built with them
+#endif
+
+#define CHANGES_NEVER 0xFFFFFFFF  // from nextChangeMs, the output stays as it is until the effect is reconfigured
 
 
 class Effect {
@@ -8,16 +16,34 @@ class Effect {
   // An effect should inherit from the abstract base class Effect, which enforces a common interface
   // for effects. The constructor of the derived class must take an parameters used for running the
   // effect (ex: freqency, brightness), and the update method must be overridden to acheive the desired effect.
+  // Effects live in preallocated Patterns, so every derived class also has a default constructor and a
+  // configure method taking the same arguments as its constructor, which sets the effect up again in place.
+  // nextChangeMs says how long after an update the output will next be different, so the render task can
+  // sleep instead of rendering frames that would be the same; the default of 1 means it changes every ms.
 
 protected:
-  LEDStrip ledStrip;
+  LEDStrip* ledStrip;  // the strip's shadow state, which the Pattern commits to the pins after every update
 
 public:
-  Effect(){};  // default constructor so an empty array of Effects can be initialized
+  Effect()
+    : ledStrip(nullptr){};  // default constructor so an empty array of Effects can be initialized
 
-  Effect(LEDStrip ledStrip)
+  Effect(LEDStrip* ledStrip)
     : ledStrip(ledStrip) {}
+  virtual ~Effect() {}
   void virtual update(unsigned long time_ms) {}  // takes the current time in millis()
+
+  uint32_t virtual nextChangeMs(unsigned long time_ms) {  // ms after the update at time_ms, or CHANGES_NEVER
+    return 1;
+  }
+
+  void virtual setIsWhite(bool is_white) {  // switch between white and colour without rebuilding the effect
+    if (is_white) {
+      this->ledStrip->setWhite();
+    } else {
+      this->ledStrip->setColour();
+    }
+  }
 };
 
 class FadeEffect : public Effect {
@@ -25,110 +51,109 @@ class FadeEffect : public Effect {
   // fade on and off
 
 private:
-  float frequency;    // how many oscillations per second, can be fractional
-  float phase_angle;  // in degrees
+  Oscillator oscillator;
 
 public:
+  FadeEffect(){};
+
+  FadeEffect(LEDStrip* ledStrip, float frequency, float phase_angle, bool is_white) {
+    configure(ledStrip, frequency, phase_angle, is_white);
+  }
 
-  FadeEffect(LEDStrip ledStrip, float frequency, float phase_angle, bool is_white)
-    : Effect(ledStrip), frequency(frequency), phase_angle(phase_angle) {
+  void configure(LEDStrip* ledStrip, float frequency, float phase_angle, bool is_white) {  // frequency in Hz, phase_angle in degrees
+    this->ledStrip = ledStrip;
+    this->oscillator.setWaveform(WAVE_SINE);
+    this->oscillator.setFrequency(frequency);
+    this->oscillator.setPhaseOffset(Oscillator::fractionToPhase(phase_angle / 360));
 
+    setIsWhite(is_white);
     if (is_white) {
-      Serial.println("Built white fade");
-      this->ledStrip.setWhite();
+      LOG_DEBUG("Built white fade");
     } else {
-      Serial.println("Built colour fade");
-      this->ledStrip.setColour();
+      LOG_DEBUG("Built colour fade");
     }
   }
 
   void update(unsigned long time_ms) override {
-    float time_in_seconds = time_ms / 1000.0;
-    float phase_angle_radians = PI / 180 * this->phase_angle;
-    float angle = TWO_PI * time_in_seconds * this->frequency;
-    float val = cos(angle + phase_angle_radians);  // val is -1 to 1, need to map to 0-255
-    val = (val + 1) / 2 * 255;
-    this->ledStrip.setBrightness(int(val));
+    this->oscillator.update(time_ms);
+    this->ledStrip->setLevel(this->oscillator.level());
   }
 };
 
 
-class AlternateEffect : public Effect {
+class MixEffect : public Effect {
 
-  // alternate between white and coloured with a certain frequency
-  // if freqency is set over ~30, it will look like both are on at the same time.
+  // white and colour on together. This used to be done by flipping the strip between them from loop(),
+  // which needs well over 30 flips a second to not flicker; now the LEDC time-shares the H-bridge itself.
 
 private:
-  float frequency;  // number of times per second to change between white and coloured
-  unsigned long last_time;
-  bool isWhite;
+  uint8_t white_share;  // 0-255, how much of the on time is white
+
 public:
+  MixEffect(){};
 
-  AlternateEffect(LEDStrip ledStrip, float frequency, uint8_t brightness)
-    : Effect(ledStrip), frequency(frequency) {
-    this->ledStrip.setBrightness(brightness);
-    this->last_time = 0;
-    this->isWhite = true;  // start white
+  MixEffect(LEDStrip* ledStrip, uint8_t white_share, uint8_t brightness) {
+    configure(ledStrip, white_share, brightness);
   };
 
+  void configure(LEDStrip* ledStrip, uint8_t white_share, uint8_t brightness) {
+    this->ledStrip = ledStrip;
+    this->white_share = white_share;
+    this->ledStrip->setMix(white_share);
+    this->ledStrip->setBrightness(brightness);
+    LOG_DEBUG("Built mix effect");
+  }
+
+  void setIsWhite(bool is_white) override {}  // this effect shows both
+
   void update(unsigned long time_ms) override {
+    return;
+  }
 
-    if (time_ms - this->last_time > 1. / frequency * 1000) {
-      this->isWhite = !this->isWhite;  // flip colour
-      this->last_time = time_ms;       // update last time
-      if (isWhite) {
-        this->ledStrip.setWhite();
-      } else {
-        this->ledStrip.setColour();
-      }
-    }
+  uint32_t nextChangeMs(unsigned long time_ms) override {
+    return CHANGES_NEVER;
   }
 };
 
 class BlinkEffect : public Effect {
 
+  // on for duty_cycle of every period, starting phase_ratio of the way into the period
+
 private:
-  float period;       // time in ms for pattern to repeat
-  float duty_cycle;   // [0-1] how much of the period to be on for
-  float phase_ratio;  // [0-1] offset fraction of the period
+  Oscillator oscillator;
   uint8_t brightness;
-  unsigned long last_time;
-  int delay;
-  bool is_white;
 
 public:
-  BlinkEffect(LEDStrip ledStrip, float period_ms, float duty_cycle, float phase_ratio, uint8_t brightness, bool is_white)
-    : Effect(ledStrip), period(period_ms), duty_cycle(duty_cycle), phase_ratio(phase_ratio), brightness(brightness), is_white(is_white) {
+  BlinkEffect(){};
+
+  BlinkEffect(LEDStrip* ledStrip, float period_ms, float duty_cycle, float phase_ratio, uint8_t brightness, bool is_white) {
+    configure(ledStrip, period_ms, duty_cycle, phase_ratio, brightness, is_white);
+  }
+
+  void configure(LEDStrip* ledStrip, float period_ms, float duty_cycle, float phase_ratio, uint8_t brightness, bool is_white) {
+    this->ledStrip = ledStrip;
+    this->brightness = brightness;
+    this->oscillator.setWaveform(WAVE_PULSE);
+    this->oscillator.setPeriod(period_ms);
+    this->oscillator.setDuty(duty_cycle);
+    this->oscillator.setPhaseOffset(Oscillator::fractionToPhase(-phase_ratio));  // the pulse starts phase_ratio into the period
 
-    if (is_white)
-      this->ledStrip.setWhite();
-    else
-      this->ledStrip.setColour();
-    this->ledStrip.setBrightness(brightness);
-    this->last_time = 0;
-    this->delay = this->period * this->phase_ratio;
+    setIsWhite(is_white);
+    this->ledStrip->setBrightness(brightness);
 
-    Serial.println("Built blink effect");
+    LOG_DEBUG("Built blink effect");
   }
 
   void update(unsigned long time_ms) override {
     // Serial.println("Updating blink effect");
+    this->oscillator.update(time_ms);
+    this->ledStrip->setBrightness(this->oscillator.level() ? this->brightness : 0);
+  }
 
-    unsigned long delta = time_ms - this->last_time;
-
-
-    if (delta < delay) {
-      //Serial.println("Set low");
-      this->ledStrip.setBrightness(0);
-    } else if (delta < delay + this->period * this->duty_cycle) {  // in the high time of the duty cycle
-      //Serial.println("Set high");
-      this->ledStrip.setBrightness(this->brightness);
-    } else if (delta < this->period) {  // in the low part of the duty cycle
-      //Serial.println("Set low");
-      this->ledStrip.setBrightness(0);
-    } else {
-      this->last_time = time_ms;  // time to move to the next period
-    }
+  uint32_t nextChangeMs(unsigned long time_ms) override {  // the next edge of the pulse
+    uint32_t on = this->oscillator.msUntil(0);
+    uint32_t off = this->oscillator.msUntil(this->oscillator.getDuty());
+    return on < off ? on : off;
   }
 };
 
@@ -136,55 +161,78 @@ public:
 class SolidEffect : public Effect {
 
 public:
-  SolidEffect(LEDStrip ledStrip, uint8_t brightness, bool is_white)
-    : Effect(ledStrip) {
+  SolidEffect(){};
+
+  SolidEffect(LEDStrip* ledStrip, uint8_t brightness, bool is_white) {
+    configure(ledStrip, brightness, is_white);
+  }
+
+  void configure(LEDStrip* ledStrip, uint8_t brightness, bool is_white) {
+    this->ledStrip = ledStrip;
+    setIsWhite(is_white);
     if (is_white) {
-      this->ledStrip.setWhite();
-      Serial.println("Built solid white effect");
+      LOG_DEBUG("Built solid white effect");
     } else {
-      this->ledStrip.setColour();
-      Serial.println("Built solid colour effect");
+      LOG_DEBUG("Built solid colour effect");
     }
-    this->ledStrip.setBrightness(brightness);
+    this->ledStrip->setBrightness(brightness);
   }
+
   void update(unsigned long time_ms) override {
     //Serial.println("updating solid effect");
     return;
   }
+
+  uint32_t nextChangeMs(unsigned long time_ms) override {
+    return CHANGES_NEVER;
+  }
 };
 
 
 class ChaosEffect : public Effect {
 
+  // organic flicker that swaps between white and colour, driven by seeded fixed point noise
+
 private:
-  float speed;     // how quickly the effect is modulated, should be around .002
-  float rng_seed;  // init conditions for the pattern, should be [-10, 10]
+  uint32_t speed;  // noise lattice cells per ms in 16.16 fixed point
+  uint32_t seed;   // strips with different seeds flicker independently
 
 public:
-  ChaosEffect(LEDStrip ledStrip, float speed, float rng_seed)
-    : Effect(ledStrip), speed(speed), rng_seed(rng_seed) {
+  ChaosEffect(){};
 
-    this->ledStrip.setWhite();
-    this->ledStrip.setBrightness(255);
-    Serial.println("Built chaos effect");
+  ChaosEffect(LEDStrip* ledStrip, float speed, uint32_t seed) {
+    configure(ledStrip, speed, seed);
   }
 
-  void update(unsigned long time_ms) override {
+  void configure(LEDStrip* ledStrip, float speed, uint32_t seed) {  // speed should be around .002
+    this->ledStrip = ledStrip;
+    this->speed = chaosSpeed(speed);
+    this->seed = seed;
+    this->ledStrip->setWhite();
+    this->ledStrip->setBrightness(255);
+    LOG_DEBUG("Built chaos effect");
+  }
+
+  // one noise lattice cell covers 2 radians of the old sin based chaos, so the flicker keeps the same pace
+  static uint32_t chaosSpeed(float speed) {
+    return (uint32_t)(speed * 65536 / 2 + 0.5f);
+  }
 
-    float x = time_ms % 120000;  // repeats every 2 mins, just so pattern doesn't degenerate
-    x = this->speed * x;
+  void setIsWhite(bool is_white) override {}  // this effect picks the colour itself
+
+  void update(unsigned long time_ms) override {
 
-    float sin_x = sin(pow(x, 1.1));
-    float r = sin(sin_x + x + this->rng_seed);
+    // wraps around the noise ring after 2^32 steps, which is seamless
+    int32_t r = Noise::fractal(this->seed, (uint32_t)time_ms * this->speed);  // -32768 to 32767
 
     if (r > 0) {
-      this->ledStrip.setWhite();
+      this->ledStrip->setWhite();
     } else {
-      this->ledStrip.setColour();
+      this->ledStrip->setColour();
     }
 
-    int brightness = int(abs(255 * r));
-    this->ledStrip.setBrightness(brightness);
+    int32_t magnitude = r < 0 ? -r : r;
+    this->ledStrip->setLevel(magnitude > 32767 ? 65535 : magnitude << 1);
     return;
   }
 };
@@ -193,36 +241,97 @@ public:
 class ChaosEffectSingleColor : public Effect {
 
 private:
-  float speed;     // how quickly the effect is modulated, should be around .002
-  float rng_seed;  // init conditions for the pattern, should be [-10, 10]
-  bool is_white;  // use white or multicolor for the effect
+  uint32_t speed;  // noise lattice cells per ms in 16.16 fixed point
+  uint32_t seed;   // strips with different seeds flicker independently
 
 public:
-  ChaosEffectSingleColor(LEDStrip ledStrip, float speed, float rng_seed, bool is_white)
-    : Effect(ledStrip), speed(speed), rng_seed(rng_seed), is_white(is_white) {
+  ChaosEffectSingleColor(){};
 
-    if (this->is_white) {
-      this->ledStrip.setWhite();
-    } else {
-      this->ledStrip.setColour();
-    }
+  ChaosEffectSingleColor(LEDStrip* ledStrip, float speed, uint32_t seed, bool is_white) {
+    configure(ledStrip, speed, seed, is_white);
+  }
 
-    this->ledStrip.setBrightness(255);
-    Serial.println("Built single color chaos effect");
+  void configure(LEDStrip* ledStrip, float speed, uint32_t seed, bool is_white) {  // speed should be around .002
+    this->ledStrip = ledStrip;
+    this->speed = ChaosEffect::chaosSpeed(speed);
+    this->seed = seed;
+    setIsWhite(is_white);  // use white or multicolor for the effect
+
+    this->ledStrip->setBrightness(255);
+    LOG_DEBUG("Built single color chaos effect");
   }
 
   void update(unsigned long time_ms) override {
 
-    float x = time_ms % 120000;  // repeats every 2 mins, just so pattern doesn't degenerate
-    x = this->speed * x;
-
-    float sin_x = sin(pow(x, 1.1));
-    float r = sin(sin_x + x + this->rng_seed);
+    int32_t r = Noise::fractal(this->seed, (uint32_t)time_ms * this->speed);  // -32768 to 32767
 
-    // normalize between 0 and 1
-    r = (r + 1) / 2;
-    int brightness = int(abs(255 * r));
-    this->ledStrip.setBrightness(brightness);
+    // normalize between 0 and 255
+    this->ledStrip->setLevel(r + 32768);
     return;
   }
-};
\ No newline at end of file
+};
+
+
+#if AUDIO_ENABLED
+class BandEffect : public Effect {
+
+  // as bright as one band of the sound is loud. The features are the pattern's copy for this frame, so
+  // every strip shows the same block.
+
+protected:
+  const AudioFeatures* features;
+  uint8_t band;
+
+public:
+  BandEffect()
+    : features(nullptr), band(0){};
+
+  BandEffect(LEDStrip* ledStrip, const AudioFeatures* features, uint8_t band, bool is_white) {
+    configure(ledStrip, features, band, is_white);
+  }
+
+  void configure(LEDStrip* ledStrip, const AudioFeatures* features, uint8_t band, bool is_white) {
+    this->ledStrip = ledStrip;
+    this->features = features;
+    this->band = band < AUDIO_BANDS ? band : AUDIO_BANDS - 1;
+    setIsWhite(is_white);
+    this->ledStrip->setBrightness(255);
+    LOG_DEBUG("Built band effect");
+  }
+
+  void update(unsigned long time_ms) override {
+    this->ledStrip->setLevel(this->features->band[this->band]);
+  }
+};
+
+
+class BeatSwingEffect : public BandEffect {
+
+  // a BandEffect that swaps between white and colour on every beat
+
+private:
+  bool is_white;
+
+public:
+  BeatSwingEffect()
+    : is_white(true){};
+
+  BeatSwingEffect(LEDStrip* ledStrip, const AudioFeatures* features, uint8_t band, bool is_white) {
+    configure(ledStrip, features, band, is_white);
+  }
+
+  void configure(LEDStrip* ledStrip, const AudioFeatures* features, uint8_t band, bool is_white) {
+    BandEffect::configure(ledStrip, features, band, is_white);
+    LOG_DEBUG("Built beat swing effect");
+  }
+
+  void setIsWhite(bool is_white) override {  // the colour between odd beats
+    this->is_white = is_white;
+  }
+
+  void update(unsigned long time_ms) override {
+    Effect::setIsWhite(this->is_white != (this->features->beats & 1));
+    BandEffect::update(time_ms);
+  }
+};
+#endif
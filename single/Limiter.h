@@ -0,0 +1,179 @@
+#pragma once
+#include <stdint.h>
+#include "Stats.h"
+
+// Per strip current model: what a strip draws fully on, in each direction. A mixed strip draws in between,
+// by its white share. These are the same guess as the simulator's --strip-ma, measure the real strips and
+// set them per strip with LEDStrip::setCurrentModel.
+#ifndef LIMIT_STRIP_WHITE_MA
+#define LIMIT_STRIP_WHITE_MA 60
+#endif
+#ifndef LIMIT_STRIP_COLOUR_MA
+#define LIMIT_STRIP_COLOUR_MA 60
+#endif
+#ifndef LIMIT_GLIDE_MS
+#define LIMIT_GLIDE_MS 1000  // time to slide between the peak and the sustained budget
+#endif
+#ifndef LIMIT_RELEASE_MS
+#define LIMIT_RELEASE_MS 500  // time for the frame to come back from off to full once the load drops
+#endif
+
+#define LIMIT_FULL_SCALE 65536  // a frame left as it is
+
+
+class CurrentLimiter {
+
+  // The last stage of every frame. LEDStrip::commitAll adds up what the strips would draw from their duty
+  // after gamma and their direction, and scales every strip's duty by the same factor so the total stays
+  // under the budget. Scaling the duty keeps the current exactly proportional and the strips in proportion
+  // to each other, so a limited frame only looks dimmer.
+  // There are two budgets. The peak is never exceeded, so a frame is cut back at once. The sustained one is
+  // for the battery and the H-bridges over time: a bucket fills with whatever is drawn over it, and once it is
+  // full the allowance slides down to the sustained budget, and back up once the bucket has half drained.
+  // The scale comes back up slowly after a cut, so noise peaks don't make the whole dress pump.
+  // Energy is counted from the current of each frame for as long as it was shown, whether or not the
+  // budgets are set. Everything is integer, and it costs a few multiplies per strip per frame.
+
+private:
+  uint32_t peak_ua;  // 0 for no limit
+  uint32_t sustained_ua;
+  uint64_t capacity;   // of the bucket, uA ms
+  uint64_t bucket;
+  uint32_t allowance_ua;  // what the frame may draw now, between the sustained budget and the peak
+  uint32_t glide_ua;      // allowance change per ms
+  bool tripped;           // the bucket has filled, and not yet half drained
+
+  uint32_t scale;   // of every strip's duty, LIMIT_FULL_SCALE for none
+  uint32_t target;  // the scale the last frame needed, scale rises to it by LIMIT_RELEASE_MS
+  uint32_t requested_ua;  // the last frame before and after scaling
+  uint32_t delivered_ua;
+  uint32_t last_ms;
+  bool started;
+
+  uint64_t energy;  // uA ms since boot. report() reads it without a lock, so a read mid update can be far out
+  uint32_t limited_frames;
+  uint32_t max_requested_ua;
+
+  uint32_t goal() const {
+    return this->tripped ? this->sustained_ua : this->peak_ua;
+  }
+
+  void advance(uint32_t elapsed) {  // the last frame's current, held for elapsed ms
+    this->energy += (uint64_t)this->delivered_ua * elapsed;
+    if (this->delivered_ua > this->sustained_ua) {
+      this->bucket += (uint64_t)(this->delivered_ua - this->sustained_ua) * elapsed;
+      if (this->bucket >= this->capacity) {
+        this->bucket = this->capacity;
+        this->tripped = true;
+      }
+    } else {
+      uint64_t drain = (uint64_t)(this->sustained_ua - this->delivered_ua) * elapsed;
+      this->bucket = drain < this->bucket ? this->bucket - drain : 0;
+      if (this->bucket <= this->capacity / 2) this->tripped = false;
+    }
+    uint32_t step = this->glide_ua * elapsed;
+    uint32_t goal = this->goal();
+    if (this->allowance_ua > goal) {
+      this->allowance_ua = this->allowance_ua - goal > step ? this->allowance_ua - step : goal;
+    } else {
+      this->allowance_ua = goal - this->allowance_ua > step ? this->allowance_ua + step : goal;
+    }
+  }
+
+public:
+  CurrentLimiter()
+    : peak_ua(0), sustained_ua(0), capacity(0), bucket(0), allowance_ua(0), glide_ua(0), tripped(false),
+      scale(LIMIT_FULL_SCALE), target(LIMIT_FULL_SCALE), requested_ua(0), delivered_ua(0), last_ms(0),
+      started(false), energy(0), limited_frames(0), max_requested_ua(0) {}
+
+  // peak_ma at any moment, and sustained_ma on average once burst_mas (mA s) over it has been drawn.
+  // A peak of 0 leaves every frame as it is, and only counts the energy.
+  void begin(uint32_t peak_ma, uint32_t sustained_ma, uint32_t burst_mas) {
+    if (sustained_ma > peak_ma) sustained_ma = peak_ma;
+    this->peak_ua = peak_ma * 1000;
+    this->sustained_ua = sustained_ma * 1000;
+    this->capacity = (uint64_t)burst_mas * 1000000;
+    this->bucket = 0;
+    this->tripped = false;
+    this->allowance_ua = this->peak_ua;
+    this->glide_ua = (this->peak_ua - this->sustained_ua) / LIMIT_GLIDE_MS;
+    if (this->glide_ua == 0) this->glide_ua = 1;
+    this->scale = LIMIT_FULL_SCALE;
+    this->target = LIMIT_FULL_SCALE;
+  }
+
+  // a strip of duty 0-65536 after gamma, with full_ua its draw fully on in the direction it is being driven
+  static uint32_t draw(uint32_t duty, uint32_t full_ua) {
+    return ((uint64_t)duty * full_ua) >> 16;
+  }
+
+  // the scale for a frame that would draw requested_ua, shown from now_ms
+  uint32_t limit(uint32_t requested_ua, uint32_t now_ms) {
+    uint32_t elapsed = this->started ? now_ms - this->last_ms : 0;
+    this->advance(elapsed);
+    this->started = true;
+    this->last_ms = now_ms;
+    this->requested_ua = requested_ua;
+    if (requested_ua > this->max_requested_ua) this->max_requested_ua = requested_ua;
+
+    if (this->peak_ua == 0 || requested_ua <= this->allowance_ua) {
+      this->target = LIMIT_FULL_SCALE;
+    } else {
+      this->target = ((uint64_t)this->allowance_ua << 16) / requested_ua;
+    }
+    if (this->target <= this->scale) {
+      this->scale = this->target;  // cut at once, the budget is never exceeded
+    } else {
+      uint32_t step = LIMIT_FULL_SCALE / LIMIT_RELEASE_MS * elapsed;
+      this->scale = this->target - this->scale > step ? this->scale + step : this->target;
+    }
+    if (this->scale < LIMIT_FULL_SCALE) this->limited_frames++;
+    this->delivered_ua = ((uint64_t)requested_ua * this->scale) >> 16;
+    return this->scale;
+  }
+
+  // ms after the last frame until the scale would move by itself, 0xFFFFFFFF (CHANGES_NEVER) if it won't
+  uint32_t nextChangeMs() const {
+    if (this->peak_ua == 0) return 0xFFFFFFFF;
+    if (this->scale < this->target || this->allowance_ua != this->goal()) return 1;
+    if (!this->tripped && this->delivered_ua > this->sustained_ua) {  // until the bucket fills
+      uint64_t over = this->delivered_ua - this->sustained_ua;
+      uint64_t ms = (this->capacity - this->bucket + over - 1) / over;
+      return ms < 1 ? 1 : ms < 0xFFFFFFFF ? ms : 0xFFFFFFFF;
+    }
+    if (this->tripped && this->delivered_ua < this->sustained_ua) {  // until it has half drained
+      uint64_t under = this->sustained_ua - this->delivered_ua;
+      uint64_t ms = (this->bucket - this->capacity / 2 + under - 1) / under;
+      return ms < 1 ? 1 : ms < 0xFFFFFFFF ? ms : 0xFFFFFFFF;
+    }
+    return 0xFFFFFFFF;
+  }
+
+  uint32_t getScale() const {
+    return this->scale;
+  }
+
+  uint32_t getDeliveredMa() const {  // the last frame, after scaling
+    return this->delivered_ua / 1000;
+  }
+
+  uint32_t getEnergyUah(uint32_t now_ms) const {  // up to now_ms, the last frame is still being shown
+    uint64_t energy = this->energy + (this->started ? (uint64_t)this->delivered_ua * (now_ms - this->last_ms) : 0);
+    return energy / 3600000;
+  }
+
+  uint32_t getLimitedFrames() const {
+    return this->limited_frames;
+  }
+
+  template <typename Out>
+  void report(Out& out) {  // more lines for RuntimeStats::report
+    RuntimeStats::line(out, "limit_energy_uah", getEnergyUah(millis()));
+    RuntimeStats::line(out, "limit_ma", this->delivered_ua / 1000);
+    RuntimeStats::line(out, "limit_max_requested_ma", this->max_requested_ua / 1000);
+    RuntimeStats::line(out, "limit_frames", this->limited_frames);
+    RuntimeStats::line(out, "limit_sustained", this->tripped);
+  }
+};
+
+static CurrentLimiter currentLimiter;
@@ -0,0 +1,185 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <atomic>
+#include "HardwareSerial.h"
+
+#if defined(ESP32) && !defined(HOST_BUILD)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+// Logging that never blocks the caller. LOG_ERROR/WARN/INFO/DEBUG format into a slot of a lock-free
+// ring buffer, and a low priority task drains the ring to Serial whenever the cores are otherwise idle.
+// When the ring is full the message is dropped and counted instead of waiting for the UART.
+//
+// Messages above LOG_LEVEL are compiled out completely, arguments included, so define LOG_LEVEL before
+// including this (or build with NDEBUG, which defaults it to LOG_LEVEL_NONE) for a release build.
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL LOG_LEVEL_NONE
+#else
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+#define LOG_SLOTS 32        // messages that can be waiting to be printed, a power of 2
+#define LOG_LINE_SIZE 128   // longer messages are truncated
+#define LOG_DRAIN_MS 20     // how often the log task empties the ring
+#define LOG_PRIORITY 1      // just above idle, below loop() and the render task
+#define LOG_STACK_SIZE 3072
+
+
+class Logger {
+
+  // Bounded multi-producer, single-consumer ring. Every slot carries a sequence number: a producer claims
+  // the slot at head when its sequence equals head, and publishes it by bumping the sequence; the drain
+  // only reads a slot once it has been published. Both cores can log without taking a lock.
+
+private:
+  struct Slot {
+    std::atomic<uint32_t> sequence;
+    uint8_t level;
+    char text[LOG_LINE_SIZE];
+  };
+
+  Slot slots[LOG_SLOTS];
+  std::atomic<uint32_t> head;  // next slot to claim, shared by the producers
+  uint32_t tail;               // next slot to print, only used by the drain
+  std::atomic<uint32_t> dropped;
+  uint32_t reported_dropped;
+  std::atomic<void (*)()> job;  // posted output too long for a message, run by the drain
+  uint8_t level;  // runtime filter, on top of LOG_LEVEL
+
+#if defined(ESP32) && !defined(HOST_BUILD)
+  static void drainTask(void* arg) {
+    Logger* logger = (Logger*)arg;
+    for (;;) {
+      logger->drain();
+      vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_MS));
+    }
+  }
+#endif
+
+public:
+  Logger()
+    : head(0), tail(0), dropped(0), reported_dropped(0), job(nullptr), level(LOG_LEVEL) {
+    for (uint32_t i = 0; i < LOG_SLOTS; i++) {
+      this->slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  void begin() {  // starts the drain task, on the host the sketch calls drain() itself
+#if defined(ESP32) && !defined(HOST_BUILD)
+    xTaskCreate(drainTask, "log", LOG_STACK_SIZE, this, LOG_PRIORITY, nullptr);
+#endif
+  }
+
+  void setLevel(uint8_t level) {
+    this->level = level;
+  }
+
+  uint32_t getDropped() const {
+    return this->dropped.load(std::memory_order_relaxed);
+  }
+
+  void write(uint8_t level, const char* format, ...) __attribute__((format(printf, 3, 4))) {
+    if (level > this->level) return;
+
+    uint32_t position = this->head.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+      slot = &this->slots[position & (LOG_SLOTS - 1)];
+      int32_t diff = (int32_t)(slot->sequence.load(std::memory_order_acquire) - position);
+      if (diff == 0) {
+        if (this->head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        this->dropped.fetch_add(1, std::memory_order_relaxed);  // full, the drain has not caught up
+        return;
+      } else {
+        position = this->head.load(std::memory_order_relaxed);  // another producer got there first
+      }
+    }
+
+    slot->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, LOG_LINE_SIZE, format, args);
+    va_end(args);
+    slot->sequence.store(position + 1, std::memory_order_release);
+  }
+
+  // Has the drain call job once the messages before it are printed. For output such as a trace dump that
+  // should go to Serial in one piece, from the log task, without a message landing in the middle of it.
+  // Only one job waits at a time, false if another was already waiting.
+  bool post(void (*job)()) {
+    void (*none)() = nullptr;
+    return this->job.compare_exchange_strong(none, job);
+  }
+
+  void drain() {  // prints everything published so far, only ever called from one task
+    for (;;) {
+      Slot* slot = &this->slots[this->tail & (LOG_SLOTS - 1)];
+      if (slot->sequence.load(std::memory_order_acquire) != this->tail + 1) break;
+      Serial.print(levelName(slot->level));
+      Serial.println(slot->text);
+      slot->sequence.store(this->tail + LOG_SLOTS, std::memory_order_release);
+      this->tail++;
+    }
+
+    uint32_t dropped = getDropped();
+    if (dropped != this->reported_dropped) {
+      Serial.print("[W] log dropped ");
+      Serial.print((unsigned long)(dropped - this->reported_dropped));
+      Serial.println(" messages");
+      this->reported_dropped = dropped;
+    }
+
+    void (*job)() = this->job.exchange(nullptr);
+    if (job) job();
+  }
+
+  static const char* levelName(uint8_t level) {
+    switch (level) {
+      case LOG_LEVEL_ERROR: return "[E] ";
+      case LOG_LEVEL_WARN: return "[W] ";
+      case LOG_LEVEL_INFO: return "[I] ";
+      default: return "[D] ";
+    }
+  }
+};
+
+static Logger logger;
+
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logger.write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logger.write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logger.write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logger.write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
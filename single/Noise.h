@@ -0,0 +1,44 @@
+#pragma once
+#include <stdint.h>
+
+class Noise {
+
+  // Seeded 1D coherent (value) noise in fixed point, for organic looking flicker without libm.
+  // Positions are 16.16 fixed point: the top 16 bits pick a lattice point, the bottom 16 bits are the
+  // position between it and the next. Each lattice point gets a pseudo-random value from a hash of
+  // its index and the seed, and the values are joined with a smoothstep curve.
+  // The lattice is a ring of 65536 points, so a position that overflows 32 bits carries on smoothly
+  // from the start of the ring, and there is never a visible jump.
+
+public:
+  static uint32_t hash(uint32_t x) {  // integer avalanche hash (lowbias32)
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+  }
+
+  static int32_t lattice(uint32_t seed, uint32_t i) {  // value at a lattice point, -32768 to 32767
+    return (int16_t)(hash((i & 0xFFFF) ^ (seed * 0x9E3779B9u)) >> 16);
+  }
+
+  static int32_t value(uint32_t seed, uint32_t position) {  // one octave, -32768 to 32767
+    uint32_t i = position >> 16;
+    uint32_t t = position & 0xFFFF;
+    uint32_t w = (t * t >> 16) * ((3 * 65536 - 2 * t) >> 2) >> 15;  // smoothstep 3t^2 - 2t^3, 0-32767
+    int32_t a = lattice(seed, i);
+    int32_t b = lattice(seed, i + 1);
+    return a + ((b - a) * (int32_t)w >> 15);
+  }
+
+  static int32_t fractal(uint32_t seed, uint32_t position) {  // two octaves, -32768 to 32767
+    int32_t coarse = value(seed, position);
+    int32_t fine = value(seed + 0x5bd1e995, position * 2 + 0x8000);  // doubling still wraps cleanly on the ring
+    int32_t r = (coarse * 2 + fine) / 2;  // weight 2:1 (divide by 3), then stretch by 1.5 so peaks reach full scale
+    if (r > 32767) r = 32767;
+    if (r < -32768) r = -32768;
+    return r;
+  }
+};
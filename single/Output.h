@@ -0,0 +1,72 @@
+#pragma once
+#include <stdint.h>
+#include "esp32-hal-gpio.h"
+#include "esp32-hal-ledc.h"
+#include "driver/ledc.h"
+
+#ifndef LEDC_FREQUENCY_HZ
+#define LEDC_FREQUENCY_HZ 5000  // PWM frequency of the H-bridge pins
+#endif
+#ifndef LEDC_RESOLUTION_BITS
+#define LEDC_RESOLUTION_BITS 12  // 80 MHz / 5 kHz leaves room for 13 bits, 12 keeps a margin
+#endif
+
+#define LEDC_FULL_DUTY (1 << LEDC_RESOLUTION_BITS)
+
+struct PinDrive {  // an output is on from hpoint for duty steps of every period, out of LEDC_FULL_DUTY
+  uint16_t duty;
+  uint16_t hpoint;
+};
+
+
+class OutputBackend {
+
+  // Whatever turns an H-bridge pin's PinDrive into PWM. LEDStrip works out the drives and hands them to
+  // write() as they change; a backend that sends them somewhere slower than a register can hold them and
+  // send the frame's worth together from flush(), which LEDStrip calls once a frame has been written.
+
+public:
+  virtual uint8_t attach(uint8_t pin) = 0;  // sets the pin up switched off, returns the channel to write to
+  virtual void write(uint8_t channel, PinDrive drive) = 0;
+  virtual void flush() {}
+  virtual bool stopsInLightSleep() const {  // the PWM needs the ESP32's clocks running
+    return true;
+  }
+};
+
+
+class LedcOutput : public OutputBackend {
+
+  // The ESP32's own LEDC, a channel per pin. A new duty takes effect at the start of the channel's next
+  // period, so writes need no batching. The two channels of a strip share an LEDC timer (Arduino gives
+  // channels 2k and 2k+1 the same one), so the hardware keeps them in step with no CPU per cycle.
+
+private:
+  uint8_t nextChannel;  // the ESP32 has 16 LEDC channels, 6 strips use 12
+
+public:
+  LedcOutput()
+    : nextChannel(0) {}
+
+  static LedcOutput& instance() {  // function local so it is ready before the sketch's global LEDStrips are built
+    static LedcOutput ledc;
+    return ledc;
+  }
+
+  uint8_t attach(uint8_t pin) override {
+    uint8_t channel = this->nextChannel++;
+    pinMode(pin, OUTPUT);  // set pin mode to output, (defaults to output typically, but good practice)
+    ledcSetup(channel, LEDC_FREQUENCY_HZ, LEDC_RESOLUTION_BITS);
+    ledcAttachPin(pin, channel);
+    PinDrive off = { 0, 0 };
+    write(channel, off);  // off until the first commit
+    return channel;
+  }
+
+  void write(uint8_t channel, PinDrive drive) override {  // takes effect at the start of the next period
+    ledc_mode_t mode = (ledc_mode_t)(channel / 8);
+    ledc_channel_t index = (ledc_channel_t)(channel % 8);
+    ledc_set_duty_with_hpoint(mode, index, drive.duty, drive.hpoint);
+    ledc_update_duty(mode, index);
+  }
+};
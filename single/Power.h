@@ -0,0 +1,72 @@
+#pragma once
+#include <stdint.h>
+#include "esp_pm.h"
+#include "LEDStrip.h"
+#include "Log.h"
+
+#if defined(ESP32) && !defined(HOST_BUILD)
+#include "esp_wifi.h"
+#include "esp_bt.h"
+#endif
+
+#ifndef POWER_MAX_CPU_MHZ
+#define POWER_MAX_CPU_MHZ 240
+#endif
+#ifndef POWER_MIN_CPU_MHZ
+#define POWER_MIN_CPU_MHZ 80  // the APB clock, which the LEDC runs from, stays at 80 MHz down to here
+#endif
+
+
+class PowerManager {
+
+  // Lets the chip save power while the render task sleeps through frames that would not change anything.
+  // begin() turns the radios off (SyncTransport::begin turns WiFi back on when SYNC_ENABLED) and has the power
+  // management scale the CPU clock down and light sleep whenever every task is blocked. Light sleep stops the
+  // LEDC's clock with it, so update() holds light sleep off while any pin is partway through its PWM; a strip
+  // that is fully on or fully off keeps its level through a light sleep.
+  // Power management has to be enabled in the build (CONFIG_PM_ENABLE, and CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  // for light sleep); without it begin() warns and the CPU only idles between frames.
+
+private:
+  esp_pm_lock_handle_t lock;
+  bool locked;
+
+public:
+  PowerManager()
+    : lock(nullptr), locked(false) {}
+
+  void begin() {
+#if defined(ESP32) && !defined(HOST_BUILD)
+    esp_wifi_stop();  // neither is started by the sketch, these just make sure
+    esp_bt_controller_disable();
+    esp_bt_controller_mem_release(ESP_BT_MODE_BTDM);
+#endif
+
+    esp_pm_config_esp32_t config = {};
+    config.max_freq_mhz = POWER_MAX_CPU_MHZ;
+    config.min_freq_mhz = POWER_MIN_CPU_MHZ;
+    config.light_sleep_enable = true;
+    if (esp_pm_configure(&config) != ESP_OK) {
+      LOG_WARN("Power management is not enabled in this build, the CPU will not light sleep");
+      return;
+    }
+    if (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "ledc", &this->lock) != ESP_OK) {
+      this->lock = nullptr;
+      return;
+    }
+    esp_pm_lock_acquire(this->lock);  // until the strips are known to be steady
+    this->locked = true;
+  }
+
+  void update(const LEDStrip ledStripArray[], int num_strips) {  // after every commit
+    if (this->lock == nullptr) return;
+    bool steady = LEDStrip::allSteady(ledStripArray, num_strips);
+    if (steady && this->locked) {
+      esp_pm_lock_release(this->lock);
+      this->locked = false;
+    } else if (!steady && !this->locked) {
+      esp_pm_lock_acquire(this->lock);
+      this->locked = true;
+    }
+  }
+};
@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "Output.h"
+
+// A record of every PinDrive LEDStrip hands to its output backend, so what the firmware actually sent
+// to the pins can be dumped and compared with what the same patterns do on the host (host/tracediff.cpp).
+// Recording is a couple of stores into a fixed ring, cheap enough to leave on in the dress: the frame's
+// time is read once by stamp(), and each write only packs the strip, side and drive next to it.
+//
+// Dump format, little endian, for the writes still in the ring:
+//   "LTRC", version byte, LEDC_RESOLUTION_BITS byte, event count (uint32), first event time in us (uint32)
+//   then per event: time since the event before as a varint, strip << 1 | side (1 for colour),
+//   duty as a varint, hpoint as a varint.
+// Over serial the dump follows a "TRACE" line, so it can be found in a capture of the log; the event count
+// says where it ends.
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+#ifndef TRACE_SLOTS
+#define TRACE_SLOTS 1024  // writes kept, a power of 2, 8 bytes each
+#endif
+
+#define TRACE_MAGIC "LTRC"
+#define TRACE_VERSION 1
+#define TRACE_MAX_STRIPS 64
+
+struct TraceEvent {
+  uint32_t time_us;
+  uint32_t packed;  // duty in bits 0-12, hpoint in 13-24, side in 25, strip in 26-31
+
+  uint8_t strip() const {
+    return this->packed >> 26;
+  }
+  uint8_t side() const {
+    return this->packed >> 25 & 1;
+  }
+  uint16_t duty() const {
+    return this->packed & 0x1FFF;
+  }
+  uint16_t hpoint() const {
+    return this->packed >> 13 & 0xFFF;
+  }
+};
+
+
+class TraceRecorder {
+
+  // Single producer ring: only the render task records, and dump() pauses recording while it reads, so a
+  // dump from another task never sees a half written event. When the ring is full the oldest write goes.
+
+  static_assert((TRACE_SLOTS & (TRACE_SLOTS - 1)) == 0, "TRACE_SLOTS must be a power of two");
+
+private:
+  TraceEvent events[TRACE_SLOTS];
+  std::atomic<uint32_t> head;  // writes recorded since boot
+  std::atomic<bool> paused;
+  uint32_t time_us;
+
+  template <typename Out>
+  static void writeVarint(Out& out, uint32_t value) {
+    while (value >= 0x80) {
+      out.write((uint8_t)(value | 0x80));
+      value >>= 7;
+    }
+    out.write((uint8_t)value);
+  }
+
+  template <typename Out>
+  static void writeWord(Out& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.write((uint8_t)(value >> (8 * i)));
+  }
+
+public:
+  TraceRecorder()
+    : head(0), paused(false), time_us(0) {}
+
+  void stamp(uint32_t time_us) {  // the time of the writes that follow, once a frame
+    this->time_us = time_us;
+  }
+
+  void record(uint8_t strip, uint8_t side, PinDrive drive) {
+#if TRACE_ENABLED
+    if (this->paused.load(std::memory_order_relaxed)) return;
+    uint32_t position = this->head.load(std::memory_order_relaxed);
+    TraceEvent& event = this->events[position & (TRACE_SLOTS - 1)];
+    event.time_us = this->time_us;
+    event.packed = (drive.duty & 0x1FFF) | (uint32_t)(drive.hpoint & 0xFFF) << 13 | (uint32_t)side << 25
+                   | (uint32_t)strip << 26;
+    this->head.store(position + 1, std::memory_order_release);
+#endif
+  }
+
+  uint32_t getCount() const {  // writes recorded since boot, not all of them still in the ring
+    return this->head.load(std::memory_order_acquire);
+  }
+
+  void clear() {
+    this->head.store(0, std::memory_order_release);
+  }
+
+  // Writes the ring out, oldest first, through anything with write(uint8_t) such as Serial. Recording
+  // stops until it is done, so writes made during a slow dump are lost rather than torn.
+  template <typename Out>
+  uint32_t dump(Out& out) {
+    this->paused.store(true, std::memory_order_relaxed);
+    uint32_t end = this->head.load(std::memory_order_acquire);
+    uint32_t start = end >= TRACE_SLOTS ? end - TRACE_SLOTS + 1 : 0;  // clear of a write already under way
+    const char* magic = TRACE_MAGIC;
+    for (int i = 0; i < 4; i++) out.write((uint8_t)magic[i]);
+    out.write((uint8_t)TRACE_VERSION);
+    out.write((uint8_t)LEDC_RESOLUTION_BITS);
+    writeWord(out, end - start);
+    uint32_t last_us = start < end ? this->events[start & (TRACE_SLOTS - 1)].time_us : 0;
+    writeWord(out, last_us);
+    for (uint32_t i = start; i < end; i++) {
+      const TraceEvent& event = this->events[i & (TRACE_SLOTS - 1)];
+      writeVarint(out, event.time_us - last_us);
+      out.write((uint8_t)(event.strip() << 1 | event.side()));
+      writeVarint(out, event.duty());
+      writeVarint(out, event.hpoint());
+      last_us = event.time_us;
+    }
+    this->paused.store(false, std::memory_order_relaxed);
+    return end - start;
+  }
+};
+
+static TraceRecorder traceRecorder;
@@ -0,0 +1,150 @@
+#pragma once
+#include <stdint.h>
+#include "LEDStrip.h"
+#include "Patterns.h"
+
+// Crossfades between patterns when the mode or colour changes, instead of cutting straight to the new one.
+// Patterns never render onto the real strips here: each renders into one of two banks of shadow-only
+// LEDStrips, and Crossfade blends the banks onto the real strips before committing them. A pattern being
+// configured therefore can't flash anything, and a fade costs one extra render and a blend per strip.
+
+template <int N>
+class Crossfade {
+
+  // Each strip is blended as separate white and colour levels, so a strip that changes side passes
+  // through a white and colour mix (LEDStrip::setMix) rather than dipping to off, and the H-bridge is only
+  // ever driven the ways LEDStrip allows. If the mode changes again mid-fade, the blend as it stands is
+  // frozen and faded out, so nothing jumps however quickly the pads are pressed.
+
+private:
+  LEDStrip* strips;
+  int num_strips;
+  uint32_t duration_ms;
+
+  LEDStrip buffers[2][N];  // the banks the patterns render into
+  int bank;                // bank of the incoming pattern
+  Pattern* incoming;
+  Pattern* outgoing;       // renders into the other bank, null if fading from frozen levels
+
+  struct Mix {
+    int32_t white;  // 0-65535 each
+    int32_t colour;
+  };
+
+  Mix frozen[N];  // what is being faded out when there is no outgoing pattern
+  Mix shown[N];   // levels of the last frame, frozen if a fade is interrupted
+  uint32_t start_ms;
+  bool fading;
+
+  static Mix split(const LEDStrip& strip) {
+    Mix mix;
+    mix.white = ((uint32_t)strip.getLevel() * strip.getWhiteShare() + 127) / 255;
+    mix.colour = strip.getLevel() - mix.white;
+    return mix;
+  }
+
+  void show(int i, const LEDStrip& in) {  // passes the incoming pattern straight through
+    this->strips[i].setMix(in.getWhiteShare());
+    this->strips[i].setLevel(in.getLevel());
+    this->shown[i] = split(in);
+  }
+
+  void show(int i, Mix mix, uint8_t share) {  // share is only used when both sides are off
+    int32_t level = mix.white + mix.colour;
+    if (level > 0) share = (mix.white * 255 + level / 2) / level;
+    this->strips[i].setMix(share);
+    this->strips[i].setLevel(level);
+    this->shown[i] = mix;
+  }
+
+public:
+  Crossfade()
+    : strips(nullptr), num_strips(0), duration_ms(0), bank(0), incoming(nullptr), outgoing(nullptr), start_ms(0), fading(false) {
+    Mix off = { 0, 0 };
+    for (int i = 0; i < N; i++) {
+      this->frozen[i] = off;
+      this->shown[i] = off;
+    }
+  }
+
+  void begin(LEDStrip strips[], int num_strips, uint32_t duration_ms) {
+    this->strips = strips;
+    this->num_strips = num_strips < N ? num_strips : N;
+    this->duration_ms = duration_ms;
+  }
+
+  // the pattern for the next start() is configured onto nextBuffer(), from the PatternPool of nextBank()
+  int nextBank() const {
+    return 1 - this->bank;
+  }
+
+  LEDStrip* nextBuffer() {
+    return this->buffers[nextBank()];
+  }
+
+  void start(Pattern* pattern, uint32_t time_ms) {
+    if (this->fading || this->incoming == nullptr) {  // fade out whatever is showing now
+      for (int i = 0; i < this->num_strips; i++) {
+        this->frozen[i] = this->shown[i];
+      }
+      this->outgoing = nullptr;
+    } else {
+      this->outgoing = this->incoming;
+    }
+    this->incoming = pattern;
+    this->bank = nextBank();
+    this->start_ms = time_ms;
+    this->fading = this->duration_ms > 0;
+  }
+
+  bool isFading() const {
+    return this->fading;
+  }
+
+  Pattern* current() const {  // the pattern being faded to or shown, null before the first start()
+    return this->incoming;
+  }
+
+  // ms after update(time_ms) until the strips next need a frame: every ms while fading or while a strip is
+  // still dithering a fraction of an LEDC step, otherwise whenever the incoming pattern or the current
+  // limiter next changes
+  uint32_t nextChangeMs(uint32_t time_ms) {
+    if (this->incoming == nullptr) return CHANGES_NEVER;
+    if (this->fading) return 1;
+    for (int i = 0; i < this->num_strips; i++) {
+      if (this->strips[i].changed()) return 1;
+    }
+    uint32_t next = this->incoming->nextChangeMs(time_ms);
+    uint32_t limit = currentLimiter.nextChangeMs();
+    return limit < next ? limit : next;
+  }
+
+  void update(uint32_t time_ms) {  // renders, blends and commits one frame
+    if (this->incoming == nullptr) return;
+    LEDStrip* in = this->buffers[this->bank];
+    this->incoming->render(time_ms);
+
+    uint32_t elapsed = (int32_t)(time_ms - this->start_ms) < 0 ? 0 : time_ms - this->start_ms;  // started after this frame's time
+    if (this->fading && elapsed >= this->duration_ms) {
+      this->fading = false;
+      this->outgoing = nullptr;
+    }
+
+    if (!this->fading) {
+      for (int i = 0; i < this->num_strips; i++) {
+        show(i, in[i]);
+      }
+    } else {
+      LEDStrip* out = this->buffers[1 - this->bank];
+      if (this->outgoing) this->outgoing->render(time_ms);
+      int32_t mix = elapsed * 256 / this->duration_ms;  // 0-255, how far into the incoming pattern
+      for (int i = 0; i < this->num_strips; i++) {
+        Mix from = this->outgoing ? split(out[i]) : this->frozen[i];
+        Mix to = split(in[i]);
+        Mix blend = { (from.white * (256 - mix) + to.white * mix) >> 8, (from.colour * (256 - mix) + to.colour * mix) >> 8 };
+        show(i, blend, in[i].getWhiteShare());
+      }
+    }
+    LEDStrip::commitAll(this->strips, this->num_strips);
+  }
+};
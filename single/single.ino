@@ -1,6 +1,23 @@
+#define NUMBER_OF_STRIPS 6  // defined before Patterns.h so every pattern is sized for exactly this many strips
+
 // our code
 #include "LEDStrip.h"
 #include "Patterns.h"
+#include "BakedTables.h"
+#include "Transition.h"
+#include "Scheduler.h"
+#include "CommandQueue.h"
+#include "Log.h"
+#include "Power.h"
+#include "Console.h"
+#include "Stats.h"
+#include "Control.h"
+#ifndef BENCHMARK
+#define BENCHMARK 0  // 1 prints timings of every effect, mode and mode switch over serial at boot, see Bench.h
+#endif
+#if BENCHMARK
+#include "Bench.h"
+#endif
 
 // touch settings
 #define TOUCH_PIN_MODE 4    // GPIO 4 is a touch pin, will toggle active pattern
@@ -31,7 +48,6 @@ unsigned long last_touch_time = 0;
 #define BUTTON_PIN 0
 
 
-#define NUMBER_OF_STRIPS 6
 LEDStrip ledStripArray[NUMBER_OF_STRIPS] = {
   LEDStrip(STRIP_0_WHITE, STRIP_0_COLOUR),
   LEDStrip(STRIP_1_WHITE, STRIP_1_COLOUR),
@@ -41,93 +57,354 @@ LEDStrip ledStripArray[NUMBER_OF_STRIPS] = {
   LEDStrip(STRIP_5_WHITE, STRIP_5_COLOUR),
 };
 
-Pattern* activePattern;
+#define RENDER_RATE_HZ 200        // patterns are updated at this fixed rate from a hardware timer
+#define STATS_INTERVAL_MS 10000  // how often the frame timing statistics are printed
+#define RENDER_CORE 0            // loop() and the input handling run on core 1, rendering gets core 0 to itself
+#define RENDER_PRIORITY 5        // above loop(), so input work never delays a frame
+#define RENDER_STACK_SIZE 4096
+#define TRANSITION_MS 400       // mode and colour changes crossfade over this long
+#define CURRENT_PEAK_MA (50 * NUMBER_OF_STRIPS)       // the strips together never draw more than this, see Limiter.h
+#define CURRENT_SUSTAINED_MA (40 * NUMBER_OF_STRIPS)  // nor more than this on average, once the burst is used up
+#define CURRENT_BURST_MAS (100 * NUMBER_OF_STRIPS)    // mA s over the sustained budget before it applies
+#define INPUT_POLL_MS 10         // how often loop() checks the button
+RenderScheduler renderScheduler;  // sleeps instead of rendering while the pattern is not changing
+PowerManager power;
+unsigned long last_stats_time = 0;
+
+// Input and rendering only share the command queue: loop() pushes mode changes,
+// and the render task applies them between frames. The render task owns the crossfade and the patterns.
+SpscQueue<Command, 16> commandQueue;
+
+// every pattern is preallocated here, mode changes reconfigure one in place. There are two pools so the
+// incoming pattern of a crossfade never reconfigures the outgoing one, whichever modes they are.
+PatternPool patternPools[2];
+Crossfade<NUMBER_OF_STRIPS> crossfade;
+ProgramStore programStore;  // more modes, run from the patterns partition without reflashing the sketch
+SerialConsole console;  // "trace" dumps the last pin writes (Trace.h), "stats" prints the counters (Stats.h)
+ControlParser control;  // binary frames from host/ledctl on the same port, see Control.h
+SpscQueue<ControlFrame, 4> controlReplies;  // from loop() to the log task, the only task that prints
+bool replies_waiting = false;  // loop() side, until the log task has been asked to send them
+#if BENCHMARK
+Benchmark benchmark;
+#endif
 
-#define TOTAL_MODES 6
+// the Arduino IDE generates these prototypes, they are written out so the sketch also builds as plain C++ on the host
+Pattern* selectActivePattern(int mode, bool is_white, LEDStrip ledStripArray[], int num_strips, PatternPool& patternPool);
+void switchPattern();
+void reportModeSwitch(unsigned long switch_start);
+bool gotButton(int pin);
+void renderTask(void* arg);
+void renderFrame();
+bool applyCommands();
+void sendCommand(const Command& command);
+void setParameter(uint8_t parameter, int32_t value);
+void handleConsole(const char* line);
+void dumpTrace();
+void dumpStats();
+void handleControl(const ControlFrame& frame);
+void replyControl(const ControlFrame& request, uint8_t status);
+void sendControlReplies();
+
+#define TOTAL_MODES 6  // built in, the programs in the patterns partition come after these
 int mode = 0;
-bool is_white = true;  // should be true for white, false for colour
+const bool is_white = true;  // This supports single colour only
+
+// what the render task is showing, only touched by the render task
+int render_mode = 0;
 
 void setup() {
   // put your setup code here, to run once:
   Serial.begin(115200);  // for debug prints
+  logger.begin();  // log messages are printed from a low priority task, never from the render path
 
   pinMode(TOUCH_PIN_MODE, INPUT);
   pinMode(TOUCH_PIN_COLOR, INPUT);
   pinMode(BUTTON_PIN, INPUT); 
   pinMode(LED_BUILTIN, OUTPUT);
 
-  // TODO: disable wifi and bluetooth, reduces power draw
+  power.begin();  // radios off, and the CPU slows down and light sleeps while nothing needs it
+  currentLimiter.begin(CURRENT_PEAK_MA, CURRENT_SUSTAINED_MA, CURRENT_BURST_MAS);
   mode = 0;
-  const bool is_white = true;  // This supports single colour only
-  activePattern = selectActivePattern(mode, is_white, ledStripArray, NUMBER_OF_STRIPS);
+  programStore.begin();
+#if BENCHMARK
+  runBenchmarks(benchmark, BENCH_RUNS, ledStripArray, NUMBER_OF_STRIPS, patternPools[0], selectActivePattern,
+                TOTAL_MODES + programStore.getCount());
+#endif
+  crossfade.begin(ledStripArray, NUMBER_OF_STRIPS, TRANSITION_MS);
+  switchPattern();  // fades in from off
+
+#ifdef HOST_BUILD
+  renderScheduler.begin(RENDER_RATE_HZ, CATCH_UP_SKIP);  // there is no second core on the host, loop() renders inline
+#else
+  xTaskCreatePinnedToCore(renderTask, "render", RENDER_STACK_SIZE, nullptr, RENDER_PRIORITY, nullptr, RENDER_CORE);
+#endif
 }
 
 
 void loop() {
-  unsigned long time_ms = millis();  // get current time
-  
-  if (gotButton(BUTTON_PIN)) {    // check if we got a touch, if we did, change mode
+  // input only, rendering happens in renderTask on the other core
+  runtimeStats.loopStarted(micros());
+  uint32_t input_start = RuntimeStats::now();
+  bool pressed = gotButton(BUTTON_PIN);
+  runtimeStats.recordInput(RuntimeStats::now() - input_start);
+  if (pressed) {    // check if we got a touch, if we did, change mode
     mode++;
-    mode %= TOTAL_MODES;
-    delete activePattern;  // delete data that will have its reference overwritten, prevent memory leak
-    activePattern = selectActivePattern(mode, is_white, ledStripArray, NUMBER_OF_STRIPS);
+    mode %= TOTAL_MODES + programStore.getCount();
+    Command command = { CMD_SET_MODE, mode };
+    sendCommand(command);
     digitalWrite(LED_BUILTIN, HIGH);
+  } else {
+    digitalWrite(LED_BUILTIN, LOW);  // the LED stays on for one poll per press
+  }
+
+  while (Serial.available() > 0) {  // control frames and commands typed into the serial monitor share the port
+    uint8_t c = Serial.read();
+    if (control.feed(c, millis())) {
+      handleControl(control.frame());
+    } else if (!control.tookLast()) {
+      const char* line = console.feed(c);
+      if (line) handleConsole(line);
+    }
+  }
+  if (replies_waiting && logger.post(sendControlReplies)) replies_waiting = false;  // or try again next poll
+
+#ifdef HOST_BUILD
+  renderFrame();  // waits for the next simulated tick, which is what paces the host loop
+  logger.drain();  // and there is no log task either
+#else
+  delay(INPUT_POLL_MS);  // gives core 1 back to the idle task between polls
+#endif
+}
+
+
+void handleConsole(const char* line) {
+  if (!strcmp(line, "trace")) {
+    if (!logger.post(dumpTrace)) LOG_WARN("Still printing the last report");
+  } else if (!strcmp(line, "stats")) {
+    if (!logger.post(dumpStats)) LOG_WARN("Still printing the last report");
+  } else {
+    LOG_WARN("Unknown command: %s", line);
+  }
+}
+
+
+void dumpTrace() {  // run by the log task, so the binary goes out in one piece after the messages before it
+  Serial.println("TRACE");
+  uint32_t count = traceRecorder.dump(Serial);
+  Serial.println();
+  LOG_INFO("Dumped %u pin writes", count);
+}
+
+
+void handleControl(const ControlFrame& frame) {  // queues the change for the render task and answers at once
+  switch (frame.type) {
+    case CONTROL_SET_MODE:
+      {
+        if (frame.length != 1) return replyControl(frame, CONTROL_BAD_LENGTH);
+        if (frame.payload[0] >= TOTAL_MODES + programStore.getCount()) return replyControl(frame, CONTROL_BAD_VALUE);
+        mode = frame.payload[0];
+        Command command = { CMD_SET_MODE, mode };
+        sendCommand(command);
+        return replyControl(frame, CONTROL_OK);
+      }
+    case CONTROL_SET_PARAM:
+      {
+        if (frame.length < 5) return replyControl(frame, CONTROL_BAD_LENGTH);
+        int parameter = findControlParameter(frame.payload + 4, frame.length - 4);
+        if (parameter < 0) return replyControl(frame, CONTROL_UNKNOWN_PARAM);
+        Command command = { CMD_SET_PARAM, frame.value(0), (uint8_t)parameter };
+        sendCommand(command);
+        return replyControl(frame, CONTROL_OK);
+      }
+    case CONTROL_QUERY:
+      return replyControl(frame, CONTROL_OK);
+    default:
+      return replyControl(frame, CONTROL_UNKNOWN_TYPE);
+  }
+}
+
+
+void replyControl(const ControlFrame& request, uint8_t status) {
+  ControlFrame reply;
+  reply.type = request.type | CONTROL_REPLY;
+  reply.length = 1;
+  reply.payload[0] = status;
+  if (request.type == CONTROL_QUERY) {
+    reply.payload[1] = mode;
+    reply.payload[2] = is_white;
+    reply.payload[3] = TOTAL_MODES + programStore.getCount();
+    reply.setValue(4, ESP.getFreeHeap());
+    reply.length = 8;
+  }
+  if (!controlReplies.push(reply)) LOG_WARN("Control replies are not being sent");
+  replies_waiting = true;
+}
+
+
+void sendControlReplies() {  // run by the log task, so a reply never lands in the middle of a message
+  ControlFrame reply;
+  uint8_t bytes[CONTROL_FRAME_SIZE];
+  while (controlReplies.pop(reply)) {
+    Serial.write(bytes, reply.encode(bytes));
   }
+}
+
+
+void dumpStats() {  // run by the log task too, the report is longer than a message
+  runtimeStats.report(Serial, TOTAL_MODES + programStore.getCount());
+  currentLimiter.report(Serial);
+}
+
+
+void renderTask(void* arg) {
+  renderScheduler.begin(RENDER_RATE_HZ, CATCH_UP_SKIP);  // the tick source wakes whichever task calls begin()
+  for (;;) {
+    renderFrame();
+  }
+}
+
 
-  activePattern->update(time_ms);  // continually update the active pattern
-  delay(1);                        // give processor some chill time, may remove
-  digitalWrite(LED_BUILTIN, LOW);
+void renderFrame() {
+  // wait for the render timer, pick up any mode change at the frame boundary, then render
+  uint32_t frames = renderScheduler.waitForFrame();
+  if (applyCommands()) {
+    renderScheduler.endIdle();
+    if (frames == 0) frames = 1;
+  }
+  if (frames == 0) return;  // woken from an idle with nothing to do
+
+  uint32_t frame_start = RuntimeStats::now();
+  unsigned long time_ms = millis();  // get current time
+  unsigned long frame_ms = renderScheduler.getPeriodUs() / 1000;
+  for (uint32_t i = frames; i > 0; i--) {
+    crossfade.update(time_ms - (i - 1) * frame_ms);  // catching up replays missed ticks at their own times
+  }
+  uint32_t render_us = RuntimeStats::now() - frame_start;
+  renderScheduler.frameDone();
+  power.update(ledStripArray, NUMBER_OF_STRIPS);
+  renderScheduler.idleFor(crossfade.nextChangeMs(time_ms));  // nothing to render until the output next changes
+  runtimeStats.recordFrame(render_mode, render_us, RuntimeStats::now() - frame_start);
+
+  if (time_ms - last_stats_time >= STATS_INTERVAL_MS) {
+    last_stats_time = time_ms;
+    renderScheduler.printStats();
+    renderScheduler.resetStats();
+  }
 }
 
 
-Pattern* selectActivePattern(int mode, bool is_white, LEDStrip ledStripArray[], int num_strips) {
+bool applyCommands() {  // true if there were any
+  Command command;
+  bool applied = false;
+  while (commandQueue.pop(command)) {
+    applied = true;
+    unsigned long switch_start = RuntimeStats::now();
+    switch (command.type) {
+      case CMD_SET_MODE:
+        render_mode = command.value;
+        switchPattern();
+        break;
+      case CMD_SET_COLOUR:  // never sent, this sketch is single colour
+        continue;
+      case CMD_SET_PARAM:
+        setParameter(command.parameter, command.value);
+        continue;  // not a mode switch
+    }
+    reportModeSwitch(switch_start);
+  }
+  return applied;
+}
+
+
+void setParameter(uint8_t parameter, int32_t value) {  // on the live pattern, which carries on from this frame
+  Pattern* pattern = crossfade.current();
+  if (pattern && pattern->setParameter(parameter, value)) {
+    LOG_INFO("Set parameter %u to %d", parameter, (int)value);
+  } else {
+    LOG_WARN("Mode %d has no parameter %u, or not %d", render_mode, parameter, (int)value);
+  }
+}
+
+
+void sendCommand(const Command& command) {  // from loop(), to the render task
+  commandQueue.push(command);
+  renderScheduler.wake();
+}
+
+
+void switchPattern() {
+  // configure the pattern for the render mode in the bank the crossfade is not showing, then fade to it
+  Pattern* pattern = selectActivePattern(render_mode, is_white, crossfade.nextBuffer(), NUMBER_OF_STRIPS,
+                                         patternPools[crossfade.nextBank()]);
+  if (!pattern) {  // a mode with no program behind it, keep showing what is there
+    LOG_WARN("No mode %d to switch to, staying on the current pattern", render_mode);
+    return;
+  }
+  crossfade.start(pattern, millis());
+}
+
+
+Pattern* selectActivePattern(int mode, bool is_white, LEDStrip ledStripArray[], int num_strips, PatternPool& patternPool) {
   Pattern* pattern;
-  Serial.println(mode);
   switch (mode) {
 
     case 0:  // solid white or colour
       {
         uint8_t brightness = 255;
-        Serial.println("Selecting mode 0");
-        pattern = new SolidPattern(ledStripArray, num_strips, brightness, is_white);
+        LOG_INFO("Selecting mode 0");
+        patternPool.solid.configure(ledStripArray, num_strips, brightness, is_white);
+        pattern = &patternPool.solid;
         return pattern;
       }
     case 1:  // off
       {
         uint8_t brightness = 0;
-        Serial.println("Selecting mode 1");
-        pattern = new SolidPattern(ledStripArray, num_strips, brightness, is_white);
+        LOG_INFO("Selecting mode 1");
+        patternPool.solid.configure(ledStripArray, num_strips, brightness, is_white);
+        pattern = &patternPool.solid;
         return pattern;
       }
     case 2:  // wave
       {
-        Serial.println("Selecting mode 2");
-        float frequency = 1.;  // Hz
-        pattern = new WavePattern(ledStripArray, num_strips, frequency, is_white);
+        LOG_INFO("Selecting mode 2");
+        patternPool.baked.configure(ledStripArray, num_strips, &BAKED_WAVE, is_white);  // 1 Hz
+        pattern = &patternPool.baked;
         return pattern;
       }
     case 3:  // slow wave
       {
-        Serial.println("Selecting mode 3");
-        float frequency = .25;  // Hz
-        pattern = new WavePattern(ledStripArray, num_strips, frequency, is_white);
+        LOG_INFO("Selecting mode 3");
+        patternPool.baked.configure(ledStripArray, num_strips, &BAKED_SLOW_WAVE, is_white);  // 0.25 Hz
+        pattern = &patternPool.baked;
         return pattern;
       }
     case 4:  // sequence
       {
-        Serial.println("Selecting mode 4");
+        LOG_INFO("Selecting mode 4");
         int period_ms = 6000;
         uint8_t brightness = 255;
-        pattern = new SequencePattern(ledStripArray, num_strips, period_ms, brightness, is_white);
+        patternPool.sequence.configure(ledStripArray, num_strips, period_ms, brightness, is_white);
+        pattern = &patternPool.sequence;
         return pattern;
       }
     case 5:  // chaos
       {
-        Serial.println("Selecting mode 5");
-        pattern = new ChaosPatternSingleColor(ledStripArray, num_strips, is_white);
+        LOG_INFO("Selecting mode 5");
+        patternPool.chaosSingleColor.configure(ledStripArray, num_strips, is_white);
+        pattern = &patternPool.chaosSingleColor;
+        return pattern;
+      }
+    default:  // a program from the patterns partition
+      {
+        int index = mode - TOTAL_MODES;
+        if (index >= programStore.getCount()) break;
+        LOG_INFO("Selecting mode %d, program %s", mode, programStore.name(index));
+        patternPool.bytecode.configure(ledStripArray, num_strips, programStore.program(index), is_white);
+        pattern = &patternPool.bytecode;
         return pattern;
       }
   }
+  return nullptr;  // mode is always kept below TOTAL_MODES plus the number of programs
 }
 
 bool gotButton(int pin) {
@@ -138,10 +415,17 @@ bool gotButton(int pin) {
   unsigned long current_time = millis();
   if (!val && current_time - last_touch_time > TOUCH_DELAY_MS) {
     last_touch_time = current_time;
-    Serial.print("Got touch for pin ");
-    Serial.println(pin);
+    LOG_DEBUG("Got touch for pin %d", pin);
     return true;
   } else {
     return false;
   }
 }
+
+void reportModeSwitch(unsigned long switch_start) {
+  // how long the switch took, and the heap, which should not move now that patterns are preallocated
+  unsigned long switch_time = (uint32_t)(RuntimeStats::now() - switch_start);
+  runtimeStats.recordModeSwitch(switch_time);
+  LOG_INFO("Mode switch took %lu us, free heap %u, min free heap %u", switch_time, (unsigned)ESP.getFreeHeap(),
+           (unsigned)ESP.getMinFreeHeap());
+}
\ No newline at end of file